@@ -25,23 +25,19 @@ bool EventAgglomerateClustering::hasAttributeAtIndex(size_t index, const string&
 }
 
 void EventAgglomerateClustering::addAttributeAtIndex(size_t index, const string& key, const int attr_index) {
-    if(!hasAttributeAtIndex(index, key)) {
-      attribute_lists[index][key] = unordered_set<size_t>();
-    }
-    attribute_lists[index][key].insert(attr_index);
+    attribute_lists[index][key].insert((uint32_t)attr_index);
 }
 
 
-void EventAgglomerateClustering::insertDataIntoTree(double start_time, double end_time, string primitive_name, string interval_id) {
+void EventAgglomerateClustering::insertDataIntoTree(double start_time, double end_time, uint32_t primitive_index, uint32_t id_index) {
     if (start_time > end_time) {
         PRINTLOG("Invalid time range: start_time > end_time");
         return;
     }
-    data.push_back(EventDict{{"time",start_time},{"primitive", primitive_name},{"ID", interval_id}});
-    data.push_back(EventDict{{"time",end_time},{"primitive", primitive_name},{"ID", interval_id}});
+    data.push((int64_t)start_time, (int64_t)end_time, primitive_index, id_index);
 }
 
-void EventAgglomerateClustering::buildAggCluster(AttributeDict& event_data_attributes) {
+void EventAgglomerateClustering::buildAggCluster() {
     // Implement the agglomerate clustering algorithm here
     // This is a placeholder for the actual clustering logic
     PRINTLOG("Building Agglomerate Clusters...");
@@ -56,10 +52,10 @@ void EventAgglomerateClustering::buildAggCluster(AttributeDict& event_data_attri
     
     for (i=0; i<npoints; i++) {
         for (j=i+1; j<npoints; j++) {
-        distmat[k] = distance_event(getEventTime(data[i*2]), 
-                                    getEventTime(data[(i*2)+1]), 
-                                    getEventTime(data[j*2]),
-                                    getEventTime(data[(j*2)+1]));
+        distmat[k] = distance_event(data.time(i*2), 
+                                    data.time((i*2)+1), 
+                                    data.time(j*2),
+                                    data.time((j*2)+1));
         k++;
         }
     }
@@ -78,26 +74,20 @@ void EventAgglomerateClustering::buildAggCluster(AttributeDict& event_data_attri
     for (i=0; i<npoints-1; i++) {
       left_node_index = changeMerge(merge[i], npoints);
       if(left_node_index < npoints) {
-        start_events[left_node_index] = getEventTime(data[left_node_index*2]);
-        end_events[left_node_index] = getEventTime(data[(left_node_index*2)+1]);
+        start_events[left_node_index] = data.time(left_node_index*2);
+        end_events[left_node_index] = data.time((left_node_index*2)+1);
 
-        for (const auto& [key, indexes] : data[left_node_index*2]) {
-          if (key == "time") continue;
-          size_t attr_index = event_data_attributes[key].get_track_index(get<string>(indexes));
-          addAttributeAtIndex(left_node_index, key, attr_index);
-        }
+        addAttributeAtIndex(left_node_index, "primitive", data.primitive(left_node_index*2));
+        addAttributeAtIndex(left_node_index, "ID", data.id(left_node_index*2));
       }
 
       right_node_index = changeMerge(merge[i+npoints-1], npoints);
       if(right_node_index < npoints) {
-        start_events[right_node_index] = getEventTime(data[right_node_index*2]);
-        end_events[right_node_index] = getEventTime(data[(right_node_index*2)+1]);
+        start_events[right_node_index] = data.time(right_node_index*2);
+        end_events[right_node_index] = data.time((right_node_index*2)+1);
 
-        for (const auto& [key, indexes] : data[right_node_index*2]) {
-          if (key == "time") continue;
-          size_t attr_index = event_data_attributes[key].get_track_index(get<string>(indexes));
-          addAttributeAtIndex(right_node_index, key, attr_index);
-        }
+        addAttributeAtIndex(right_node_index, "primitive", data.primitive(right_node_index*2));
+        addAttributeAtIndex(right_node_index, "ID", data.id(right_node_index*2));
       }
 
       if(end_events[left_node_index] > start_events[right_node_index]) {
@@ -109,12 +99,10 @@ void EventAgglomerateClustering::buildAggCluster(AttributeDict& event_data_attri
       end_events[root_node_index] = end_events[right_node_index];
 
       for (const auto& [key, indexes] : attribute_lists[left_node_index]) {
-        for (size_t index : indexes)
-          addAttributeAtIndex(root_node_index, key, index);
+        attribute_lists[root_node_index][key].unionWith(indexes);
       }
       for (const auto& [key, indexes] : attribute_lists[right_node_index]) {
-        for (size_t index : indexes)
-          addAttributeAtIndex(root_node_index, key, index);
+        attribute_lists[root_node_index][key].unionWith(indexes);
       }
     }
     
@@ -127,9 +115,9 @@ int EventAgglomerateClustering::searchEvent(int64_t tb, int begin_index) {
   int s_begin = 0;
   while(left < right) {
     int mid = (left + right) / 2;
-    if(getEventTime(data[(mid*2)+1]) < tb) {
+    if(data.time((mid*2)+1) < tb) {
       left = mid + 1;
-    } else if(getEventTime(data[mid*2]) > tb) {
+    } else if(data.time(mid*2) > tb) {
       right = mid - 1;
     } else {
       s_begin = mid;
@@ -162,7 +150,7 @@ void EventAgglomerateClustering::findClusters(int64_t start_t, int64_t end_t, in
         PRINTLOG("Attribute not found at index: " << root_node << ", key: " << return_attribute_key);
         return;
       }
-      results.push_back((int64_t)(*attribute_lists[root_node][return_attribute_key].begin()));
+      results.push_back((int64_t)attribute_lists[root_node][return_attribute_key].first());
     } else {
       results.push_back(start_time);
       results.push_back(end_time);
@@ -182,7 +170,7 @@ void EventAgglomerateClustering::findClusters(int64_t start_t, int64_t end_t, in
         PRINTLOG("Attribute not found at index: " << root_node << ", key: " << return_attribute_key);
         return;
       }
-      results.push_back((int64_t)(*attribute_lists[root_node][return_attribute_key].begin()));
+      results.push_back((int64_t)attribute_lists[root_node][return_attribute_key].first());
     } else {
       results.push_back(start_time);
       results.push_back(end_time);
@@ -201,38 +189,13 @@ void EventAgglomerateClustering::findClusters(int64_t start_t, int64_t end_t, in
 }
 
 vector<double> EventAgglomerateClustering::binnedRangeQuery(int64_t time_begin, int64_t time_end, uint64_t bins, int hrd) {
-  vector<double> results(bins);
   uint64_t bin_size(getBinSize(time_begin, time_end, bins));
   PRINTLOG("Got AGC binned range query");
 
   vector<int64_t> data_short_list;
   findClusters(time_begin, time_end, (int64_t)bin_size*hrd, npoints-2, data_short_list);
 
-  for(long unsigned int i = 0; i < data_short_list.size(); i+=2) {
-    int64_t start_time = data_short_list[i];
-    int64_t end_time = data_short_list[i+1]; 
-    
-    if(end_time < time_begin || start_time > time_end) continue;
-
-
-    if(start_time < time_begin) start_time = time_begin;
-    if(start_time > time_end) continue;
-    if(end_time < time_begin) continue;
-    if(end_time > time_end) end_time = time_end;
-    int64_t startingBin = getBinNumber(time_begin, time_end, bins, start_time);
-    int64_t endingBin = getBinNumber(time_begin, time_end, bins, end_time);
-    if(startingBin < 0 || endingBin < 0) continue;
-
-    for(int64_t bin_it = startingBin+1;
-    bin_it < endingBin && bin_it < (int64_t)bins && results[bin_it] < 0.5; 
-    bin_it++)
-    results[bin_it] = 1.0;
-    
-    if(startingBin < (int64_t)bins && results[startingBin] < 0.5) 
-      results[startingBin] = (start_time % bin_size)?0.5:1.0;
-    if(endingBin < (int64_t)bins && results[endingBin] < 0.5)
-      results[endingBin] = (end_time % bin_size)?0.5:1.0;
-  }
+  vector<double> results = rasterizeClusters(data_short_list, time_begin, time_end, bins);
   
   data_short_list.clear();
   filters.clear();
@@ -244,7 +207,7 @@ bool EventAgglomerateClustering::checkFilterSatisfied(const size_t node_id, cons
   try {
     for (const auto& [key, value] : filter) {
         if (!(hasAttributeAtIndex(node_id, key))) return false;
-        if (!attribute_lists[node_id].at(key).count(get<size_t>(value))) return false;
+        if (!attribute_lists[node_id].at(key).contains((uint32_t)get<size_t>(value))) return false;
     }
   } catch (...) {
     return true;
@@ -277,25 +240,47 @@ void AgglomerateClusters::insertDataIntoTree(double start_time,
                                              string track, 
                                              string primitive_name,
                                              string interval_id) {
-  if(agglomerate_clusters.find(track) == agglomerate_clusters.end()) {
-    agglomerate_clusters[track] = EventAgglomerateClustering();
-    agglomerate_clusters[track].track = track;
-  }
-  agglomerate_clusters[track].insertDataIntoTree(start_time, end_time, primitive_name, interval_id);
+  EventAgglomerateClustering* cluster = trackClustering(track);
   if(event_data_attributes.find("primitive") == event_data_attributes.end()) {
       event_data_attributes.insert(make_pair("primitive", StringIndexMapper()));
   }
-  event_data_attributes["primitive"].insert(primitive_name);
+  size_t primitive_index = event_data_attributes["primitive"].insert(primitive_name);
 
   if(event_data_attributes.find("ID") == event_data_attributes.end()) {
       event_data_attributes.insert(make_pair("ID", StringIndexMapper()));
   }
-  event_data_attributes["ID"].insert(interval_id);
+  size_t id_index = event_data_attributes["ID"].insert(interval_id);
+  cluster->insertDataIntoTree(start_time, end_time, (uint32_t)primitive_index, (uint32_t)id_index);
+}
+
+// clustering of the track, a new track gets an empty one
+EventAgglomerateClustering* AgglomerateClusters::trackClustering(const string& track) {
+  if(agglomerate_clusters.find(track) == agglomerate_clusters.end()) {
+    agglomerate_clusters[track] = EventAgglomerateClustering();
+    agglomerate_clusters[track].track = track;
+  }
+  return &agglomerate_clusters[track];
+}
+
+void AgglomerateClusters::insertIntervalChunk(const IntervalChunk& chunk) {
+  forEachChunkInterval(chunk, event_data_attributes["primitive"], event_data_attributes["ID"],
+    [this](const string& track) { return trackClustering(track); },
+    [](EventAgglomerateClustering* cluster, int64_t start_time, int64_t end_time, uint32_t primitive_index, uint32_t id_index) {
+      cluster->insertDataIntoTree((double)start_time, (double)end_time, primitive_index, id_index);
+    });
+}
+
+void AgglomerateClusters::insertIntervalFile(const IntervalFile& file) {
+  forEachFileInterval(file, event_data_attributes["primitive"], event_data_attributes["ID"],
+    [this](const string& track) { return trackClustering(track); },
+    [](EventAgglomerateClustering* cluster, int64_t start_time, int64_t end_time, uint32_t primitive_index, uint32_t id_index) {
+      cluster->insertDataIntoTree((double)start_time, (double)end_time, primitive_index, id_index);
+    });
 }
 
 void AgglomerateClusters::buildAllAggClusters() {
   for(auto it = agglomerate_clusters.begin(); it != agglomerate_clusters.end(); it++) {
-    it->second.buildAggCluster(event_data_attributes);
+    it->second.buildAggCluster();
     PRINTLOG("building agglomerate cluster for: " << it->first);
   }
 }
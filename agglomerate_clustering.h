@@ -2,6 +2,7 @@
 #define AGGLOMERATE_CLUSTERING_H_
 
 #include "eseman_commons.h"
+#include "eseman_interval_file.h"
 
 inline int changeMerge(int i, int N){
   if (i < 0) {
@@ -12,10 +13,10 @@ inline int changeMerge(int i, int N){
 }
 
 // this is a one dimensional agglomerate clustering for event sequences.
-// Start and end events will be stored in a vector, even number index will hold the start event and odd number index will hold the end event.
+// Start and end events are stored in EventColumns, even number index holds the start event and odd number index holds the end event.
 class EventAgglomerateClustering {
   private:
-    vector<EventDict> data;
+    EventColumns data;
     int* merge = NULL;
     double* height = NULL;
     int* node_size = NULL;
@@ -46,8 +47,8 @@ class EventAgglomerateClustering {
       attribute_lists.clear();
     }
 
-    void insertDataIntoTree(double start_time, double end_time, string primitive_name, string interval_id);
-    void buildAggCluster(AttributeDict& event_data_attributes);
+    void insertDataIntoTree(double start_time, double end_time, uint32_t primitive_index, uint32_t id_index);
+    void buildAggCluster();
     vector<double> binnedRangeQuery(int64_t time_begin, int64_t time_end, uint64_t bins, int hrd);
     int64_t findNearestEvent(uint64_t cTime);
 
@@ -67,6 +68,8 @@ class AgglomerateClusters {
     map<string, EventAgglomerateClustering> agglomerate_clusters;
     AttributeDict                           event_data_attributes;
 
+    EventAgglomerateClustering* trackClustering(const string& track);
+
   public:
     int horizontal_resolution_divisor = 1;
     EventDictList filters;
@@ -79,6 +82,8 @@ class AgglomerateClusters {
       // Memory cleanup logic for AgglomerateClusters
     }
     void insertDataIntoTree(double start_time, double end_time, string track, string primitive_name, string interval_id);
+    void insertIntervalChunk(const IntervalChunk& chunk);
+    void insertIntervalFile(const IntervalFile& file);
     void buildAllAggClusters();
     LocDict binnedRangeQuery(int64_t time_begin, 
       int64_t time_end, 
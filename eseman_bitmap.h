@@ -0,0 +1,473 @@
+#ifndef ESEMAN_BITMAP_H
+#define ESEMAN_BITMAP_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// =======================================
+// Compressed sets of dictionary indices
+// =======================================
+// Every node keeps the primitive and ID indices of all intervals beneath it, so the sets near the root of a
+// track hold a large part of the dictionaries. EsemanBitmap stores them the way roaring bitmaps do: a value is
+// split into its high 16 bits, which select a container, and its low 16 bits, which the container holds either
+// as a sorted array while it has at most ESEMAN_BITMAP_ARRAY_MAX of them or as a 65536 bit bitmap. Unions run
+// container by container and OR whole words once a container is dense.
+//
+// Serialized, a bitmap starts with a uint32 header. Small sets, where it takes fewer bytes, are flat: the header
+// is ESEMAN_BITMAP_FLAT | count and count sorted uint32 values follow. Otherwise the header is the container count
+// and the containers follow as
+//
+//   container count x EsemanBitmapContainerInfo   sorted by key
+//   container payloads                    each at its offset from the start of the serialized bitmap
+//
+// where a payload is whichever of these is the smallest: cardinality sorted uint16 values, 1024 uint64 words, or a
+// uint16 run count followed by [uint16 first value, uint16 length - 1] per run of consecutive values.
+// EsemanBitmapView answers lookups on the serialized form in place and knows where it ends.
+
+#define ESEMAN_BITMAP_ARRAY_MAX     4096
+#define ESEMAN_BITMAP_WORDS         1024 // 65536 bits
+#define ESEMAN_BITMAP_ARRAY         0
+#define ESEMAN_BITMAP_BITSET        1
+#define ESEMAN_BITMAP_RUNS          2
+#define ESEMAN_BITMAP_FLAT          (1U << 31)
+
+#pragma pack(push, 1)
+struct EsemanBitmapContainerInfo {
+  uint16_t  key;
+  uint8_t   type;
+  uint8_t   unused;
+  uint32_t  cardinality;
+  uint32_t  offset;
+};
+#pragma pack(pop)
+
+class EsemanBitmapView;
+
+class EsemanBitmap {
+private:
+  struct Container {
+    uint16_t          key = 0;
+    uint32_t          cardinality = 0;
+    std::vector<uint16_t> values;  // sorted low bits while the container is an array
+    std::vector<uint64_t> words;   // ESEMAN_BITMAP_WORDS words once it is a bitmap
+
+    inline bool isBitset() const { return !words.empty(); }
+    inline bool contains(uint16_t low) const {
+      if (isBitset()) return (words[low >> 6] >> (low & 63)) & 1;
+      return std::binary_search(values.begin(), values.end(), low);
+    }
+    void toBitset() {
+      words.assign(ESEMAN_BITMAP_WORDS, 0);
+      for (uint16_t low : values) words[low >> 6] |= 1ULL << (low & 63);
+      std::vector<uint16_t>().swap(values);
+    }
+    template<typename F> void forEach(F f) const {
+      const uint32_t high = (uint32_t)key << 16;
+      if (!isBitset()) {
+        for (uint16_t low : values) f(high | low);
+        return;
+      }
+      for (uint32_t w = 0; w < ESEMAN_BITMAP_WORDS; ++w) {
+        for (uint64_t word = words[w]; word; word &= word - 1) f(high | (w << 6) | (uint32_t)__builtin_ctzll(word));
+      }
+    }
+    // runs of consecutive values, serialized as runs when that is smaller than the array or the bitmap
+    uint32_t runCount() const {
+      uint32_t runs = 0;
+      if (!isBitset()) {
+        for (size_t i = 0; i < values.size(); ++i) runs += (i == 0 || values[i] != values[i - 1] + 1);
+        return runs;
+      }
+      uint64_t carry = 0;
+      for (uint64_t word : words) {
+        runs += __builtin_popcountll(word & ~((word << 1) | carry));
+        carry = word >> 63;
+      }
+      return runs;
+    }
+  };
+
+  std::vector<Container>  containers;  // sorted by key
+  uint64_t                cardinality = 0;
+
+  Container& containerFor(uint16_t key) {
+    auto it = std::lower_bound(containers.begin(), containers.end(), key,
+                               [](const Container& c, uint16_t k) { return c.key < k; });
+    if (it == containers.end() || it->key != key) {
+      it = containers.insert(it, Container());
+      it->key = key;
+    }
+    return *it;
+  }
+  const Container* findContainer(uint16_t key) const {
+    auto it = std::lower_bound(containers.begin(), containers.end(), key,
+                               [](const Container& c, uint16_t k) { return c.key < k; });
+    return it == containers.end() || it->key != key ? nullptr : &*it;
+  }
+  static inline size_t payloadSize(uint8_t type, uint32_t cardinality, uint32_t runs) {
+    if (type == ESEMAN_BITMAP_ARRAY) return (size_t)cardinality * sizeof(uint16_t);
+    if (type == ESEMAN_BITMAP_BITSET) return ESEMAN_BITMAP_WORDS * sizeof(uint64_t);
+    return sizeof(uint16_t) + (size_t)runs * 2 * sizeof(uint16_t);
+  }
+  static inline uint8_t smallestType(uint32_t cardinality, uint32_t runs) {
+    size_t array_size = payloadSize(ESEMAN_BITMAP_ARRAY, cardinality, runs);
+    size_t bitset_size = payloadSize(ESEMAN_BITMAP_BITSET, cardinality, runs);
+    size_t runs_size = payloadSize(ESEMAN_BITMAP_RUNS, cardinality, runs);
+    if (runs_size < array_size && runs_size < bitset_size) return ESEMAN_BITMAP_RUNS;
+    return array_size <= bitset_size ? ESEMAN_BITMAP_ARRAY : ESEMAN_BITMAP_BITSET;
+  }
+
+public:
+  inline uint64_t size() const { return cardinality; }
+  inline bool empty() const { return cardinality == 0; }
+  void clear() {
+    containers.clear();
+    cardinality = 0;
+  }
+  void swap(EsemanBitmap& other) {
+    containers.swap(other.containers);
+    std::swap(cardinality, other.cardinality);
+  }
+
+  void insert(uint32_t value) {
+    Container& c = containerFor((uint16_t)(value >> 16));
+    const uint16_t low = (uint16_t)value;
+    if (c.isBitset()) {
+      uint64_t& word = c.words[low >> 6];
+      const uint64_t bit = 1ULL << (low & 63);
+      if (word & bit) return;
+      word |= bit;
+    } else {
+      auto it = std::lower_bound(c.values.begin(), c.values.end(), low);
+      if (it != c.values.end() && *it == low) return;
+      c.values.insert(it, low);
+      if (c.values.size() > ESEMAN_BITMAP_ARRAY_MAX) c.toBitset();
+    }
+    c.cardinality++;
+    cardinality++;
+  }
+
+  inline bool contains(uint32_t value) const {
+    const Container* c = findContainer((uint16_t)(value >> 16));
+    return c && c->contains((uint16_t)value);
+  }
+
+  // the smallest value, the set must not be empty
+  uint32_t first() const {
+    for (const Container& c : containers) {
+      if (!c.cardinality) continue;
+      if (!c.isBitset()) return ((uint32_t)c.key << 16) | c.values.front();
+      for (uint32_t w = 0; w < ESEMAN_BITMAP_WORDS; ++w) {
+        if (c.words[w]) return ((uint32_t)c.key << 16) | (w << 6) | (uint32_t)__builtin_ctzll(c.words[w]);
+      }
+    }
+    return 0;
+  }
+
+  // calls f with every value in increasing order
+  template<typename F> void forEach(F f) const {
+    for (const Container& c : containers) c.forEach(f);
+  }
+
+  void unionWith(const EsemanBitmap& other) {
+    std::vector<uint16_t> merged;
+    for (const Container& o : other.containers) {
+      Container& c = containerFor(o.key);
+      cardinality -= c.cardinality;
+      if (c.isBitset() || o.isBitset()
+          || c.values.size() + o.values.size() > ESEMAN_BITMAP_ARRAY_MAX) {
+        if (!c.isBitset()) c.toBitset();
+        if (o.isBitset()) {
+          for (uint32_t w = 0; w < ESEMAN_BITMAP_WORDS; ++w) c.words[w] |= o.words[w];
+        } else {
+          for (uint16_t low : o.values) c.words[low >> 6] |= 1ULL << (low & 63);
+        }
+        c.cardinality = 0;
+        for (uint64_t word : c.words) c.cardinality += __builtin_popcountll(word);
+        // a bitset no denser than an array, e.g. after unioning two sets that overlap a lot, goes back to one
+        if (c.cardinality <= ESEMAN_BITMAP_ARRAY_MAX) {
+          merged.clear();
+          c.forEach([&](uint32_t value) { merged.push_back((uint16_t)value); });
+          c.values.assign(merged.begin(), merged.end());
+          std::vector<uint64_t>().swap(c.words);
+        }
+      } else {
+        merged.clear();
+        std::set_union(c.values.begin(), c.values.end(), o.values.begin(), o.values.end(), std::back_inserter(merged));
+        c.values.swap(merged);
+        c.cardinality = (uint32_t)c.values.size();
+      }
+      cardinality += c.cardinality;
+    }
+  }
+
+  // appends the serialized bitmap to out
+  void serialize(std::string& out) const {
+    const size_t begin = out.size();
+    std::vector<uint32_t> run_counts(containers.size());
+    size_t container_bytes = sizeof(uint32_t) + containers.size() * sizeof(EsemanBitmapContainerInfo);
+    for (size_t i = 0; i < containers.size(); ++i) {
+      run_counts[i] = containers[i].runCount();
+      container_bytes += payloadSize(smallestType(containers[i].cardinality, run_counts[i]), containers[i].cardinality, run_counts[i]);
+    }
+    if ((cardinality + 1) * sizeof(uint32_t) <= container_bytes) {
+      const uint32_t header = ESEMAN_BITMAP_FLAT | (uint32_t)cardinality;
+      out.append((const char*)&header, sizeof(header));
+      forEach([&](uint32_t value) { out.append((const char*)&value, sizeof(value)); });
+      return;
+    }
+
+    const uint32_t container_count = (uint32_t)containers.size();
+    out.append((const char*)&container_count, sizeof(container_count));
+    const size_t infos_offset = out.size();
+    out.resize(out.size() + containers.size() * sizeof(EsemanBitmapContainerInfo));
+
+    std::vector<uint16_t> runs;
+    for (size_t i = 0; i < containers.size(); ++i) {
+      const Container& c = containers[i];
+      EsemanBitmapContainerInfo info;
+      info.key = c.key;
+      info.unused = 0;
+      info.cardinality = c.cardinality;
+      info.offset = (uint32_t)(out.size() - begin);
+      uint32_t run_count = run_counts[i];
+      info.type = smallestType(c.cardinality, run_count);
+      memcpy(&out[infos_offset + i * sizeof(info)], &info, sizeof(info));
+
+      if (info.type == ESEMAN_BITMAP_RUNS) {
+        runs.clear();
+        uint16_t run_begin = 0, previous = 0;
+        bool has_run = false;
+        c.forEach([&](uint32_t value) {
+          uint16_t low = (uint16_t)value;
+          if (has_run && low == previous + 1) {
+            previous = low;
+            return;
+          }
+          if (has_run) {
+            runs.push_back(run_begin);
+            runs.push_back((uint16_t)(previous - run_begin));
+          }
+          has_run = true;
+          run_begin = previous = low;
+        });
+        if (has_run) {
+          runs.push_back(run_begin);
+          runs.push_back((uint16_t)(previous - run_begin));
+        }
+        uint16_t stored_runs = (uint16_t)run_count;
+        out.append((const char*)&stored_runs, sizeof(stored_runs));
+        out.append((const char*)runs.data(), runs.size() * sizeof(uint16_t));
+      } else if (info.type == ESEMAN_BITMAP_BITSET) {
+        if (c.isBitset()) {
+          out.append((const char*)c.words.data(), c.words.size() * sizeof(uint64_t));
+        } else {
+          std::vector<uint64_t> words(ESEMAN_BITMAP_WORDS, 0);
+          for (uint16_t low : c.values) words[low >> 6] |= 1ULL << (low & 63);
+          out.append((const char*)words.data(), words.size() * sizeof(uint64_t));
+        }
+      } else if (c.isBitset()) {
+        c.forEach([&](uint32_t value) {
+          uint16_t low = (uint16_t)value;
+          out.append((const char*)&low, sizeof(low));
+        });
+      } else {
+        out.append((const char*)c.values.data(), c.values.size() * sizeof(uint16_t));
+      }
+    }
+  }
+
+  // replaces the contents with a serialized bitmap, false if it is malformed
+  inline bool load(const EsemanBitmapView& view);
+};
+
+// Read only view over a serialized EsemanBitmap. Nothing is copied, and as with the node views the data is not
+// aligned, so every field is read through memcpy.
+class EsemanBitmapView {
+private:
+  const char*   data;
+  size_t        size;
+
+  template<typename T> inline T readAt(size_t offset) const {
+    T value;
+    memcpy(&value, data + offset, sizeof(T));
+    return value;
+  }
+  inline EsemanBitmapContainerInfo info(uint32_t i) const {
+    return readAt<EsemanBitmapContainerInfo>(sizeof(uint32_t) + (size_t)i * sizeof(EsemanBitmapContainerInfo));
+  }
+  inline size_t payloadSize(const EsemanBitmapContainerInfo& c) const {
+    if (c.type == ESEMAN_BITMAP_ARRAY) return (size_t)c.cardinality * sizeof(uint16_t);
+    if (c.type == ESEMAN_BITMAP_BITSET) return ESEMAN_BITMAP_WORDS * sizeof(uint64_t);
+    if (c.offset + sizeof(uint16_t) > size) return SIZE_MAX;
+    return sizeof(uint16_t) + (size_t)readAt<uint16_t>(c.offset) * 2 * sizeof(uint16_t);
+  }
+  inline bool hasPayload(const EsemanBitmapContainerInfo& c) const {
+    size_t payload = payloadSize(c);
+    return c.type <= ESEMAN_BITMAP_RUNS && c.offset <= size && payload <= size - c.offset;
+  }
+
+  friend class EsemanBitmap;
+
+  inline bool isFlat() const { return readAt<uint32_t>(0) & ESEMAN_BITMAP_FLAT; }
+  inline uint32_t flatCount() const { return readAt<uint32_t>(0) & ~ESEMAN_BITMAP_FLAT; }
+  inline uint32_t flatValue(uint32_t i) const { return readAt<uint32_t>(sizeof(uint32_t) + (size_t)i * sizeof(uint32_t)); }
+  inline uint32_t containerCount() const { return readAt<uint32_t>(0); }
+
+public:
+  EsemanBitmapView() : data(nullptr), size(0) {}
+  EsemanBitmapView(const char* b_data, size_t b_size) : data(b_data), size(b_size) {}
+
+  inline bool isValid() const {
+    if (data == nullptr || size < sizeof(uint32_t)) return false;
+    if (isFlat()) return (size - sizeof(uint32_t)) / sizeof(uint32_t) >= flatCount();
+    if ((size - sizeof(uint32_t)) / sizeof(EsemanBitmapContainerInfo) < containerCount()) return false;
+    return containerCount() == 0 || hasPayload(info(containerCount() - 1));
+  }
+  // bytes the serialized bitmap takes, payloads are written in container order so the last one ends it
+  inline size_t byteSize() const {
+    if (isFlat()) return sizeof(uint32_t) + (size_t)flatCount() * sizeof(uint32_t);
+    if (containerCount() == 0) return sizeof(uint32_t);
+    EsemanBitmapContainerInfo last = info(containerCount() - 1);
+    return last.offset + payloadSize(last);
+  }
+  uint64_t cardinality() const {
+    if (isFlat()) return flatCount();
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < containerCount(); ++i) total += info(i).cardinality;
+    return total;
+  }
+
+  bool contains(uint32_t value) const {
+    if (!isValid()) return false;
+    if (isFlat()) {
+      uint32_t left = 0, right = flatCount();
+      while (left < right) {
+        uint32_t mid = (left + right) / 2;
+        uint32_t m_value = flatValue(mid);
+        if (m_value == value) return true;
+        if (m_value < value) left = mid + 1;
+        else right = mid;
+      }
+      return false;
+    }
+    const uint16_t key = (uint16_t)(value >> 16);
+    const uint16_t low = (uint16_t)value;
+    uint32_t left = 0, right = containerCount();
+    while (left < right) {
+      uint32_t mid = (left + right) / 2;
+      if (info(mid).key < key) left = mid + 1;
+      else right = mid;
+    }
+    if (left == containerCount()) return false;
+    EsemanBitmapContainerInfo c = info(left);
+    if (c.key != key || !hasPayload(c)) return false;
+
+    if (c.type == ESEMAN_BITMAP_BITSET) {
+      return (readAt<uint64_t>(c.offset + (low >> 6) * sizeof(uint64_t)) >> (low & 63)) & 1;
+    }
+    if (c.type == ESEMAN_BITMAP_ARRAY) {
+      uint32_t l = 0, r = c.cardinality;
+      while (l < r) {
+        uint32_t mid = (l + r) / 2;
+        uint16_t m_value = readAt<uint16_t>(c.offset + mid * sizeof(uint16_t));
+        if (m_value == low) return true;
+        if (m_value < low) l = mid + 1;
+        else r = mid;
+      }
+      return false;
+    }
+    // the last run starting at or before low
+    const size_t runs_offset = c.offset + sizeof(uint16_t);
+    uint32_t l = 0, r = readAt<uint16_t>(c.offset);
+    while (l < r) {
+      uint32_t mid = (l + r) / 2;
+      if (readAt<uint16_t>(runs_offset + mid * 2 * sizeof(uint16_t)) <= low) l = mid + 1;
+      else r = mid;
+    }
+    if (l == 0) return false;
+    const size_t run = runs_offset + (l - 1) * 2 * sizeof(uint16_t);
+    return low - readAt<uint16_t>(run) <= readAt<uint16_t>(run + sizeof(uint16_t));
+  }
+
+  bool first(uint32_t& value) const {
+    if (!isValid()) return false;
+    if (isFlat()) {
+      if (!flatCount()) return false;
+      value = flatValue(0);
+      return true;
+    }
+    for (uint32_t i = 0; i < containerCount(); ++i) {
+      EsemanBitmapContainerInfo c = info(i);
+      if (!c.cardinality || !hasPayload(c)) continue;
+      const uint32_t high = (uint32_t)c.key << 16;
+      if (c.type == ESEMAN_BITMAP_ARRAY) {
+        value = high | readAt<uint16_t>(c.offset);
+        return true;
+      }
+      if (c.type == ESEMAN_BITMAP_RUNS) {
+        if (!readAt<uint16_t>(c.offset)) continue;
+        value = high | readAt<uint16_t>(c.offset + sizeof(uint16_t));
+        return true;
+      }
+      for (uint32_t w = 0; w < ESEMAN_BITMAP_WORDS; ++w) {
+        uint64_t word = readAt<uint64_t>(c.offset + w * sizeof(uint64_t));
+        if (word) {
+          value = high | (w << 6) | (uint32_t)__builtin_ctzll(word);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+};
+
+inline bool EsemanBitmap::load(const EsemanBitmapView& view) {
+  clear();
+  if (!view.isValid()) return false;
+  if (view.isFlat()) {
+    for (uint32_t i = 0; i < view.flatCount(); ++i) insert(view.flatValue(i));
+    return true;
+  }
+  containers.resize(view.containerCount());
+  for (uint32_t i = 0; i < view.containerCount(); ++i) {
+    EsemanBitmapContainerInfo info = view.info(i);
+    if (!view.hasPayload(info)) {
+      clear();
+      return false;
+    }
+    Container& c = containers[i];
+    c.key = info.key;
+    if (info.type == ESEMAN_BITMAP_BITSET) {
+      c.words.resize(ESEMAN_BITMAP_WORDS);
+      memcpy(c.words.data(), view.data + info.offset, ESEMAN_BITMAP_WORDS * sizeof(uint64_t));
+      for (uint64_t word : c.words) c.cardinality += __builtin_popcountll(word);
+    } else if (info.type == ESEMAN_BITMAP_ARRAY) {
+      c.values.resize(info.cardinality);
+      memcpy(c.values.data(), view.data + info.offset, info.cardinality * sizeof(uint16_t));
+      c.cardinality = info.cardinality;
+    } else {
+      // runs are expanded into the form the container would have in memory
+      if (info.cardinality > ESEMAN_BITMAP_ARRAY_MAX) c.words.assign(ESEMAN_BITMAP_WORDS, 0);
+      uint16_t run_count = view.readAt<uint16_t>(info.offset);
+      for (uint32_t r = 0; r < run_count; ++r) {
+        size_t run = info.offset + sizeof(uint16_t) + r * 2 * sizeof(uint16_t);
+        uint32_t run_begin = view.readAt<uint16_t>(run);
+        uint32_t run_end = std::min<uint32_t>(run_begin + view.readAt<uint16_t>(run + sizeof(uint16_t)), UINT16_MAX);
+        for (uint32_t low = run_begin; low <= run_end; ++low) {
+          if (c.isBitset()) c.words[low >> 6] |= 1ULL << (low & 63);
+          else c.values.push_back((uint16_t)low);
+        }
+      }
+      if (!c.isBitset()) c.cardinality = (uint32_t)c.values.size();
+      else for (uint64_t word : c.words) c.cardinality += __builtin_popcountll(word);
+    }
+    cardinality += c.cardinality;
+  }
+  return true;
+}
+
+#endif // ESEMAN_BITMAP_H
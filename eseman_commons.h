@@ -22,6 +22,7 @@
 #include <fstream>
 #include <chrono>
 #include <climits>
+#include <limits>
 #include <variant>
 #include <stack>
 #include <lmdb.h> 
@@ -32,6 +33,7 @@
 // - optimal space usage
 // - optimal for write once and read heavy queries
 // - only drawback is the database doesnt grow on demand, have to predefined the whole database size
+#include "eseman_bitmap.h"
 
 using namespace std;
 
@@ -42,10 +44,11 @@ using namespace std;
 #endif
 
 #define LMDB_DATABASE_TOTAL_SIZE 20L*1024*1024*1024 //20 GB
+#define LMDB_MAX_DBS 8 // named databases inside one LMDB environment
 
 typedef unordered_map<string, size_t>                 String_to_index;
 typedef map<uint64_t, vector<double>>                 LocDict;
-typedef unordered_map<string, unordered_set<size_t>>  AttributeList;
+typedef unordered_map<string, EsemanBitmap>           AttributeList;
 
 // =======================================
 // Event related types and inline functions
@@ -121,21 +124,23 @@ public:
     return tracks.at(idx);
   }
 
-  // Insert a string if not present, preserving insertion order
-  void insert(const string& s) {
-    if (track_to_index.find(s) == track_to_index.end()) {
-      track_to_index[s] = tracks.size();
-      tracks.push_back(s);
-    }
+  // Insert a string if not present, preserving insertion order, and return its index
+  size_t insert(const string& s) {
+    auto it = track_to_index.find(s);
+    if (it != track_to_index.end()) return it->second;
+    track_to_index[s] = tracks.size();
+    tracks.push_back(s);
+    return tracks.size() - 1;
   }
 
   // Returns the index of the string if found, else return size()
-  size_t get_track_index(const string& s) {
-    if (track_to_index.find(s) == track_to_index.end()) {
+  size_t get_track_index(const string& s) const {
+    auto it = track_to_index.find(s);
+    if (it == track_to_index.end()) {
       PRINTLOG("Track not found: " << s);
       return tracks.size();
     }
-    return track_to_index[s];
+    return it->second;
   }
 
   // Number of unique strings
@@ -161,16 +166,309 @@ public:
 
 typedef unordered_map<string, StringIndexMapper>            AttributeDict;
 
+// =======================================
+// Columnar event store used while bundling
+// =======================================
+// Events of one track as struct of arrays. Like EventDictList, the start and end event of interval i
+// are at index 2*i and 2*i+1 of times. Primitive and ID are stored once per interval as indices into
+// the "primitive" and "ID" dictionaries of the AttributeDict, so no strings are kept per event.
+struct EventColumns {
+  vector<int64_t>   times;
+  vector<uint32_t>  primitives;
+  vector<uint32_t>  ids;
+
+  // number of events, two per interval
+  inline size_t size() const { return times.size(); }
+  inline bool empty() const { return times.empty(); }
+  inline int64_t time(size_t event_index) const { return times[event_index]; }
+  inline uint32_t primitive(size_t event_index) const { return primitives[event_index >> 1]; }
+  inline uint32_t id(size_t event_index) const { return ids[event_index >> 1]; }
+
+  inline void push(int64_t start_time, int64_t end_time, uint32_t primitive_index, uint32_t id_index) {
+    times.push_back(start_time);
+    times.push_back(end_time);
+    primitives.push_back(primitive_index);
+    ids.push_back(id_index);
+  }
+
+  // frees the memory as well, the columns of a built track are not needed anymore
+  void clear() {
+    vector<int64_t>().swap(times);
+    vector<uint32_t>().swap(primitives);
+    vector<uint32_t>().swap(ids);
+  }
+};
+
+// What the build stage found while putting a track's intervals in start time order
+struct IntervalOrderStats {
+  uint64_t  unsorted_tracks = 0;
+  uint64_t  overlapping = 0;  // intervals starting before an earlier interval ended
+  uint64_t  nested = 0;       // overlapping intervals that also end inside the earlier one
+  uint64_t  inverted = 0;     // intervals ending before they start
+
+  void add(const IntervalOrderStats& other) {
+    unsorted_tracks += other.unsorted_tracks;
+    overlapping += other.overlapping;
+    nested += other.nested;
+    inverted += other.inverted;
+  }
+  inline bool hasIssues() const { return unsorted_tracks || overlapping || inverted; }
+};
+
+inline void reportIntervalOrder(const IntervalOrderStats& stats) {
+  if (!stats.hasIssues()) return;
+  cerr << "Sorted " << stats.unsorted_tracks << " tracks by start time, found "
+       << stats.overlapping << " overlapping intervals (" << stats.nested << " nested) and "
+       << stats.inverted << " intervals ending before they start" << endl;
+}
+
+inline bool isSortedByStart(const EventColumns& columns) {
+  for (size_t i = 2; i < columns.times.size(); i += 2) {
+    if (columns.times[i] < columns.times[i - 2]) return false;
+  }
+  return true;
+}
+
+// Stable LSD radix sort of the intervals by start time, 8 bits per pass. A pass is skipped when every key
+// has the same byte there, so timestamps sharing their high bytes only pay for the bytes that differ.
+inline void sortIntervalsByStart(EventColumns& columns) {
+  size_t n = columns.primitives.size();
+  vector<uint64_t> keys(n), keys_tmp(n);
+  vector<size_t> order(n), order_tmp(n);
+  for (size_t i = 0; i < n; ++i) {
+    keys[i] = (uint64_t)columns.times[2 * i] ^ (1ULL << 63); // flip the sign bit so negative times sort first
+    order[i] = i;
+  }
+  for (int shift = 0; shift < 64; shift += 8) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < n; ++i) counts[(keys[i] >> shift) & 0xFF]++;
+    if (counts[(keys[0] >> shift) & 0xFF] == n) continue;
+    size_t offset = 0;
+    for (size_t& c : counts) {
+      size_t bucket_size = c;
+      c = offset;
+      offset += bucket_size;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      size_t dest = counts[(keys[i] >> shift) & 0xFF]++;
+      keys_tmp[dest] = keys[i];
+      order_tmp[dest] = order[i];
+    }
+    keys.swap(keys_tmp);
+    order.swap(order_tmp);
+  }
+
+  EventColumns sorted;
+  sorted.times.resize(2 * n);
+  sorted.primitives.resize(n);
+  sorted.ids.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    sorted.times[2 * i] = columns.times[2 * order[i]];
+    sorted.times[2 * i + 1] = columns.times[2 * order[i] + 1];
+    sorted.primitives[i] = columns.primitives[order[i]];
+    sorted.ids[i] = columns.ids[order[i]];
+  }
+  columns = std::move(sorted);
+}
+
+// counts the intervals that break the alternating start/end layout, the columns must be sorted by start
+inline IntervalOrderStats checkIntervalOrder(const EventColumns& columns) {
+  IntervalOrderStats stats;
+  int64_t max_end = numeric_limits<int64_t>::min();
+  for (size_t i = 0; i < columns.times.size(); i += 2) {
+    int64_t start = columns.times[i], end = columns.times[i + 1];
+    if (end < start) stats.inverted++;
+    if (i > 0 && start < max_end) {
+      stats.overlapping++;
+      if (end <= max_end) stats.nested++;
+    }
+    max_end = max(max_end, end);
+  }
+  return stats;
+}
+
+// =======================================
+// Intervals parsed from one piece of the input file
+// =======================================
+// Strings are interned in chunk local dictionaries while parsing, so chunks can be filled on separate threads.
+// The model maps each distinct string to its own dictionaries once when the chunk is inserted.
+struct IntervalChunk {
+  StringIndexMapper  tracks;
+  StringIndexMapper  primitives;
+  StringIndexMapper  ids;
+  vector<int64_t>    times;             // start and end of interval i at 2*i and 2*i+1
+  vector<uint32_t>   track_indices;
+  vector<uint32_t>   primitive_indices;
+  vector<uint32_t>   id_indices;
+  size_t             skipped_objects = 0;
+
+  inline size_t size() const { return track_indices.size(); }
+
+  inline void push(int64_t start_time, int64_t end_time, const string& track, const string& primitive, const string& id) {
+    times.push_back(start_time);
+    times.push_back(end_time);
+    track_indices.push_back((uint32_t)tracks.insert(track));
+    primitive_indices.push_back((uint32_t)primitives.insert(primitive));
+    id_indices.push_back((uint32_t)ids.insert(id));
+  }
+
+  void clear() {
+    tracks.cleanMemory();
+    primitives.cleanMemory();
+    ids.cleanMemory();
+    vector<int64_t>().swap(times);
+    vector<uint32_t>().swap(track_indices);
+    vector<uint32_t>().swap(primitive_indices);
+    vector<uint32_t>().swap(id_indices);
+    skipped_objects = 0;
+  }
+};
+
+// maps every index of a chunk local dictionary to the index of the same string in the model's dictionary
+inline vector<uint32_t> mapChunkDictionary(const StringIndexMapper& chunk_dictionary, StringIndexMapper& dictionary) {
+  vector<uint32_t> index_map(chunk_dictionary.size());
+  for (size_t i = 0; i < chunk_dictionary.size(); ++i) {
+    index_map[i] = (uint32_t)dictionary.insert(chunk_dictionary[i]);
+  }
+  return index_map;
+}
+
+// Walks a parsed chunk in its order for a model. map_track is called for every track of the chunk in the
+// order the tracks first appear and returns the model's handle for it, push gets every interval as
+// (handle, start, end, primitive index, ID index) with the indices of the model's dictionaries. Tracks and
+// attribute values are added in the order they first appear, so inserting the chunks in file order gives
+// the same indices as inserting the intervals one by one.
+template <typename MapTrack, typename Push>
+inline void forEachChunkInterval(const IntervalChunk& chunk, StringIndexMapper& primitives, StringIndexMapper& ids,
+                                 MapTrack map_track, Push push) {
+  vector<decltype(map_track(string()))> track_map;
+  track_map.reserve(chunk.tracks.size());
+  for (size_t i = 0; i < chunk.tracks.size(); ++i) track_map.push_back(map_track(chunk.tracks[i]));
+  vector<uint32_t> primitive_map = mapChunkDictionary(chunk.primitives, primitives);
+  vector<uint32_t> id_map = mapChunkDictionary(chunk.ids, ids);
+
+  for (size_t i = 0; i < chunk.size(); ++i) {
+    push(track_map[chunk.track_indices[i]], chunk.times[2*i], chunk.times[2*i+1],
+         primitive_map[chunk.primitive_indices[i]], id_map[chunk.id_indices[i]]);
+  }
+}
+
 inline uint64_t getBinSize(int64_t time_begin, int64_t time_end, uint64_t bins){
   return (uint64_t)floor((double)(time_end - time_begin) / (double)bins);
 }
 
-inline int getBinNumber(int64_t time_begin, int64_t time_end, uint64_t bins, int64_t ctime) {
-  uint64_t bin_size = getBinSize(time_begin, time_end, bins);
-  if(ctime < time_begin || ctime > time_end) return -1;
-  return (int)floor((double)(ctime - time_begin) / (double)bin_size);
+// Marks the bins covered by clusters, added in time order. A bin a cluster covers fully is 1.0, a bin where a
+// cluster starts or ends off the bin boundary is 0.5 unless another cluster covers it fully or marked it before.
+// The bins between a cluster's first and last bin go into a difference array as +1 at the first and -1 after the
+// last, the two end bins are marked on their own, and finish resolves both in one pass over the bins. A cluster
+// costs the same whatever its width, and bins are found by integer division.
+class EsemanBinRasterizer {
+private:
+  int64_t           time_begin;
+  int64_t           time_end;
+  uint64_t          bins;
+  int64_t           bin_size;
+  vector<int32_t>   covered_runs; // bins + 1 entries
+  vector<uint8_t>   end_marks;    // 0 none, 1 partly, 2 fully covered, set by the first cluster ending there
+
+public:
+  EsemanBinRasterizer(int64_t r_time_begin, int64_t r_time_end, uint64_t r_bins)
+    : time_begin(r_time_begin), time_end(r_time_end), bins(r_bins),
+      bin_size(std::max<int64_t>((int64_t)getBinSize(r_time_begin, r_time_end, r_bins), 1)),
+      covered_runs(r_bins + 1, 0), end_marks(r_bins, 0) {}
+
+  inline void add(int64_t start_time, int64_t end_time) {
+    if(end_time < time_begin || start_time > time_end) return;
+    if(start_time < time_begin) start_time = time_begin;
+    if(end_time > time_end) end_time = time_end;
+    // the last bin can reach past bins when bin_size was rounded down, bins from there on are dropped
+    uint64_t starting_bin = (uint64_t)((start_time - time_begin) / bin_size);
+    uint64_t ending_bin = (uint64_t)((end_time - time_begin) / bin_size);
+
+    uint64_t run_end = std::min(ending_bin, bins);
+    if(starting_bin + 1 < run_end) {
+      covered_runs[starting_bin + 1]++;
+      covered_runs[run_end]--;
+    }
+    if(starting_bin < bins && !end_marks[starting_bin])
+      end_marks[starting_bin] = (start_time % bin_size) ? 1 : 2;
+    if(ending_bin < bins && !end_marks[ending_bin])
+      end_marks[ending_bin] = (end_time % bin_size) ? 1 : 2;
+  }
+
+  vector<double> finish() const {
+    static const double mark_values[3] = {0.0, 0.5, 1.0};
+    vector<double> results(bins);
+    int32_t covering = 0;
+    for(uint64_t b = 0; b < bins; b++) {
+      covering += covered_runs[b];
+      results[b] = covering > 0 ? 1.0 : mark_values[end_marks[b]];
+    }
+    return results;
+  }
+};
+
+// the bins of the clusters a track query returned as [start, end] pairs
+inline vector<double> rasterizeClusters(const vector<int64_t>& clusters, int64_t time_begin, int64_t time_end, uint64_t bins) {
+  EsemanBinRasterizer rasterizer(time_begin, time_end, bins);
+  for(size_t i = 0; i + 1 < clusters.size(); i += 2) rasterizer.add(clusters[i], clusters[i+1]);
+  return rasterizer.finish();
 }
 
+// =======================================
+// Per request query state
+// =======================================
+// Filters, the attribute a query returns and its counters. The engines keep none of this themselves, so
+// one engine can answer queries on several threads at once as long as each brings its own context.
+// A context serves one query at a time, the server keeps one per connection.
+struct EsemanQueryContext {
+  EventDictList   filters;
+  bool            has_filter_query = false;
+  string          return_attribute_key = "";
+  bool            has_return_attribute_key = false;
+  int             max_depth_reached = 0;
+  int             leafs_read = 0;
+  int             nodes_visited = 0;
+
+  void addPrimitiveFilter(const string& primitive_filter) {
+    for (const auto& filter : filters) {
+      if(getEventPrimitive(filter) == primitive_filter) return;
+    }
+    filters.push_back(EventDict{{"primitive", primitive_filter}});
+  }
+  void addIDFilter(const string& id_filter) {
+    for (const auto& filter : filters) {
+      if(getEventID(filter) == id_filter) return;
+    }
+    filters.push_back(EventDict{{"ID", id_filter}});
+  }
+  void clearPrimitiveFilters() {
+    filters.clear();
+  }
+
+  // replaces the filter strings by their indices in the dictionaries, an unknown key or value matches nothing.
+  // The dictionaries are only read, they are shared by every query.
+  void resolveFilters(const AttributeDict& attributes) {
+    has_filter_query = false;
+    for (auto& filter : filters) {
+      for (auto& [key, value] : filter) {
+        has_filter_query = true;
+        const string* name = get_if<string>(&value);
+        if (!name) continue;
+        auto dictionary = attributes.find(key);
+        value = dictionary == attributes.end() ? SIZE_MAX : dictionary->second.get_track_index(*name);
+      }
+    }
+  }
+  // filters apply to one query and are dropped after it
+  void finishQuery() {
+    filters.clear();
+    has_filter_query = false;
+    return_attribute_key = "";
+    has_return_attribute_key = false;
+  }
+};
+
 inline string doubleToStringZeroPrecision(double value) {
     stringstream ss;
     ss << fixed << setprecision(0) << value;
@@ -1,80 +1,368 @@
 #include "eseman_data_server.h"
 
+// One interval record as read from the input, only the fields the bundle needs.
+struct ESeManInterval {
+    int64_t enter_timestamp = 0;
+    int64_t leave_timestamp = 0;
+    std::string location;
+    std::string primitive;
+    std::string interval_id;
+    uint8_t found_fields = 0;     // bitmask of the fields seen so far
+};
+
+// Streams the top-level array of interval objects and emits each interval directly from the SAX events.
+// The key path of every value is tracked, so enter.Timestamp, leave.Timestamp, Location, Primitive and
+// intervalId are picked up during the single pass and everything else (children, metrics, ...) is skipped
+// without being copied.
 class ESeManJSONHandler : public BaseReaderHandler<UTF8<>, ESeManJSONHandler> {
 public:
+    enum Field : uint8_t {
+        NONE            = 0,
+        ENTER_TIMESTAMP = 1 << 0,
+        LEAVE_TIMESTAMP = 1 << 1,
+        LOCATION        = 1 << 2,
+        PRIMITIVE       = 1 << 3,
+        INTERVAL_ID     = 1 << 4,
+        ALL_FIELDS      = ENTER_TIMESTAMP | LEAVE_TIMESTAMP | LOCATION | PRIMITIVE | INTERVAL_ID
+    };
+    enum class Parent : uint8_t { OTHER, ENTER, LEAVE };
+
     int depth = 0;                // Current object/array nesting depth
     bool inArrayRoot = false;     // True if we are inside the top-level array
-    std::string buffer;           // JSON buffer for one object
+    Parent parent = Parent::OTHER;// which member of the interval object the current nested object belongs to
+    Field field = NONE;           // field the next value belongs to
+    ESeManInterval interval;      // interval being read, reused across objects
+    size_t skipped_objects = 0;
 
-    std::function<void(const std::string&)> onObject;
+    std::function<void(const ESeManInterval&)> onInterval;
 
     bool StartArray() {
         if (!inArrayRoot && depth == 0) {
             inArrayRoot = true;   // Root array starts
-        } else {
-            buffer.push_back('[');
         }
+        field = NONE;
         depth++;
         return true;
     }
 
     bool EndArray(SizeType) {
         depth--;
-        if (depth > 0) {
-            buffer.push_back(']');
-        } else if (inArrayRoot && depth == 0) {
+        if (inArrayRoot && depth == 0) {
             inArrayRoot = false; // Finished root array
         }
         return true;
     }
 
     bool StartObject() {
-        buffer.push_back('{');
         depth++;
+        if (depth == 2 && inArrayRoot) {
+            // Top-level object starts
+            interval.found_fields = 0;
+            parent = Parent::OTHER;
+        }
+        field = NONE;
         return true;
     }
 
     bool EndObject(SizeType) {
-        buffer.push_back('}');
         depth--;
         if (depth == 1 && inArrayRoot) {
             // Top-level object just finished
-            if (onObject) onObject(buffer);
-            buffer.clear();
+            if (interval.found_fields == ALL_FIELDS) {
+                if (onInterval) onInterval(interval);
+            } else {
+                skipped_objects++;
+            }
         }
         return true;
     }
 
     bool Key(const char* str, SizeType length, bool) {
-        if(buffer.size() > 0 && buffer.back() != '{' && buffer.back() != ',') {
-            buffer.push_back(',');
+        field = NONE;
+        if (!inArrayRoot) return true;
+        std::string_view key(str, length);
+        if (depth == 2) {
+            parent = Parent::OTHER;
+            if (key == "enter") parent = Parent::ENTER;
+            else if (key == "leave") parent = Parent::LEAVE;
+            else if (key == "Location") field = LOCATION;
+            else if (key == "Primitive") field = PRIMITIVE;
+            else if (key == "intervalId") field = INTERVAL_ID;
+        } else if (depth == 3 && key == "Timestamp") {
+            if (parent == Parent::ENTER) field = ENTER_TIMESTAMP;
+            else if (parent == Parent::LEAVE) field = LEAVE_TIMESTAMP;
         }
-        buffer.push_back('"');
-        buffer.append(str, length);
-        buffer.push_back('"');
-        buffer.push_back(':');
         return true;
     }
 
     bool String(const char* str, SizeType length, bool) {
-        if(buffer.size() > 0 && buffer.back() == '"') {
-            buffer.push_back(',');
+        switch (field) {
+            case LOCATION:    interval.location.assign(str, length); break;
+            case PRIMITIVE:   interval.primitive.assign(str, length); break;
+            case INTERVAL_ID: interval.interval_id.assign(str, length); break;
+            default: field = NONE; return true;
         }
-        buffer.push_back('"');
-        buffer.append(str, length);
-        buffer.push_back('"');
+        interval.found_fields |= field;
+        field = NONE;
         return true;
     }
 
-    bool Int(int i) { buffer += std::to_string(i); return true; }
-    bool Uint(unsigned u) { buffer += std::to_string(u); return true; }
-    bool Int64(int64_t i) { buffer += std::to_string(i); return true; }
-    bool Uint64(uint64_t u) { buffer += std::to_string(u); return true; }
-    bool Double(double d) { buffer += std::to_string(d); return true; }
-    bool Bool(bool b) { buffer += (b ? "true" : "false"); return true; }
-    bool Null() { buffer += "null"; return true; }
+    bool Timestamp(int64_t value) {
+        if (field == ENTER_TIMESTAMP) interval.enter_timestamp = value;
+        else if (field == LEAVE_TIMESTAMP) interval.leave_timestamp = value;
+        else return true;
+        interval.found_fields |= field;
+        field = NONE;
+        return true;
+    }
+
+    bool Int(int i) { return Timestamp(i); }
+    bool Uint(unsigned u) { return Timestamp(u); }
+    bool Int64(int64_t i) { return Timestamp(i); }
+    bool Uint64(uint64_t u) { return Timestamp((int64_t)u); }
+    bool Double(double d) { return Timestamp((int64_t)d); }
+    bool Bool(bool) { field = NONE; return true; }
+    bool Null() { field = NONE; return true; }
+};
+
+// =======================================
+// Parallel ingest of the memory mapped input
+// =======================================
+#define ESEMAN_MIN_PARSE_CHUNK_SIZE 4*1024*1024 // 4MB, smaller inputs are split into fewer chunks
+#define ESEMAN_MAX_PARSE_CHUNK_SIZE 64*1024*1024 // 64MB, larger inputs are split into more chunks than threads
+#define ESEMAN_STREAM_CHUNK_INTERVALS 64*1024 // intervals handed over at once when the input is read as a stream
+
+enum class INPUT_PARSE_RESULT { PARSED, FAILED, NOT_MAPPED };
+
+struct InputChunk {
+    size_t          begin = 0;      // offset of the first top-level object of the chunk
+    size_t          limit = 0;      // objects are parsed until one ends at or after this offset
+    size_t          end = 0;        // offset of the object following the chunk, or of the closing ']'
+    bool            failed = false;
+    IntervalChunk   intervals;
 };
 
+static inline size_t skipWhitespace(const char* data, size_t size, size_t pos) {
+    while (pos < size && (data[pos] == ' ' || data[pos] == '\n' || data[pos] == '\r' || data[pos] == '\t')) pos++;
+    return pos;
+}
+
+// Guesses the start of a top-level object at or after pos by looking for '}' ',' '{' separated by whitespace only.
+// The guess can be wrong, e.g. inside a string or between nested objects, the chunks are verified after parsing.
+static size_t findObjectBoundary(const char* data, size_t size, size_t pos) {
+    while (pos < size) {
+        const char* close = (const char*)memchr(data + pos, '}', size - pos);
+        if (!close) return size;
+        size_t next = skipWhitespace(data, size, (close - data) + 1);
+        if (next < size && data[next] == ',') {
+            next = skipWhitespace(data, size, next + 1);
+            if (next < size && data[next] == '{') return next;
+        }
+        pos = (close - data) + 1;
+    }
+    return size;
+}
+
+// Parses the top-level objects from chunk.begin until an object ends at or after chunk.limit.
+// Starting from a real object boundary the parse only ever stops on real boundaries.
+static void parseInputChunk(const char* data, size_t size, InputChunk& chunk) {
+    IntervalChunk& intervals = chunk.intervals;
+    ESeManJSONHandler handler;
+    handler.onInterval = [&intervals](const ESeManInterval& interval) {
+        intervals.push(interval.enter_timestamp, interval.leave_timestamp, interval.location, interval.primitive, interval.interval_id);
+    };
+
+    Reader reader;
+    size_t pos = chunk.begin;
+    chunk.failed = false;
+    while (pos < chunk.limit) {
+        if (data[pos] != '{') {
+            chunk.failed = data[pos] != ']';
+            break;
+        }
+        // each object is parsed as if it were inside the root array
+        handler.depth = 1;
+        handler.inArrayRoot = true;
+        MemoryStream ms(data + pos, size - pos);
+        ParseResult ok = reader.Parse<kParseStopWhenDoneFlag>(ms, handler);
+        if (!ok) {
+            chunk.failed = true;
+            break;
+        }
+        pos = skipWhitespace(data, size, pos + ms.Tell());
+        if (pos >= size || data[pos] != ',') break;
+        pos = skipWhitespace(data, size, pos + 1);
+    }
+    chunk.end = pos;
+    intervals.skipped_objects = handler.skipped_objects;
+}
+
+// Memory maps the input and parses chunks of the top-level array on several threads.
+// Chunk boundaries are guessed up front and checked in file order: a chunk that does not start where the
+// previous one ended is parsed again from the right offset. Chunks are handed to the model in file order as soon
+// as they are checked, so every track receives its intervals in the same order as reading the file serially.
+// Threads parse at most 2 chunks per thread ahead of the last inserted one, so only those are held in memory
+// while the model takes, and under a memory budget spills, the earlier ones.
+// Returns NOT_MAPPED if the input cannot be mapped or is not an array, the caller then reads it as a stream.
+static INPUT_PARSE_RESULT parseInputInParallel(const string& input_file, size_t thread_count,
+                                               const function<void(const IntervalChunk&)>& insert_chunk) {
+    int fd = open(input_file.c_str(), O_RDONLY);
+    if (fd < 0) return INPUT_PARSE_RESULT::NOT_MAPPED;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return INPUT_PARSE_RESULT::NOT_MAPPED;
+    }
+    size_t size = file_stat.st_size;
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return INPUT_PARSE_RESULT::NOT_MAPPED;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    const char* data = (const char*)mapped;
+
+    size_t array_begin = skipWhitespace(data, size, 0);
+    if (array_begin >= size || data[array_begin] != '[') {
+        munmap(mapped, size);
+        return INPUT_PARSE_RESULT::NOT_MAPPED;
+    }
+    size_t first_object = skipWhitespace(data, size, array_begin + 1);
+
+    if (thread_count == 0) thread_count = thread::hardware_concurrency();
+    if (thread_count == 0) thread_count = 1;
+    size_t input_size = size - first_object;
+    size_t chunk_count = max<size_t>(thread_count * 4, input_size / ESEMAN_MAX_PARSE_CHUNK_SIZE);
+    chunk_count = max<size_t>(1, min<size_t>(chunk_count, input_size / ESEMAN_MIN_PARSE_CHUNK_SIZE));
+    size_t chunk_size = input_size / chunk_count;
+
+    vector<InputChunk> chunks(1);
+    chunks[0].begin = first_object;
+    for (size_t i = 1; i < chunk_count; ++i) {
+        size_t boundary = findObjectBoundary(data, size, first_object + i * chunk_size);
+        if (boundary >= size || boundary <= chunks.back().begin) continue;
+        chunks.emplace_back();
+        chunks.back().begin = boundary;
+    }
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        chunks[i].limit = i + 1 < chunks.size() ? chunks[i + 1].begin : size;
+    }
+    PRINTLOG("Parsing " << size << " bytes in " << chunks.size() << " chunks with " << thread_count << " threads");
+
+    // chunks are taken in file order, a thread waits before taking one too far ahead of the inserted chunks
+    const size_t max_parsed_ahead = 2 * thread_count;
+    mutex chunk_mutex;
+    condition_variable chunk_parsed, chunk_inserted;
+    vector<bool> is_parsed(chunks.size(), false);
+    size_t inserted_chunks = 0;
+    bool is_stopped = false;
+    atomic<size_t> next_chunk(0);
+    vector<thread> workers;
+    for (size_t t = 0; t < min(thread_count, chunks.size()); ++t) {
+        workers.emplace_back([&]() {
+            for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+                {
+                    unique_lock<mutex> lock(chunk_mutex);
+                    chunk_inserted.wait(lock, [&]() { return is_stopped || i < inserted_chunks + max_parsed_ahead; });
+                    if (is_stopped) return;
+                }
+                parseInputChunk(data, size, chunks[i]);
+                lock_guard<mutex> lock(chunk_mutex);
+                is_parsed[i] = true;
+                chunk_parsed.notify_all();
+            }
+        });
+    }
+
+    INPUT_PARSE_RESULT result = INPUT_PARSE_RESULT::PARSED;
+    size_t skipped_objects = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        {
+            unique_lock<mutex> lock(chunk_mutex);
+            chunk_parsed.wait(lock, [&]() { return is_parsed[i]; });
+        }
+        InputChunk& chunk = chunks[i];
+        if (i > 0 && chunk.begin != chunks[i - 1].end) {
+            chunk.intervals.clear();
+            if (chunks[i - 1].end >= chunk.limit) {
+                // the previous chunk already parsed everything up to this chunk's limit
+                chunk.end = chunks[i - 1].end;
+                chunk.failed = false;
+            } else {
+                PRINTLOG("Chunk boundary guess at offset " << chunk.begin << " was wrong, parsing again from " << chunks[i - 1].end);
+                chunk.begin = chunks[i - 1].end;
+                parseInputChunk(data, size, chunk);
+            }
+        }
+        if (chunk.failed) {
+            std::cerr << "Parse error in the object at offset " << chunk.end << "\n";
+            result = INPUT_PARSE_RESULT::FAILED;
+            break;
+        }
+
+        insert_chunk(chunk.intervals);
+        skipped_objects += chunk.intervals.skipped_objects;
+        chunk.intervals.clear();
+
+        lock_guard<mutex> lock(chunk_mutex);
+        inserted_chunks = i + 1;
+        chunk_inserted.notify_all();
+    }
+    {
+        lock_guard<mutex> lock(chunk_mutex);
+        is_stopped = true;
+        chunk_inserted.notify_all();
+    }
+    for (auto& w : workers) w.join();
+
+    if (skipped_objects) {
+        std::cerr << "Skipped " << skipped_objects
+                << " objects without enter.Timestamp, leave.Timestamp, Location, Primitive or intervalId" << endl;
+    }
+    munmap(mapped, size);
+    return result;
+}
+
+// Reads the JSON input and hands the parsed intervals to insert_chunk in file order.
+// Inputs that cannot be memory mapped are read as a stream on a single thread.
+// Returns false if the input cannot be read or has a parse error, what was parsed before it was already inserted.
+static bool parseInput(const string& input_file, size_t thread_count,
+                       const function<void(const IntervalChunk&)>& insert_chunk) {
+    INPUT_PARSE_RESULT parallel_result = parseInputInParallel(input_file, thread_count, insert_chunk);
+    if (parallel_result != INPUT_PARSE_RESULT::NOT_MAPPED) return parallel_result == INPUT_PARSE_RESULT::PARSED;
+
+    FILE* fp = fopen(input_file.c_str(), "rb");
+    if (!fp) {
+        cerr << "Failed to open input file: " << input_file << endl;
+        return false;
+    }
+    vector<char> readBuffer(DEFAULT_READ_BUFFER_SIZE);
+    FileReadStream is(fp, readBuffer.data(), readBuffer.size());
+
+    IntervalChunk intervals;
+    Reader reader;
+    ESeManJSONHandler handler;
+    handler.onInterval = [&](const ESeManInterval& interval) {
+        intervals.push(interval.enter_timestamp, interval.leave_timestamp, interval.location, interval.primitive, interval.interval_id);
+        if (intervals.size() >= ESEMAN_STREAM_CHUNK_INTERVALS) {
+            insert_chunk(intervals);
+            intervals.clear();
+        }
+    };
+
+    ParseResult ok = reader.Parse(is, handler);
+    if (!ok) {
+        std::cerr << "Parse error: " 
+                << GetParseError_En(ok.Code()) 
+                << " at offset " << ok.Offset() << "\n";
+    }
+    insert_chunk(intervals);
+    if (handler.skipped_objects) {
+        std::cerr << "Skipped " << handler.skipped_objects
+                << " objects without enter.Timestamp, leave.Timestamp, Location, Primitive or intervalId" << endl;
+    }
+    fclose(fp);
+    return !ok.IsError();
+}
+
 void printHelp(const char* progName, const CMD_OPTIONS& options) {
     cout << "Usage: " << progName << " [options]\n\n"
          << "Options:" << endl;
@@ -97,9 +385,11 @@ int process_input_arguments(int argc, char* argv[], STRING_DICT& args) {
         {"-h", "--help",    "",         "",     "Show this help message."},
         {"-s", "--start",   "",         "",     "Start the server."},
         {"-b", "--bundle",  "",         "",     "Bundle the input file and store into LMDB."},
+        {"-g", "--merge",   "",         "",     "Merge the shards bundled by ESEMAN_TASK_COUNT tasks into one dataset."},
         {"-p", "--port",    "<PORT>",   "8080", "Server port"},
-        {"-i", "--input",   "<FILE>",   "",     "Specify the event sequence input file location. The input file should be in JSON format."},
-        {"-m", "--model",   "<MODEL>",  "KDT",  "Specify the data structure, AGC for agglomerative clustering, KDT for KD-Tree."}
+        {"-c", "--convert", "<FILE>",   "",     "Convert the input file into a binary interval file, -b -i reads it without parsing the JSON."},
+        {"-i", "--input",   "<FILE>",   "",     "Specify the event sequence input file location. The input file should be in JSON or binary interval format."},
+        {"-m", "--model",   "<MODEL>",  "KDT",  "Specify the data structure, AGC for agglomerative clustering, KDT for KD-Tree, ODKDT for the 2D KD-Tree, IKDT for the implicit KD-Tree."}
     };
     vector<string> short_names;
     vector<string> long_names;
@@ -134,6 +424,9 @@ int process_input_arguments(int argc, char* argv[], STRING_DICT& args) {
         else if (arg == "-b" || arg == "--bundle") {
             args["bundle"] = "true";
         }
+        else if (arg == "-g" || arg == "--merge") {
+            args["merge"] = "true";
+        }
         else {
             int found_index = -1;
             if (find(short_names.begin(), short_names.end(), arg) != short_names.end()) {
@@ -167,8 +460,8 @@ int process_input_arguments(int argc, char* argv[], STRING_DICT& args) {
             cerr << "Invalid port number: " << args["port"] << endl;
             return 1;
         }
-        if (args["model"] != "AGC" && args["model"] != "KDT" && args["model"] != "ODKDT") {
-            cerr << "Invalid model type: " << args["model"] << ". Supported models are AGC, KDT, ODKDT." << endl;
+        if (args["model"] != "AGC" && args["model"] != "KDT" && args["model"] != "ODKDT" && args["model"] != "IKDT") {
+            cerr << "Invalid model type: " << args["model"] << ". Supported models are AGC, KDT, ODKDT, IKDT." << endl;
             return 1;
         }
         if (args.find("bundle") != args.end() && !args["bundle"].empty()) {
@@ -177,6 +470,12 @@ int process_input_arguments(int argc, char* argv[], STRING_DICT& args) {
                 return 1;
             }
         }
+        if (args.find("convert") != args.end() && !args["convert"].empty()) {
+            if (args.find("input") == args.end() || args["input"].empty()) {
+                cerr << "Input file must be specified when converting." << endl;
+                return 1;
+            }
+        }
     } catch (...) {
         cerr << "Error in input arguments" << endl;
         return 1;
@@ -187,6 +486,7 @@ int process_input_arguments(int argc, char* argv[], STRING_DICT& args) {
 
 
 Document agcGetAttributeQuery(uint64_t cTime, uint64_t cLocation) {
+    lock_guard<mutex> lock(agc_query_mutex);
     std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
     string new_result = agglomerateClusters->findNearestEvent(cTime, cLocation);
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
@@ -207,9 +507,9 @@ Document agcGetAttributeQuery(uint64_t cTime, uint64_t cLocation) {
     return document;
 }
 
-Document esemanGetAttributeQuery(uint64_t cTime, uint64_t cLocation) {
+Document esemanGetAttributeQuery(EsemanKDTQueryContext& context, uint64_t cTime, uint64_t cLocation) {
     std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
-    string new_result = esemanKDT->findNearestEvent(cTime, cLocation);
+    string new_result = esemanKDT->findNearestEvent(context, cTime, cLocation);
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
 
     if(!new_result.empty())
@@ -230,6 +530,29 @@ Document esemanGetAttributeQuery(uint64_t cTime, uint64_t cLocation) {
     return document;
 }
 
+Document esemanImplicitGetAttributeQuery(EsemanIKDTQueryContext& context, uint64_t cTime, uint64_t cLocation) {
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    string new_result = esemanIKDT->findNearestEvent(context, cTime, cLocation);
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    if(!new_result.empty())
+        cout << "ESEMAN_IMPLICIT," << "ds_attribute,"
+            << cTime << "," << cLocation << ","
+            << esemanIKDT->horizontal_resolution_divisor << ","
+            << std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()
+            << endl;
+
+    Document document;
+    document.SetObject();
+    Document::AllocatorType& allocator = document.GetAllocator();
+    if(new_result.length()>0) {
+        Value val(kObjectType);
+        val.SetString(new_result.c_str(), static_cast<SizeType>(new_result.length()), allocator);
+        document.AddMember("event_id", val, allocator);
+    }
+    return document;
+}
+
 Document convertLocDictToDocument(LocDict locDict) {
     Document document;
     document.SetObject();
@@ -267,6 +590,7 @@ Document binnedAGCSearchQuery(
     vector<string> &locations,
     uint64_t bins, string primitive) {
 
+    lock_guard<mutex> lock(agc_query_mutex);
     if(primitive.length()>0) {
         agglomerateClusters->addPrimitiveFilter(primitive);
     }
@@ -295,15 +619,25 @@ void print_available_endpoints(string address, unsigned short port) {
 }
 
 Document binnedESEMANSearchQuery(
+    EsemanKDTQueryContext& kdt_context,
+    EsemanIKDTQueryContext& ikdt_context,
     int64_t time_begin,
     int64_t time_end,
     vector<string> &locations,
     uint64_t bins, string primitive) {
 
-    if(primitive.length()>0) {
-        esemanKDT->addPrimitiveFilter(primitive);
+    tuple<LocDict, int64_t, int64_t> lResults;
+    if(esemanIKDT != nullptr) {
+        if(primitive.length()>0) {
+            ikdt_context.addPrimitiveFilter(primitive);
+        }
+        lResults = esemanIKDT->binnedRangeQuery(ikdt_context, time_begin, time_end, locations, bins);
+    } else {
+        if(primitive.length()>0) {
+            kdt_context.addPrimitiveFilter(primitive);
+        }
+        lResults = esemanKDT->binnedRangeQuery(kdt_context, time_begin, time_end, locations, bins);
     }
-    tuple<LocDict, int64_t, int64_t> lResults = esemanKDT->binnedRangeQuery(time_begin, time_end, locations, bins);
     Document d = convertLocDictToDocument(get<0>(lResults));
 
     Document metadata(kObjectType);
@@ -331,6 +665,10 @@ class HttpSession : public enable_shared_from_this<HttpSession> {
     beast::tcp_stream stream_;
     beast::flat_buffer buffer_;
     http::request<http::string_body> req_;
+    // a session handles one request at a time, so its queries can keep their state here and
+    // sessions on different I/O threads share the models without locking
+    EsemanKDTQueryContext kdt_context_;
+    EsemanIKDTQueryContext ikdt_context_;
 
 public:
     explicit HttpSession(tcp::socket&& socket) : stream_(move(socket)) {}
@@ -518,8 +856,8 @@ private:
                 Document doc = binnedAGCSearchQuery(time_begin, time_end, locationsList, bins, primitive);
                 doc.Accept(writer);
                 res.body() = buffer.GetString();
-            } else if(esemanKDT != nullptr) {
-                Document doc = binnedESEMANSearchQuery(time_begin, time_end, locationsList, bins, primitive);
+            } else if(esemanKDT != nullptr || esemanIKDT != nullptr) {
+                Document doc = binnedESEMANSearchQuery(kdt_context_, ikdt_context_, time_begin, time_end, locationsList, bins, primitive);
                 doc.Accept(writer);
                 res.body() = buffer.GetString();
             } else {
@@ -539,8 +877,12 @@ private:
                 Document doc = agcGetAttributeQuery(cTime, cLocation);
                 doc.Accept(writer);
                 res.body() = buffer.GetString();    
+            } else if(eseman_model == ESEMAN_MODELS::IKDT) {
+                Document doc = esemanImplicitGetAttributeQuery(ikdt_context_, cTime, cLocation);
+                doc.Accept(writer);
+                res.body() = buffer.GetString();
             } else {
-                Document doc = esemanGetAttributeQuery(cTime, cLocation);
+                Document doc = esemanGetAttributeQuery(kdt_context_, cTime, cLocation);
                 doc.Accept(writer);
                 res.body() = buffer.GetString();
             }
@@ -652,6 +994,7 @@ void startBoostServer(unsigned short port) {
     signals.async_wait([&](beast::error_code const&, int){ 
         cout << "Shutting down the ESeMan server." << endl;
         if(esemanKDT != nullptr) esemanKDT->closeReadOnlyLMDB();
+        if(esemanIKDT != nullptr) esemanIKDT->closeImplicitFile();
         ioc.stop(); 
     });
 
@@ -684,6 +1027,8 @@ int main(int argc, char* argv[]) {
         eseman_model = ESEMAN_MODELS::AGC;
     } else if (args.find("model") != args.end() && args["model"] == string("ODKDT")) {
         eseman_model = ESEMAN_MODELS::ODKDT;
+    } else if (args.find("model") != args.end() && args["model"] == string("IKDT")) {
+        eseman_model = ESEMAN_MODELS::IKDT;
     }
 
 
@@ -708,9 +1053,18 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    size_t parse_threads = 0; // threads parsing the input while bundling, 0 uses all hardware threads
+    if (doc["default"].HasMember("ESEMAN_PARSE_THREADS"))
+        parse_threads = doc["default"].GetObject()["ESEMAN_PARSE_THREADS"].GetUint();
+
     if(eseman_model == ESEMAN_MODELS::AGC) {
         agglomerateClusters = new AgglomerateClusters();
         agglomerateClusters->horizontal_resolution_divisor = doc["default"].GetObject()["horizontal_pixel_window"].GetInt();
+    } else if(eseman_model == ESEMAN_MODELS::IKDT) {
+        esemanIKDT = new EseManIKDT();
+        esemanIKDT->horizontal_resolution_divisor = doc["default"].GetObject()["horizontal_pixel_window"].GetInt();
+        esemanIKDT->setDatasetID(doc["default"].GetObject()["database_name"].GetString());
+        esemanIKDT->node_storage_base_path = doc["default"].GetObject()["database_location"].GetString();
     } else {
         esemanKDT = new EseManKDT();
         esemanKDT->horizontal_resolution_divisor = doc["default"].GetObject()["horizontal_pixel_window"].GetInt();
@@ -724,6 +1078,26 @@ int main(int argc, char* argv[]) {
         esemanKDT->ESEMAN_SPLITTING_RULE = doc["default"].GetObject()["ESEMAN_SPLITTING_RULE"].GetString();
         esemanKDT->ESEMAN_TASK_COUNT = doc["default"].GetObject()["ESEMAN_TASK_COUNT"].GetInt();
         esemanKDT->ESEMAN_TASK_ID = doc["default"].GetObject()["ESEMAN_TASK_ID"].GetInt();
+        if (doc["default"].HasMember("ESEMAN_BULK_COMMIT_NODES"))
+            esemanKDT->ESEMAN_BULK_COMMIT_NODES = doc["default"].GetObject()["ESEMAN_BULK_COMMIT_NODES"].GetUint64();
+        if (doc["default"].HasMember("ESEMAN_BUILD_THREADS"))
+            esemanKDT->ESEMAN_BUILD_THREADS = doc["default"].GetObject()["ESEMAN_BUILD_THREADS"].GetUint();
+        if (doc["default"].HasMember("ESEMAN_BUNDLE_MEMORY_BUDGET"))
+            esemanKDT->ESEMAN_BUNDLE_MEMORY_BUDGET = doc["default"].GetObject()["ESEMAN_BUNDLE_MEMORY_BUDGET"].GetUint64();
+        if (doc["default"].HasMember("ESEMAN_NODE_FANOUT"))
+            esemanKDT->ESEMAN_NODE_FANOUT = doc["default"].GetObject()["ESEMAN_NODE_FANOUT"].GetUint();
+        if (doc["default"].HasMember("ESEMAN_LEAF_BUCKET_SIZE"))
+            esemanKDT->ESEMAN_LEAF_BUCKET_SIZE = doc["default"].GetObject()["ESEMAN_LEAF_BUCKET_SIZE"].GetUint();
+        if (doc["default"].HasMember("ESEMAN_LOD_BINS"))
+            esemanKDT->ESEMAN_LOD_BINS = doc["default"].GetObject()["ESEMAN_LOD_BINS"].GetUint64();
+        if (doc["default"].HasMember("ESEMAN_LOD_QUERIES"))
+            esemanKDT->ESEMAN_LOD_QUERIES = doc["default"].GetObject()["ESEMAN_LOD_QUERIES"].GetBool();
+        if (doc["default"].HasMember("ESEMAN_NODE_CACHE_BYTES"))
+            esemanKDT->ESEMAN_NODE_CACHE_BYTES = doc["default"].GetObject()["ESEMAN_NODE_CACHE_BYTES"].GetUint64();
+        if (doc["default"].HasMember("ESEMAN_NODE_CACHE_PINNED_LEVELS"))
+            esemanKDT->ESEMAN_NODE_CACHE_PINNED_LEVELS = doc["default"].GetObject()["ESEMAN_NODE_CACHE_PINNED_LEVELS"].GetInt();
+        if (doc["default"].HasMember("ESEMAN_QUERY_THREADS"))
+            esemanKDT->ESEMAN_QUERY_THREADS = doc["default"].GetObject()["ESEMAN_QUERY_THREADS"].GetUint();
 #ifdef _DEBUG        
         cout << "values from config file: " << endl;
         cout << "  horizontal_pixel_window: " << esemanKDT->horizontal_resolution_divisor << endl;
@@ -734,77 +1108,111 @@ int main(int argc, char* argv[]) {
         cout << "  ESEMAN_SPLITTING_RULE: " << esemanKDT->ESEMAN_SPLITTING_RULE << endl;
         cout << "  ESEMAN_TASK_COUNT: " << esemanKDT->ESEMAN_TASK_COUNT << endl;
         cout << "  ESEMAN_TASK_ID: " << esemanKDT->ESEMAN_TASK_ID << endl;
+        cout << "  ESEMAN_BULK_COMMIT_NODES: " << esemanKDT->ESEMAN_BULK_COMMIT_NODES << endl;
+        cout << "  ESEMAN_BUILD_THREADS: " << esemanKDT->ESEMAN_BUILD_THREADS << endl;
+        cout << "  ESEMAN_BUNDLE_MEMORY_BUDGET: " << esemanKDT->ESEMAN_BUNDLE_MEMORY_BUDGET << endl;
+        cout << "  ESEMAN_NODE_FANOUT: " << esemanKDT->ESEMAN_NODE_FANOUT << endl;
+        cout << "  ESEMAN_LEAF_BUCKET_SIZE: " << esemanKDT->ESEMAN_LEAF_BUCKET_SIZE << endl;
+        cout << "  ESEMAN_LOD_BINS: " << esemanKDT->ESEMAN_LOD_BINS << endl;
+        cout << "  ESEMAN_LOD_QUERIES: " << esemanKDT->ESEMAN_LOD_QUERIES << endl;
+        cout << "  ESEMAN_NODE_CACHE_BYTES: " << esemanKDT->ESEMAN_NODE_CACHE_BYTES << endl;
+        cout << "  ESEMAN_NODE_CACHE_PINNED_LEVELS: " << esemanKDT->ESEMAN_NODE_CACHE_PINNED_LEVELS << endl;
+        cout << "  ESEMAN_QUERY_THREADS: " << esemanKDT->ESEMAN_QUERY_THREADS << endl;
 #endif
     }
 
     if (args.find("input") != args.end() && !args["input"].empty()) {
         filesystem::path path(args["input"].c_str());
-        esemanKDT->setDatasetID(path.stem().c_str());
+        if(esemanKDT != nullptr) esemanKDT->setDatasetID(path.stem().c_str());
+        if(esemanIKDT != nullptr) esemanIKDT->setDatasetID(path.stem().c_str());
+    }
+
+    // If convert option is specified, write the parsed input file as a binary interval file
+    if(args.find("convert") != args.end()) {
+        EseManKDT converter;
+        if (IntervalFile::isIntervalFile(args["input"])) {
+            IntervalFile interval_file;
+            if (!interval_file.open(args["input"])) {
+                cerr << "Failed to read interval file: " << args["input"] << endl;
+                return 1;
+            }
+            converter.insertIntervalFile(interval_file);
+        } else if (!parseInput(args["input"], parse_threads, [&converter](const IntervalChunk& chunk) {
+                converter.insertIntervalChunk(chunk);
+            })) {
+            return 1;
+        }
+        if (!converter.saveIntervalFile(args["convert"])) {
+            cerr << "Failed to write interval file: " << args["convert"] << endl;
+            return 1;
+        }
     }
 
     // If bundle option is specified, bundle the input file and store into LMDB
     if(args.find("bundle") != args.end()) {
         
-        fp = fopen(args["input"].c_str(), "rb");
-        if (!fp) {
-            cerr << "Failed to open input file: " << args["input"] << endl;
-            return 1;
-        }
-        memset(readBuffer, 0, sizeof(readBuffer));
-        FileReadStream is(fp, readBuffer, sizeof(readBuffer));
-
-        Reader reader;
-        ESeManJSONHandler handler;
-
-        handler.onObject = [](const std::string& jsonStr) {
-            // Remove trailing comma if present
-            std::string cleaned = jsonStr;
-            if (!cleaned.empty() && cleaned.back() == ',')
-                cleaned.pop_back();
-
-            Document d;
-            d.Parse(cleaned.c_str());
-            if (d.HasParseError()) {
-                std::cerr << "Parse error inside object: "
-                        << GetParseError_En(d.GetParseError()) << endl
-                        << cleaned
-                        << endl;
-                return;
+        if (IntervalFile::isIntervalFile(args["input"])) {
+            IntervalFile interval_file;
+            if (!interval_file.open(args["input"])) {
+                cerr << "Failed to read interval file: " << args["input"] << endl;
+                return 1;
             }
-
+            PRINTLOG("Reading " << interval_file.intervalCount() << " intervals of " << interval_file.trackCount() << " tracks from the interval file");
             if(agglomerateClusters != nullptr) {
-                agglomerateClusters->insertDataIntoTree((double)d["enter"]["Timestamp"].GetInt64(),
-                                                        (double)d["leave"]["Timestamp"].GetInt64(),
-                                                        d["Location"].GetString(),
-                                                        d["Primitive"].GetString(),
-                                                        d["intervalId"].GetString());
+                agglomerateClusters->insertIntervalFile(interval_file);
+            } else if(esemanIKDT != nullptr) {
+                esemanIKDT->insertIntervalFile(interval_file);
             } else if(esemanKDT != nullptr) {
-                esemanKDT->insertDataIntoTree((double)d["enter"]["Timestamp"].GetInt64(),
-                                            (double)d["leave"]["Timestamp"].GetInt64(),
-                                            d["Location"].GetString(),
-                                            d["Primitive"].GetString(),
-                                            d["intervalId"].GetString());
-            } else {}
-        };
-
-        ParseResult ok = reader.Parse(is, handler);
-        if (!ok) {
-            std::cerr << "Parse error: " 
-                    << GetParseError_En(ok.Code()) 
-                    << " at offset " << ok.Offset() << "\n";
+                esemanKDT->insertIntervalFile(interval_file);
+            }
+        } else if (!parseInput(args["input"], parse_threads, [](const IntervalChunk& chunk) {
+                if(agglomerateClusters != nullptr) {
+                    agglomerateClusters->insertIntervalChunk(chunk);
+                } else if(esemanIKDT != nullptr) {
+                    esemanIKDT->insertIntervalChunk(chunk);
+                } else if(esemanKDT != nullptr) {
+                    esemanKDT->insertIntervalChunk(chunk);
+                }
+            })) {
+            return 1;
         }
-        fclose(fp);
 
         if(eseman_model == ESEMAN_MODELS::AGC) {
             agglomerateClusters->buildAllAggClusters();
+        } else if(eseman_model == ESEMAN_MODELS::IKDT) {
+            if(!esemanIKDT->buildImplicitTrees()) {
+                cerr << "Failed to write the implicit KD-Tree" << endl;
+                return 1;
+            }
         } else {
-            esemanKDT->buildKDT();
+            if(!esemanKDT->buildKDT()) {
+                cerr << "Failed to write the KD-Tree" << endl;
+                return 1;
+            }
+        }
+    }
+
+    // If merge option is specified, combine the shards of all bundling tasks into one dataset
+    if(args.find("merge") != args.end()) {
+        if(eseman_model == ESEMAN_MODELS::AGC || eseman_model == ESEMAN_MODELS::IKDT) {
+            cerr << "Merging shards is only supported for the KDT and ODKDT models" << endl;
+            return 1;
+        }
+        if(!esemanKDT->mergeShards()) {
+            cerr << "Failed to merge the bundled shards" << endl;
+            return 1;
         }
     }
 
     if(args.find("start") != args.end()) {
         if(eseman_model == ESEMAN_MODELS::AGC) {
             startBoostServer(stoi(args["port"]));
+        } else if(eseman_model == ESEMAN_MODELS::IKDT) {
+            if(esemanIKDT->openImplicitFile()) {
+                startBoostServer(stoi(args["port"]));
+            } else {
+                cout << "ESEMAN implicit dataset not found on disk" << endl;
+            }
         } else {
             esemanKDT->openReadOnlyLMDB();
             if(esemanKDT->reloadNodesFromFile(true)) {    
@@ -5,6 +5,10 @@
 #include <cstdlib>
 #include <iomanip>
 #include <filesystem>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
@@ -15,6 +19,7 @@
 #include <boost/algorithm/string/predicate.hpp>
 
 #include "eseman_kdt.h"
+#include "eseman_ikdt.h"
 #include "agglomerate_clustering.h"
 
 #include "rapidjson/error/en.h"
@@ -23,6 +28,7 @@
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/filereadstream.h"
+#include "rapidjson/memorystream.h"
 
 using namespace rapidjson;
 using namespace std;
@@ -32,7 +38,7 @@ namespace http = beast::http;
 namespace net = boost::asio;
 using tcp = boost::asio::ip::tcp;
 
-//TODO: dynamically tune the buffer size for larger files to improve I/O performance
+// used for the config file and for inputs that cannot be memory mapped, bundling normally maps the input
 #define DEFAULT_READ_BUFFER_SIZE 256*1024 // 256KB
 
 // short name, long name, argument name, default value, description
@@ -41,7 +47,7 @@ typedef vector<tuple <string, string, string, string, string> > CMD_OPTIONS;
 typedef unordered_map<string, vector< tuple <string, bool, bool> > > GET_PARAMS;
 typedef unordered_map<string, string> STRING_DICT;
 
-enum class ESEMAN_MODELS { AGC, KDT, ODKDT };
+enum class ESEMAN_MODELS { AGC, KDT, ODKDT, IKDT };
 ESEMAN_MODELS eseman_model = ESEMAN_MODELS::KDT;
 
 GET_PARAMS get_params = {
@@ -64,5 +70,9 @@ GET_PARAMS get_params = {
 
 AgglomerateClusters *agglomerateClusters = nullptr;
 EseManKDT *esemanKDT = nullptr;
+EseManIKDT *esemanIKDT = nullptr;
+// the KD-Tree models take their query state from each session, agglomerative clustering keeps its own
+// and answers one query at a time
+mutex agc_query_mutex;
 
 #endif // ESEMAN_DATA_SERVER_H_
\ No newline at end of file
@@ -0,0 +1,408 @@
+#include "eseman_ikdt.h"
+
+void EseManIKDT::insertDataIntoTree(double start_time, double end_time, string track, string primitive_name, string interval_id) {
+    size_t track_index = trackColumns(track);
+    size_t primitive_index = event_data_attributes["primitive"].insert(primitive_name);
+    size_t id_index = event_data_attributes["ID"].insert(interval_id);
+    event_data_values[track_index].push((int64_t)start_time, (int64_t)end_time, (uint32_t)primitive_index, (uint32_t)id_index);
+}
+
+// index of the track's columns, a new track gets empty ones
+size_t EseManIKDT::trackColumns(const string& track) {
+    size_t track_index = event_tracks.insert(track);
+    if (track_index == event_data_values.size()) event_data_values.push_back(EventColumns());
+    return track_index;
+}
+
+void EseManIKDT::insertIntervalChunk(const IntervalChunk& chunk) {
+    forEachChunkInterval(chunk, event_data_attributes["primitive"], event_data_attributes["ID"],
+        [this](const string& track) { return trackColumns(track); },
+        [this](size_t track_index, int64_t start_time, int64_t end_time, uint32_t primitive_index, uint32_t id_index) {
+            event_data_values[track_index].push(start_time, end_time, primitive_index, id_index);
+        });
+}
+
+void EseManIKDT::insertIntervalFile(const IntervalFile& file) {
+    forEachFileInterval(file, event_data_attributes["primitive"], event_data_attributes["ID"],
+        [this](const string& track) { return trackColumns(track); },
+        [this](size_t track_index, int64_t start_time, int64_t end_time, uint32_t primitive_index, uint32_t id_index) {
+            event_data_values[track_index].push(start_time, end_time, primitive_index, id_index);
+        });
+}
+
+// fills the summaries of the internal nodes of [first, first + count) below heap_index
+static void fillImplicitSummaries(const EventColumns& columns, uint64_t heap_index, uint64_t first, uint64_t count,
+                                  vector<ImplicitSummary>& summaries) {
+    if (count < 2) return;
+    uint64_t left_count = count / 2;
+    summaries[heap_index].start_time = columns.times[2 * first];
+    summaries[heap_index].end_time = columns.times[2 * (first + count) - 1];
+    fillImplicitSummaries(columns, 2 * heap_index + 1, first, left_count, summaries);
+    fillImplicitSummaries(columns, 2 * heap_index + 2, first + left_count, count - left_count, summaries);
+}
+
+// interval positions of a track sorted by their value in the column, positions with the same value stay ascending
+static vector<uint32_t> implicitAttributeOrder(const vector<uint32_t>& values) {
+    vector<uint32_t> order(values.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = (uint32_t)i;
+    stable_sort(order.begin(), order.end(), [&values](uint32_t a, uint32_t b) { return values[a] < values[b]; });
+    return order;
+}
+
+// Sorts every track by start time and writes the implicit file into the dataset folder.
+// The file is written next to its final name and renamed into place once complete.
+bool EseManIKDT::buildImplicitTrees() {
+    IntervalOrderStats order_stats;
+    for (size_t t = 0; t < event_data_values.size(); ++t) {
+        EventColumns& columns = event_data_values[t];
+        bool is_sorted = isSortedByStart(columns);
+        if (!is_sorted) sortIntervalsByStart(columns);
+        IntervalOrderStats stats = checkIntervalOrder(columns);
+        stats.unsorted_tracks = is_sorted ? 0 : 1;
+        order_stats.add(stats);
+    }
+    reportIntervalOrder(order_stats);
+
+    ImplicitFileHeader file_header;
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.magic, ESEMAN_IMPLICIT_FILE_MAGIC, sizeof(file_header.magic));
+    file_header.version = ESEMAN_IMPLICIT_FILE_VERSION;
+    file_header.track_count = (uint32_t)event_data_values.size();
+
+    vector<ImplicitFileTrack> tracks(event_data_values.size());
+    for (size_t t = 0; t < event_data_values.size(); ++t) {
+        tracks[t].first_interval = file_header.interval_count;
+        tracks[t].interval_count = event_data_values[t].primitives.size();
+        tracks[t].first_summary = file_header.summary_count;
+        file_header.interval_count += tracks[t].interval_count;
+        file_header.summary_count += implicitSummaryCount(tracks[t].interval_count);
+    }
+
+    string file_path = implicitFilePath();
+    string tmp_path = file_path + ".tmp";
+    error_code ec;
+    filesystem::create_directories(node_storage_base_path + "/" + dataset_id, ec);
+    ofstream out(tmp_path, ios::binary | ios::trunc);
+    if (!out.is_open()) {
+        PRINTLOG("Failed to write implicit file: " << file_path);
+        return false;
+    }
+    out.write((const char*)&file_header, sizeof(file_header));
+    file_header.track_table_offset = out.tellp();
+    out.write((const char*)tracks.data(), tracks.size() * sizeof(ImplicitFileTrack));
+
+    file_header.start_times_offset = out.tellp();
+    for (const auto& c : event_data_values) {
+        for (size_t i = 0; i < c.times.size(); i += 2) out.write((const char*)&c.times[i], sizeof(int64_t));
+    }
+    file_header.end_times_offset = out.tellp();
+    for (const auto& c : event_data_values) {
+        for (size_t i = 1; i < c.times.size(); i += 2) out.write((const char*)&c.times[i], sizeof(int64_t));
+    }
+    file_header.primitive_indices_offset = out.tellp();
+    for (const auto& c : event_data_values) out.write((const char*)c.primitives.data(), c.primitives.size() * sizeof(uint32_t));
+    file_header.id_indices_offset = out.tellp();
+    for (const auto& c : event_data_values) out.write((const char*)c.ids.data(), c.ids.size() * sizeof(uint32_t));
+    file_header.primitive_order_offset = out.tellp();
+    for (const auto& c : event_data_values) {
+        vector<uint32_t> order = implicitAttributeOrder(c.primitives);
+        out.write((const char*)order.data(), order.size() * sizeof(uint32_t));
+    }
+    file_header.id_order_offset = out.tellp();
+    for (const auto& c : event_data_values) {
+        vector<uint32_t> order = implicitAttributeOrder(c.ids);
+        out.write((const char*)order.data(), order.size() * sizeof(uint32_t));
+    }
+    padIntervalFile(out);
+    file_header.summaries_offset = out.tellp();
+    for (size_t t = 0; t < event_data_values.size(); ++t) {
+        vector<ImplicitSummary> track_summaries(implicitSummaryCount(tracks[t].interval_count), ImplicitSummary{0, 0});
+        fillImplicitSummaries(event_data_values[t], 0, 0, tracks[t].interval_count, track_summaries);
+        out.write((const char*)track_summaries.data(), track_summaries.size() * sizeof(ImplicitSummary));
+    }
+    file_header.track_names_offset = out.tellp();
+    writeIntervalFileStrings(out, intervalFileStrings(event_tracks));
+    padIntervalFile(out);
+    file_header.primitive_names_offset = out.tellp();
+    writeIntervalFileStrings(out, intervalFileStrings(event_data_attributes["primitive"]));
+    padIntervalFile(out);
+    file_header.id_names_offset = out.tellp();
+    writeIntervalFileStrings(out, intervalFileStrings(event_data_attributes["ID"]));
+
+    out.seekp(0);
+    out.write((const char*)&file_header, sizeof(file_header));
+    out.close();
+    if (out.fail() || rename(tmp_path.c_str(), file_path.c_str()) != 0) {
+        PRINTLOG("Failed to write implicit file: " << file_path);
+        remove(tmp_path.c_str());
+        return false;
+    }
+    PRINTLOG("Wrote " << file_header.interval_count << " intervals of " << file_header.track_count << " tracks to " << file_path);
+    for (auto& c : event_data_values) c.clear();
+    return true;
+}
+
+bool EseManIKDT::validateImplicitFile() {
+    if (file_size < sizeof(ImplicitFileHeader)) return false;
+    header = (const ImplicitFileHeader*)data;
+    if (memcmp(header->magic, ESEMAN_IMPLICIT_FILE_MAGIC, sizeof(header->magic)) != 0) return false;
+    if (header->version != ESEMAN_IMPLICIT_FILE_VERSION) {
+        PRINTLOG("Unsupported implicit file version " << header->version);
+        return false;
+    }
+    uint64_t n = header->interval_count;
+    uint64_t s = header->summary_count;
+    if (n > file_size || s > file_size) return false;
+    if (!isSection(header->track_table_offset, header->track_count * sizeof(ImplicitFileTrack), sizeof(uint64_t))
+        || !isSection(header->start_times_offset, n * sizeof(int64_t), sizeof(int64_t))
+        || !isSection(header->end_times_offset, n * sizeof(int64_t), sizeof(int64_t))
+        || !isSection(header->primitive_indices_offset, n * sizeof(uint32_t), sizeof(uint32_t))
+        || !isSection(header->id_indices_offset, n * sizeof(uint32_t), sizeof(uint32_t))
+        || !isSection(header->primitive_order_offset, n * sizeof(uint32_t), sizeof(uint32_t))
+        || !isSection(header->id_order_offset, n * sizeof(uint32_t), sizeof(uint32_t))
+        || !isSection(header->summaries_offset, s * sizeof(ImplicitSummary), sizeof(int64_t))) return false;
+    track_table = (const ImplicitFileTrack*)(data + header->track_table_offset);
+    start_times = (const int64_t*)(data + header->start_times_offset);
+    end_times = (const int64_t*)(data + header->end_times_offset);
+    primitive_indices = (const uint32_t*)(data + header->primitive_indices_offset);
+    id_indices = (const uint32_t*)(data + header->id_indices_offset);
+    primitive_order = (const uint32_t*)(data + header->primitive_order_offset);
+    id_order = (const uint32_t*)(data + header->id_order_offset);
+    summaries = (const ImplicitSummary*)(data + header->summaries_offset);
+
+    IntervalFileStrings track_names, primitive_names, id_names;
+    if (!track_names.load(data, file_size, header->track_names_offset)
+        || !primitive_names.load(data, file_size, header->primitive_names_offset)
+        || !id_names.load(data, file_size, header->id_names_offset)) return false;
+    if (track_names.size() != header->track_count) return false;
+
+    for (size_t t = 0; t < header->track_count; ++t) {
+        const ImplicitFileTrack& track = track_table[t];
+        if (track.first_interval > n || track.interval_count > n - track.first_interval) return false;
+        if (track.first_summary > s || implicitSummaryCount(track.interval_count) > s - track.first_summary) return false;
+        // positions and indices are used without checks while querying
+        for (uint64_t i = track.first_interval; i < track.first_interval + track.interval_count; ++i) {
+            if (primitive_order[i] >= track.interval_count || id_order[i] >= track.interval_count) return false;
+            if (primitive_indices[i] >= primitive_names.size() || id_indices[i] >= id_names.size()) return false;
+        }
+    }
+
+    event_tracks.cleanMemory();
+    event_data_attributes.clear();
+    for (size_t i = 0; i < track_names.size(); ++i) event_tracks.insert(string(track_names[i]));
+    for (size_t i = 0; i < primitive_names.size(); ++i) event_data_attributes["primitive"].insert(string(primitive_names[i]));
+    for (size_t i = 0; i < id_names.size(); ++i) event_data_attributes["ID"].insert(string(id_names[i]));
+    return true;
+}
+
+// maps the dataset's implicit file for querying
+bool EseManIKDT::openImplicitFile() {
+    closeImplicitFile();
+    string file_path = implicitFilePath();
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        PRINTLOG("Failed to open implicit file: " << file_path);
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) return false;
+    data = (const char*)mapped;
+    file_size = file_stat.st_size;
+    if (!validateImplicitFile()) {
+        PRINTLOG("Invalid implicit file: " << file_path);
+        closeImplicitFile();
+        return false;
+    }
+    return true;
+}
+
+void EseManIKDT::closeImplicitFile() {
+    if (data) munmap((void*)data, file_size);
+    data = nullptr;
+    file_size = 0;
+    header = nullptr;
+}
+
+// true if an interval in [first, first + count) of the track has the value, found with one binary search
+// over the track's (value, position) order
+bool EseManIKDT::rangeHasAttributeValue(size_t track_index, const string& key, size_t value, uint64_t first, uint64_t count) const {
+    const uint32_t* values;
+    const uint32_t* order;
+    if (key == "primitive") {
+        values = primitive_indices;
+        order = primitive_order;
+    } else if (key == "ID") {
+        values = id_indices;
+        order = id_order;
+    } else {
+        return false;
+    }
+    const ImplicitFileTrack& track = track_table[track_index];
+    values += track.first_interval;
+    order += track.first_interval;
+    const uint32_t* it = lower_bound(order, order + track.interval_count, first, [values, value](uint32_t position, uint64_t first) {
+        return values[position] < value || (values[position] == value && position < first);
+    });
+    return it != order + track.interval_count && values[*it] == value && *it < first + count;
+}
+
+bool EseManIKDT::checkFiltersSatisfied(const EsemanQueryContext& context, size_t track_index, uint64_t first, uint64_t count) const {
+    for (const auto& filter : context.filters) {
+        for (const auto& [key, value] : filter) {
+            const size_t* attr_index = get_if<size_t>(&value);
+            if (!attr_index) continue;
+            if (!rangeHasAttributeValue(track_index, key, *attr_index, first, count)) return false;
+        }
+    }
+    return true;
+}
+
+// Same search as EseManKDT::findClusters with the FAIR rule. A node is its heap index and interval range,
+// the children are computed from them, so nothing is looked up or allocated on the way down.
+void EseManIKDT::findClusters(EsemanIKDTQueryContext& context, size_t track_index, int64_t start_t, int64_t end_t, int64_t bin_size, vector<int64_t> &results) {
+    const ImplicitFileTrack& track = track_table[track_index];
+    if (track.interval_count == 0) return;
+    const int64_t* track_starts = start_times + track.first_interval;
+    const int64_t* track_ends = end_times + track.first_interval;
+    const uint32_t* attribute_indices = context.return_attribute_key == "primitive" ? primitive_indices : id_indices;
+    const ImplicitSummary* track_summaries = summaries + track.first_summary;
+
+    context.traversal_stack.clear();
+    context.traversal_stack.push_back({0, 0, track.interval_count, 0});
+
+    while (!context.traversal_stack.empty()) {
+        context.nodes_visited++;
+        ImplicitTraversalItem current = context.traversal_stack.back();
+        context.traversal_stack.pop_back();
+
+        if (context.has_filter_query && !checkFiltersSatisfied(context, track_index, current.first, current.count)) continue;
+
+        bool is_leaf = current.count == 1;
+        int64_t start_time = is_leaf ? track_starts[current.first] : track_summaries[current.heap_index].start_time;
+        int64_t end_time = is_leaf ? track_ends[current.first] : track_summaries[current.heap_index].end_time;
+        if (start_time >= end_t || end_time <= start_t) continue;
+
+        if (bin_size >= (end_time - start_time + 1) || is_leaf) {
+            if (bin_size < (end_time - start_time + 1)) {
+                start_time = max(start_time, start_t);
+                end_time = min(end_time, end_t);
+            }
+            if (context.has_return_attribute_key) {
+                // the attribute of the node's first interval
+                results.push_back((int64_t)attribute_indices[track.first_interval + current.first]);
+            } else {
+                results.push_back(start_time);
+                results.push_back(end_time);
+            }
+            context.max_depth_reached = std::max(context.max_depth_reached, current.depth);
+            continue;
+        }
+
+        // Push right child first (so left child gets processed first when popped)
+        uint64_t left_count = current.count / 2;
+        context.traversal_stack.push_back({2 * current.heap_index + 2, current.first + left_count, current.count - left_count, current.depth + 1});
+        context.traversal_stack.push_back({2 * current.heap_index + 1, current.first, left_count, current.depth + 1});
+    }
+}
+
+vector<double> EseManIKDT::binnedRangeQueryPerTrack(EsemanIKDTQueryContext& context, int64_t time_begin, int64_t time_end, size_t track_index, uint64_t bins) {
+    uint64_t bin_size(getBinSize(time_begin, time_end, bins));
+    vector<int64_t> data_short_list;
+    findClusters(context, track_index, time_begin, time_end, (int64_t)bin_size*horizontal_resolution_divisor, data_short_list);
+    return rasterizeClusters(data_short_list, time_begin, time_end, bins);
+}
+
+// the span of the track's root
+void EseManIKDT::trackSpan(size_t track_index, int64_t& start_time, int64_t& end_time) const {
+    const ImplicitFileTrack& track = track_table[track_index];
+    if (track.interval_count == 1) {
+        start_time = start_times[track.first_interval];
+        end_time = end_times[track.first_interval];
+    } else if (track.interval_count > 1) {
+        start_time = summaries[track.first_summary].start_time;
+        end_time = summaries[track.first_summary].end_time;
+    }
+}
+
+tuple<LocDict, int64_t, int64_t> EseManIKDT::binnedRangeQuery(EsemanIKDTQueryContext& context,
+                                    int64_t i_time_begin,
+                                    int64_t i_time_end,
+                                    vector<string> &locations,
+                                    uint64_t bins){
+    LocDict locDict;
+    PRINTLOG("Got EseMan IKDT binned range query");
+    if (!header) return make_tuple(locDict, i_time_begin, i_time_end);
+
+    context.resolveFilters(event_data_attributes);
+    bool is_filtered = context.has_filter_query;
+
+    int total_nodes_visited = 0;
+    context.max_depth_reached = 0;
+    context.has_return_attribute_key = false;
+    chrono::steady_clock::time_point clock_begin = chrono::steady_clock::now();
+    if(locations.size() == 0) {
+        for(size_t i = 0; i < event_tracks.size(); i++) {
+            locations.push_back(event_tracks[i]);
+        }
+    }
+    if(i_time_begin < 0 || i_time_end < 0) {
+        int64_t global_start_time = std::numeric_limits<int64_t>::max();
+        int64_t global_end_time = 0;
+        for (const string& loc : locations) {
+            size_t track_index = event_tracks.get_track_index(loc);
+            if(track_index == event_tracks.size() || track_table[track_index].interval_count == 0) continue;
+            int64_t start_time = 0, end_time = 0;
+            trackSpan(track_index, start_time, end_time);
+            global_start_time = std::min(global_start_time, start_time);
+            global_end_time = std::max(global_end_time, end_time);
+        }
+        if(i_time_begin < 0) i_time_begin = global_start_time - 10;
+        if(i_time_end < 0) i_time_end = global_end_time + 10;
+    }
+
+    for (const string& loc : locations) {
+        size_t track_index = event_tracks.get_track_index(loc);
+        if(track_index == event_tracks.size()) {
+            PRINTLOG("Track not found in event tracks " << loc);
+            continue;
+        }
+        context.nodes_visited = 0;
+        locDict[stol(loc)] = binnedRangeQueryPerTrack(context, i_time_begin, i_time_end, track_index, bins);
+        total_nodes_visited += context.nodes_visited;
+    }
+    chrono::steady_clock::time_point clock_end = chrono::steady_clock::now();
+
+    context.finishQuery(); // automatically clear filters after query
+
+    cout << "ESEMAN_IMPLICIT,ds_window";
+    if(is_filtered) cout << "_cond";
+    cout << "," << i_time_begin << "," << i_time_end << ","
+        << horizontal_resolution_divisor << ","
+        << chrono::duration_cast<chrono::microseconds>(clock_end - clock_begin).count() << ","
+        << total_nodes_visited
+        << endl;
+    return make_tuple(locDict, i_time_begin, i_time_end);
+}
+
+string EseManIKDT::findNearestEvent(EsemanIKDTQueryContext& context, uint64_t cTime, uint64_t cLocation) {
+    string ret_result("");
+    if (!header) return ret_result;
+    size_t track_index = event_tracks.get_track_index(to_string(cLocation));
+    if (track_index == event_tracks.size()) return ret_result;
+
+    context.return_attribute_key = "ID";
+    context.has_return_attribute_key = true;
+    vector<int64_t> data_short_list;
+    uint64_t bin_size(getBinSize(cTime, cTime+1, 1));
+    findClusters(context, track_index, cTime, cTime+1, (int64_t)bin_size, data_short_list);
+    auto ids = event_data_attributes.find("ID");
+    if(data_short_list.size() > 0 && ids != event_data_attributes.end()) ret_result = ids->second[data_short_list[0]];
+    context.finishQuery();
+    return ret_result;
+}
@@ -0,0 +1,175 @@
+#ifndef ESEMAN_IKDT_H_
+#define ESEMAN_IKDT_H_
+
+#include "eseman_commons.h"
+#include "eseman_interval_file.h"
+#include <filesystem>
+
+// =======================================
+// Implicit KD-Tree file
+// =======================================
+// The FAIR rule always gives the first floor(n / 2) intervals of a node to its left child, so the tree of a
+// track is fully determined by its sorted interval array. The implicit model stores only that array and a
+// summary of the internal nodes in level order (children of node i at 2i + 1 and 2i + 2), and walks the
+// tree with index arithmetic over the memory mapped file. A node's interval range is carried down the
+// traversal, the leaves are the intervals themselves.
+//
+// All values are in host byte order and every section starts at an 8 byte aligned offset.
+//
+//   ImplicitFileHeader                    magic "ESEMANIK", version and the offsets of the sections below
+//   track table                           track_count x ImplicitFileTrack
+//   start times, end times                int64[interval_count] each, every track sorted by start time
+//   primitive indices, id indices         uint32[interval_count] each
+//   primitive order, id order             uint32[interval_count] each, per track the interval positions
+//                                         sorted by (index, position), used to check filters on a range
+//   summaries                             summary_count x ImplicitSummary
+//   track names, primitive names, ids     string tables as in eseman_interval_file.h
+
+#define ESEMAN_IMPLICIT_FILE_NAME     "eseman_implicit.dat"
+#define ESEMAN_IMPLICIT_FILE_MAGIC    "ESEMANIK"
+#define ESEMAN_IMPLICIT_FILE_VERSION  1
+
+struct ImplicitFileHeader {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  track_count;
+  uint64_t  interval_count;
+  uint64_t  summary_count;
+  uint64_t  track_table_offset;
+  uint64_t  start_times_offset;
+  uint64_t  end_times_offset;
+  uint64_t  primitive_indices_offset;
+  uint64_t  id_indices_offset;
+  uint64_t  primitive_order_offset;
+  uint64_t  id_order_offset;
+  uint64_t  summaries_offset;
+  uint64_t  track_names_offset;
+  uint64_t  primitive_names_offset;
+  uint64_t  id_names_offset;
+};
+
+struct ImplicitFileTrack {
+  uint64_t  first_interval;
+  uint64_t  interval_count;
+  uint64_t  first_summary;
+};
+
+// span of an internal node, the start of its first interval and the end of its last one like the KDT
+struct ImplicitSummary {
+  int64_t   start_time;
+  int64_t   end_time;
+};
+
+// internal nodes of a track with n intervals fit into the levels above the deepest leaf, ceil(log2 n) deep
+inline uint64_t implicitSummaryCount(uint64_t interval_count) {
+  uint64_t levels = 0;
+  while (((uint64_t)1 << levels) < interval_count) levels++;
+  return ((uint64_t)1 << levels) - 1;
+}
+
+struct ImplicitTraversalItem {
+  uint64_t  heap_index;
+  uint64_t  first;      // first interval of the node, relative to the track
+  uint64_t  count;
+  int       depth;
+};
+
+// query state of the implicit model, the traversal stack is reused across the context's queries so
+// traversal does not allocate
+struct EsemanIKDTQueryContext : public EsemanQueryContext {
+  vector<ImplicitTraversalItem> traversal_stack;
+};
+
+class EseManIKDT {
+private:
+
+  StringIndexMapper           event_tracks;
+  vector<EventColumns>        event_data_values;
+  AttributeDict               event_data_attributes;
+  EsemanIKDTQueryContext      default_context; // for callers on a single thread that use the filter methods below
+  string                      dataset_id = "default_dataset";
+
+  // the mapped file, see above
+  const char*                 data = nullptr;
+  size_t                      file_size = 0;
+  const ImplicitFileHeader*   header = nullptr;
+  const ImplicitFileTrack*    track_table = nullptr;
+  const int64_t*              start_times = nullptr;
+  const int64_t*              end_times = nullptr;
+  const uint32_t*             primitive_indices = nullptr;
+  const uint32_t*             id_indices = nullptr;
+  const uint32_t*             primitive_order = nullptr;
+  const uint32_t*             id_order = nullptr;
+  const ImplicitSummary*      summaries = nullptr;
+
+  inline bool isSection(uint64_t offset, uint64_t length, size_t alignment) const {
+    return offset % alignment == 0 && offset <= file_size && length <= file_size - offset;
+  }
+  bool validateImplicitFile();
+  size_t trackColumns(const string& track);
+  string implicitFilePath() const {
+    return node_storage_base_path + "/" + dataset_id + "/" + ESEMAN_IMPLICIT_FILE_NAME;
+  }
+
+  bool rangeHasAttributeValue(size_t track_index, const string& key, size_t value, uint64_t first, uint64_t count) const;
+  bool checkFiltersSatisfied(const EsemanQueryContext& context, size_t track_index, uint64_t first, uint64_t count) const;
+  void findClusters(EsemanIKDTQueryContext& context, size_t track_index, int64_t start_t, int64_t end_t, int64_t bin_size,
+                    vector<int64_t> &results);
+  vector<double> binnedRangeQueryPerTrack(EsemanIKDTQueryContext& context, int64_t time_begin, int64_t time_end,
+                                          size_t track_index, uint64_t bins);
+  void trackSpan(size_t track_index, int64_t& start_time, int64_t& end_time) const;
+
+public:
+  int                 horizontal_resolution_divisor = 1;
+  string              node_storage_base_path = ".";
+
+  EseManIKDT() {}
+  EseManIKDT(const EseManIKDT&) = delete;
+  EseManIKDT& operator=(const EseManIKDT&) = delete;
+  ~EseManIKDT() {
+    closeImplicitFile();
+    event_tracks.cleanMemory();
+    event_data_values.clear();
+    event_data_attributes.clear();
+  }
+
+  void setDatasetID(const string& ds_id) {
+    dataset_id = ds_id;
+  }
+  void insertDataIntoTree(double start_time, double end_time, string track, string primitive_name, string interval_id);
+  void insertIntervalChunk(const IntervalChunk& chunk);
+  void insertIntervalFile(const IntervalFile& file);
+  bool buildImplicitTrees();
+
+  bool openImplicitFile();
+  void closeImplicitFile();
+
+  void addPrimitiveFilter(string primitive_filter) {
+    default_context.addPrimitiveFilter(primitive_filter);
+  }
+  void addIDFilter(string id_filter) {
+    default_context.addIDFilter(id_filter);
+  }
+  void clearPrimitiveFilters() {
+    default_context.clearPrimitiveFilters();
+  }
+
+  // queries for concurrent callers, each brings its own context and sets its filters on it. The mapped
+  // file and the dictionaries are only read.
+  tuple<LocDict, int64_t, int64_t> binnedRangeQuery(EsemanIKDTQueryContext& context,
+                          int64_t i_time_begin, int64_t i_time_end,
+                          vector<string> &locations,
+                          uint64_t bins);
+  string findNearestEvent(EsemanIKDTQueryContext& context, uint64_t cTime, uint64_t cLocation);
+
+  tuple<LocDict, int64_t, int64_t> binnedRangeQuery(int64_t i_time_begin, int64_t i_time_end,
+                          vector<string> &locations,
+                          uint64_t bins) {
+    return binnedRangeQuery(default_context, i_time_begin, i_time_end, locations, bins);
+  }
+  string findNearestEvent(uint64_t cTime, uint64_t cLocation) {
+    return findNearestEvent(default_context, cTime, cLocation);
+  }
+};
+
+#endif
@@ -0,0 +1,302 @@
+#ifndef ESEMAN_INTERVAL_FILE_H
+#define ESEMAN_INTERVAL_FILE_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string_view>
+
+#include "eseman_commons.h"
+
+// =======================================
+// Binary interval file
+// =======================================
+// A columnar copy of a parsed input, written by `eseman_data_server -c` and accepted by `-b -i` in place of
+// the JSON. Bundling from it only maps the file and copies the columns, nothing is parsed.
+//
+// All values are in host byte order and every section starts at an 8 byte aligned offset.
+//
+//   IntervalFileHeader                    magic "ESEMANIV", version and the offsets of the sections below
+//   track table                           track_count x IntervalFileTrack
+//   times                                 int64[2 * interval_count], start and end of each interval
+//   primitive indices                     uint32[interval_count], index into the primitive names
+//   id indices                            uint32[interval_count], index into the id names
+//   track names, primitive names, ids     three string tables
+//
+// The intervals of a track are contiguous and in the order the track received them while parsing, which is
+// time order for trace inputs. Tracks are stored in the order they were first seen.
+// A string table is a uint64 count, then count + 1 uint64 offsets relative to the end of the offsets,
+// then the string bytes. String i spans [offsets[i], offsets[i + 1]).
+
+#define ESEMAN_INTERVAL_FILE_MAGIC "ESEMANIV"
+#define ESEMAN_INTERVAL_FILE_VERSION 1
+
+struct IntervalFileHeader {
+  char      magic[8];
+  uint32_t  version;
+  uint32_t  track_count;
+  uint64_t  interval_count;
+  uint64_t  track_table_offset;
+  uint64_t  times_offset;
+  uint64_t  primitive_indices_offset;
+  uint64_t  id_indices_offset;
+  uint64_t  track_names_offset;
+  uint64_t  primitive_names_offset;
+  uint64_t  id_names_offset;
+};
+
+struct IntervalFileTrack {
+  uint64_t  first_interval;
+  uint64_t  interval_count;
+};
+
+// string table inside the mapped file
+class IntervalFileStrings {
+  private:
+    const uint64_t* offsets = nullptr;
+    const char*     bytes = nullptr;
+    size_t          count = 0;
+
+  public:
+    // validates the table at offset, returns false if it does not fit into the file
+    bool load(const char* data, size_t file_size, uint64_t offset) {
+      if (offset % sizeof(uint64_t) != 0 || offset > file_size || file_size - offset < sizeof(uint64_t)) return false;
+      uint64_t c_count;
+      memcpy(&c_count, data + offset, sizeof(uint64_t));
+      size_t available = (file_size - offset) / sizeof(uint64_t) - 1;
+      if (c_count >= available) return false;
+      offsets = (const uint64_t*)(data + offset + sizeof(uint64_t));
+      bytes = (const char*)(offsets + c_count + 1);
+      count = c_count;
+      size_t byte_limit = file_size - (bytes - data);
+      for (size_t i = 0; i < count; ++i) {
+        if (offsets[i] > offsets[i + 1]) return false;
+      }
+      return offsets[0] == 0 && offsets[count] <= byte_limit;
+    }
+    inline size_t size() const { return count; }
+    inline string_view operator[](size_t idx) const {
+      return string_view(bytes + offsets[idx], offsets[idx + 1] - offsets[idx]);
+    }
+};
+
+// Read only view of a memory mapped interval file
+class IntervalFile {
+  private:
+    const char*                 data = nullptr;
+    size_t                      file_size = 0;
+    const IntervalFileHeader*   header = nullptr;
+    const IntervalFileTrack*    track_table = nullptr;
+    const int64_t*              times = nullptr;
+    const uint32_t*             primitive_indices = nullptr;
+    const uint32_t*             id_indices = nullptr;
+    IntervalFileStrings         track_names;
+    IntervalFileStrings         primitive_names;
+    IntervalFileStrings         id_names;
+
+    // true if [offset, offset + length) lies inside the file and offset is aligned for the column type
+    inline bool isSection(uint64_t offset, uint64_t length, size_t alignment) const {
+      return offset % alignment == 0 && offset <= file_size && length <= file_size - offset;
+    }
+    bool validate() {
+      if (file_size < sizeof(IntervalFileHeader)) return false;
+      header = (const IntervalFileHeader*)data;
+      if (memcmp(header->magic, ESEMAN_INTERVAL_FILE_MAGIC, sizeof(header->magic)) != 0) return false;
+      if (header->version != ESEMAN_INTERVAL_FILE_VERSION) {
+        PRINTLOG("Unsupported interval file version " << header->version);
+        return false;
+      }
+      uint64_t n = header->interval_count;
+      if (n > file_size) return false;
+      if (!isSection(header->track_table_offset, header->track_count * sizeof(IntervalFileTrack), sizeof(uint64_t))
+          || !isSection(header->times_offset, 2 * n * sizeof(int64_t), sizeof(int64_t))
+          || !isSection(header->primitive_indices_offset, n * sizeof(uint32_t), sizeof(uint32_t))
+          || !isSection(header->id_indices_offset, n * sizeof(uint32_t), sizeof(uint32_t))) return false;
+      track_table = (const IntervalFileTrack*)(data + header->track_table_offset);
+      times = (const int64_t*)(data + header->times_offset);
+      primitive_indices = (const uint32_t*)(data + header->primitive_indices_offset);
+      id_indices = (const uint32_t*)(data + header->id_indices_offset);
+      if (!track_names.load(data, file_size, header->track_names_offset)
+          || !primitive_names.load(data, file_size, header->primitive_names_offset)
+          || !id_names.load(data, file_size, header->id_names_offset)) return false;
+      if (track_names.size() != header->track_count) return false;
+
+      for (size_t t = 0; t < header->track_count; ++t) {
+        if (track_table[t].first_interval > n || track_table[t].interval_count > n - track_table[t].first_interval) return false;
+      }
+      // the indices are used without checks while bundling
+      for (size_t i = 0; i < n; ++i) {
+        if (primitive_indices[i] >= primitive_names.size() || id_indices[i] >= id_names.size()) return false;
+      }
+      return true;
+    }
+
+  public:
+    IntervalFile() {}
+    IntervalFile(const IntervalFile&) = delete;
+    IntervalFile& operator=(const IntervalFile&) = delete;
+    ~IntervalFile() {
+      close();
+    }
+
+    // true if the file starts with the interval file magic, inputs without it are parsed as JSON
+    static bool isIntervalFile(const string& file_name) {
+      char magic[sizeof(IntervalFileHeader::magic)];
+      ifstream in(file_name, ios::binary);
+      if (!in.read(magic, sizeof(magic))) return false;
+      return memcmp(magic, ESEMAN_INTERVAL_FILE_MAGIC, sizeof(magic)) == 0;
+    }
+
+    bool open(const string& file_name) {
+      close();
+      int fd = ::open(file_name.c_str(), O_RDONLY);
+      if (fd < 0) return false;
+      struct stat file_stat;
+      if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        ::close(fd);
+        return false;
+      }
+      void* mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (mapped == MAP_FAILED) return false;
+      data = (const char*)mapped;
+      file_size = file_stat.st_size;
+      if (!validate()) {
+        PRINTLOG("Invalid interval file: " << file_name);
+        close();
+        return false;
+      }
+      return true;
+    }
+
+    void close() {
+      if (data) munmap((void*)data, file_size);
+      data = nullptr;
+      file_size = 0;
+      header = nullptr;
+    }
+
+    inline size_t trackCount() const { return header->track_count; }
+    inline size_t intervalCount() const { return header->interval_count; }
+    inline string_view trackName(size_t track) const { return track_names[track]; }
+    inline size_t trackIntervalCount(size_t track) const { return track_table[track].interval_count; }
+    // start and end of the track's intervals, interleaved
+    inline const int64_t* trackTimes(size_t track) const { return times + 2 * track_table[track].first_interval; }
+    inline const uint32_t* trackPrimitiveIndices(size_t track) const { return primitive_indices + track_table[track].first_interval; }
+    inline const uint32_t* trackIDIndices(size_t track) const { return id_indices + track_table[track].first_interval; }
+    inline const IntervalFileStrings& primitiveNames() const { return primitive_names; }
+    inline const IntervalFileStrings& idNames() const { return id_names; }
+};
+
+// maps every string of a file's string table to its index in the model's dictionary
+inline vector<uint32_t> mapIntervalFileDictionary(const IntervalFileStrings& names, StringIndexMapper& dictionary) {
+  vector<uint32_t> index_map(names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    index_map[i] = (uint32_t)dictionary.insert(string(names[i]));
+  }
+  return index_map;
+}
+
+// Walks a mapped interval file track by track for a model, with the callbacks of forEachChunkInterval.
+// Dictionaries are filled in file order, so loading a file into an empty model gives the same indices as
+// parsing the JSON it was converted from.
+template <typename MapTrack, typename Push>
+inline void forEachFileInterval(const IntervalFile& file, StringIndexMapper& primitives, StringIndexMapper& ids,
+                                MapTrack map_track, Push push) {
+  vector<uint32_t> primitive_map = mapIntervalFileDictionary(file.primitiveNames(), primitives);
+  vector<uint32_t> id_map = mapIntervalFileDictionary(file.idNames(), ids);
+
+  for (size_t t = 0; t < file.trackCount(); ++t) {
+    auto track = map_track(string(file.trackName(t)));
+    const int64_t* times = file.trackTimes(t);
+    const uint32_t* primitive_indices = file.trackPrimitiveIndices(t);
+    const uint32_t* id_indices = file.trackIDIndices(t);
+    for (size_t i = 0; i < file.trackIntervalCount(t); ++i) {
+      push(track, times[2*i], times[2*i+1], primitive_map[primitive_indices[i]], id_map[id_indices[i]]);
+    }
+  }
+}
+
+inline void writeIntervalFileStrings(ofstream& out, const vector<string_view>& strings) {
+  uint64_t count = strings.size();
+  out.write((const char*)&count, sizeof(count));
+  uint64_t offset = 0;
+  out.write((const char*)&offset, sizeof(offset));
+  for (const auto& s : strings) {
+    offset += s.size();
+    out.write((const char*)&offset, sizeof(offset));
+  }
+  for (const auto& s : strings) out.write(s.data(), s.size());
+}
+
+inline void padIntervalFile(ofstream& out) {
+  static const char zeros[sizeof(uint64_t)] = {0};
+  size_t remainder = (size_t)out.tellp() % sizeof(uint64_t);
+  if (remainder) out.write(zeros, sizeof(uint64_t) - remainder);
+}
+
+inline vector<string_view> intervalFileStrings(const StringIndexMapper& dictionary) {
+  vector<string_view> strings;
+  strings.reserve(dictionary.size());
+  for (size_t i = 0; i < dictionary.size(); ++i) strings.push_back(dictionary[i]);
+  return strings;
+}
+
+// Writes the ingested columns of every track, tracks[i] owns columns[i].
+// The file is written next to file_name and renamed into place once complete.
+inline bool writeIntervalFile(const string& file_name,
+                              const StringIndexMapper& tracks,
+                              const vector<EventColumns>& columns,
+                              const StringIndexMapper& primitives,
+                              const StringIndexMapper& ids) {
+  IntervalFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ESEMAN_INTERVAL_FILE_MAGIC, sizeof(header.magic));
+  header.version = ESEMAN_INTERVAL_FILE_VERSION;
+  header.track_count = (uint32_t)columns.size();
+
+  vector<IntervalFileTrack> track_table(columns.size());
+  for (size_t t = 0; t < columns.size(); ++t) {
+    track_table[t].first_interval = header.interval_count;
+    track_table[t].interval_count = columns[t].primitives.size();
+    header.interval_count += track_table[t].interval_count;
+  }
+
+  string tmp_name = file_name + ".tmp";
+  ofstream out(tmp_name, ios::binary | ios::trunc);
+  if (!out.is_open()) {
+    PRINTLOG("Failed to write interval file: " << file_name);
+    return false;
+  }
+  out.write((const char*)&header, sizeof(header));
+  header.track_table_offset = out.tellp();
+  out.write((const char*)track_table.data(), track_table.size() * sizeof(IntervalFileTrack));
+  header.times_offset = out.tellp();
+  for (const auto& c : columns) out.write((const char*)c.times.data(), c.times.size() * sizeof(int64_t));
+  header.primitive_indices_offset = out.tellp();
+  for (const auto& c : columns) out.write((const char*)c.primitives.data(), c.primitives.size() * sizeof(uint32_t));
+  header.id_indices_offset = out.tellp();
+  for (const auto& c : columns) out.write((const char*)c.ids.data(), c.ids.size() * sizeof(uint32_t));
+  padIntervalFile(out);
+  header.track_names_offset = out.tellp();
+  writeIntervalFileStrings(out, intervalFileStrings(tracks));
+  padIntervalFile(out);
+  header.primitive_names_offset = out.tellp();
+  writeIntervalFileStrings(out, intervalFileStrings(primitives));
+  padIntervalFile(out);
+  header.id_names_offset = out.tellp();
+  writeIntervalFileStrings(out, intervalFileStrings(ids));
+
+  out.seekp(0);
+  out.write((const char*)&header, sizeof(header));
+  out.close();
+  if (out.fail() || rename(tmp_name.c_str(), file_name.c_str()) != 0) {
+    PRINTLOG("Failed to write interval file: " << file_name);
+    remove(tmp_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+#endif // ESEMAN_INTERVAL_FILE_H
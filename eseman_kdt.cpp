@@ -40,18 +40,48 @@ vector<string> EsemanNode::getAttributeKeys() {
 }
 
 void EsemanNode::addAttribute(const string& key, const int attr_index) {
-    if(!hasAttribute(key)) {
-      attribute_lists[key] = unordered_set<size_t>();
-    }
-    attribute_lists[key].insert(attr_index);
-    // int v_index = attr_index / 64;
-    // int v_bit = attr_index % 64;
-    // uint64_t mask = 1ULL << v_bit;
-    // while (attribute_lists[key].size() <= v_index) {
-    //   attribute_lists[key].push_back(0);
-    // }
-    // uint64_t& value = attribute_lists[key][v_index];
-    // value |= mask;
+    attribute_lists[key].insert((uint32_t)attr_index);
+}
+
+// union a finished child's attribute sets into this node; an empty set takes over the child's containers
+// since the child's sets are not needed after this
+void EsemanNode::mergeAttributes(AttributeList& child_attributes) {
+    for (auto& [key, indexes] : child_attributes) {
+        auto& own = attribute_lists[key];
+        if (own.empty()) own.swap(indexes);
+        else own.unionWith(indexes);
+    }
+}
+
+// EsemanAttributeView functions
+EsemanBitmapView EsemanAttributeView::findAttribute(const string& key) const {
+    if (!isValid()) return EsemanBitmapView();
+    size_t offset = bucketAttributeBlockSize(bucket_intervals);
+    for (uint16_t i = 0; i < attribute_count; i++) {
+        if (offset + sizeof(uint8_t) > size) return EsemanBitmapView();
+        uint8_t key_length = readAt<uint8_t>(offset);
+        offset += sizeof(uint8_t);
+        if (offset + key_length > size) return EsemanBitmapView();
+        const char* c_key = data + offset;
+        offset += key_length;
+        EsemanBitmapView values(data + offset, size - offset);
+        if (!values.isValid() || values.byteSize() > size - offset) return EsemanBitmapView();
+        if (key_length == key.size() && memcmp(c_key, key.data(), key_length) == 0) return values;
+        offset += values.byteSize();
+    }
+    return EsemanBitmapView();
+}
+
+// the bitmap is looked up in place without decoding it
+bool EsemanAttributeView::hasAttributeValue(const string& key, size_t value) const {
+    return value <= UINT32_MAX && findAttribute(key).contains((uint32_t)value);
+}
+
+bool EsemanAttributeView::firstAttributeValue(const string& key, size_t& value) const {
+    uint32_t c_value;
+    if (!findAttribute(key).first(c_value)) return false;
+    value = c_value;
+    return true;
 }
 
 void EseManKDT::insertDataIntoTree(double start_time, double end_time, string track, string primitive_name, string interval_id) {
@@ -62,20 +92,56 @@ void EseManKDT::insertDataIntoTree(double start_time, double end_time, string tr
     } else if(track_index == event_tracks.size()) {
         event_tracks.insert(track);
         track_index = event_tracks.get_track_index(track);
-        event_data_values.push_back(EventDictList());
+        event_data_values.push_back(EventColumns());
     }
-    event_data_values[track_index].push_back(EventDict{{"time",start_time},{"primitive", primitive_name},{"ID", interval_id}});
-    event_data_values[track_index].push_back(EventDict{{"time",end_time},{"primitive", primitive_name},{"ID", interval_id}});
-    
+
     if(event_data_attributes.find("primitive") == event_data_attributes.end()) {
         event_data_attributes.insert(make_pair("primitive", StringIndexMapper()));
     }
-    event_data_attributes["primitive"].insert(primitive_name);
+    size_t primitive_index = event_data_attributes["primitive"].insert(primitive_name);
 
     if(event_data_attributes.find("ID") == event_data_attributes.end()) {
         event_data_attributes.insert(make_pair("ID", StringIndexMapper()));
     }
-    event_data_attributes["ID"].insert(interval_id);
+    size_t id_index = event_data_attributes["ID"].insert(interval_id);
+
+    pushInterval(track_index, (int64_t)start_time, (int64_t)end_time, (uint32_t)primitive_index, (uint32_t)id_index);
+}
+
+// index of the track's columns, a new track gets empty ones
+size_t EseManKDT::trackColumns(const string& track) {
+    size_t track_index = event_tracks.insert(track);
+    if (track_index == event_data_values.size()) event_data_values.push_back(EventColumns());
+    return track_index;
+}
+
+// appends an interval with the model's dictionary indices, checking the memory budget like every insert
+void EseManKDT::pushInterval(size_t track_index, int64_t start_time, int64_t end_time, uint32_t primitive_index, uint32_t id_index) {
+    event_data_values[track_index].push(start_time, end_time, primitive_index, id_index);
+    resident_column_bytes += ESEMAN_INTERVAL_COLUMN_BYTES;
+    checkMemoryBudget();
+}
+
+void EseManKDT::insertIntervalChunk(const IntervalChunk& chunk) {
+    forEachChunkInterval(chunk, event_data_attributes["primitive"], event_data_attributes["ID"],
+        [this](const string& track) { return trackColumns(track); },
+        [this](size_t track_index, int64_t start_time, int64_t end_time, uint32_t primitive_index, uint32_t id_index) {
+            pushInterval(track_index, start_time, end_time, primitive_index, id_index);
+        });
+}
+
+void EseManKDT::insertIntervalFile(const IntervalFile& file) {
+    forEachFileInterval(file, event_data_attributes["primitive"], event_data_attributes["ID"],
+        [this](const string& track) { return trackColumns(track); },
+        [this](size_t track_index, int64_t start_time, int64_t end_time, uint32_t primitive_index, uint32_t id_index) {
+            pushInterval(track_index, start_time, end_time, primitive_index, id_index);
+        });
+}
+
+// Writes the ingested intervals as a binary interval file, see eseman_interval_file.h
+bool EseManKDT::saveIntervalFile(const string& file_name) {
+    return writeIntervalFile(file_name, event_tracks, event_data_values,
+                             event_data_attributes["primitive"], event_data_attributes["ID"]);
 }
 
 void EseManKDT::deleteTree(EsemanNode *node) {
@@ -90,41 +156,154 @@ void EseManKDT::deleteTree(EsemanNode *node) {
     delete node;
 }
 
-inline bool EseManKDT::checkFilterSatisfied(const EsemanNode* node, const EventDict& filter) {
-    try {
+inline bool EseManKDT::checkFilterSatisfied(const EsemanAttributeView& attributes, const EventDict& filter) {
+    for (const auto& [key, value] : filter) {
+        const size_t* attr_index = get_if<size_t>(&value);
+        if (!attr_index) return true;
+        if (!attributes.hasAttributeValue(key, *attr_index)) return false;
+    }
+    return true;
+}
+// reads the node's attributes record once for all filters
+inline bool EseManKDT::checkFiltersSatisfied(const EsemanKDTQueryContext& context, const EsemanNodeView& node) {
+    EsemanAttributeView attributes = getAttributeView(context.read_txn, node);
+    for (const auto& filter : context.filters) {
+        if (!checkFilterSatisfied(attributes, filter)) return false;
+    }
+    return true;
+}
+// the same check for one interval of a leaf bucket, which only carries its primitive and ID
+inline bool EseManKDT::checkFiltersSatisfied(const EsemanKDTQueryContext& context, uint32_t primitive_index, uint32_t id_index) {
+    for (const auto& filter : context.filters) {
         for (const auto& [key, value] : filter) {
-            if (!(node->hasAttribute(key))) return false;
-            if (!node->attribute_lists.at(key).count(get<size_t>(value))) return false;
+            const size_t* attr_index = get_if<size_t>(&value);
+            if (!attr_index) continue;
+            if (key == "primitive" && *attr_index == primitive_index) continue;
+            if (key == "ID" && *attr_index == id_index) continue;
+            return false;
         }
-    } catch (...) {
-        return true;
     }
     return true;
 }
-inline bool EseManKDT::checkFiltersSatisfied(const EsemanNode* node) {
-    for (const auto& filter : filters) {
-        if (!checkFilterSatisfied(node, filter)) return false;
+
+// adds the dictionary indices of the event's interval to the node
+void EseManKDT::addEventAttributes(EsemanNode* node, const EventColumns& events, size_t event_index) const {
+    node->addAttribute("primitive", events.primitive(event_index));
+    node->addAttribute("ID", events.id(event_index));
+}
+
+// level of a node in an inline subtree heap, from its heap index (the root is 0 at level 0)
+static inline size_t inlineLevel(size_t heap_index) {
+    size_t level = 0;
+    while (heap_index >= ((size_t)2 << level) - 1) level++;
+    return level;
+}
+
+// copies a child's subtree heap one level down into the left (side 0) or right (side 1) half of heap,
+// levels that do not fit into heap are dropped
+static void placeInlineSubtree(vector<EsemanInlineChild>& heap, const vector<EsemanInlineChild>& child_heap, size_t side) {
+    for (size_t j = 0; j < child_heap.size(); ++j) {
+        size_t level = inlineLevel(j);
+        size_t index = ((size_t)2 << level) - 1 + (side << level) + (j - (((size_t)1 << level) - 1));
+        if (index >= heap.size()) break;
+        heap[index] = child_heap[j];
     }
-    return true;
+}
+
+// Lays out the nodes below root in van Emde Boas order: the top half of the levels first, then each
+// subtree hanging below them left to right, both recursively. Any root to leaf walk then stays within
+// O(log_B n) runs of consecutive ids, and consecutive ids share LMDB pages since every put appends.
+// The levels are cut by the real height of each subtree, so unbalanced trees are split evenly too.
+static void layoutSubtreeVEB(const EsemanNodeBuffer& nodes, const vector<uint32_t>& heights, uint64_t root, uint32_t levels,
+                             vector<uint64_t>& order) {
+    levels = min(levels, heights[root - 1]);
+    if (levels <= 1) {
+        order.push_back(root);
+        return;
+    }
+    uint32_t top_levels = levels / 2;
+    layoutSubtreeVEB(nodes, heights, root, top_levels, order);
+
+    vector<uint64_t> frontier(1, root), next;
+    for (uint32_t level = 0; level < top_levels && !frontier.empty(); ++level) {
+        next.clear();
+        for (uint64_t id : frontier) {
+            uint64_t child_ids[2];
+            memcpy(child_ids, nodes.bytes.data() + nodes.offsets[id - 1] + offsetof(EsemanNodeHeader, left_child), sizeof(child_ids));
+            for (uint64_t child_id : child_ids) {
+                if (child_id != ESEMAN_NULL_NODE_ID) next.push_back(child_id);
+            }
+        }
+        frontier.swap(next);
+    }
+    for (uint64_t id : frontier) layoutSubtreeVEB(nodes, heights, id, levels - top_levels, order);
+}
+
+// Fills the buffer's layout, run by the builder once its tree is complete so the writer only renumbers.
+static void layoutNodes(EsemanNodeBuffer& nodes, uint64_t root_local_id) {
+    if (root_local_id == ESEMAN_NULL_NODE_ID || nodes.size() == 0) return;
+    // children are serialized before their parent, so heights fill in one pass over the local ids
+    vector<uint32_t> heights(nodes.size(), 1);
+    for (uint64_t id = 1; id <= nodes.size(); ++id) {
+        uint64_t child_ids[2];
+        memcpy(child_ids, nodes.bytes.data() + nodes.offsets[id - 1] + offsetof(EsemanNodeHeader, left_child), sizeof(child_ids));
+        for (uint64_t child_id : child_ids) {
+            if (child_id != ESEMAN_NULL_NODE_ID) heights[id - 1] = max(heights[id - 1], heights[child_id - 1] + 1);
+        }
+    }
+    nodes.layout_order.clear();
+    nodes.layout_order.reserve(nodes.size());
+    layoutSubtreeVEB(nodes, heights, root_local_id, heights[root_local_id - 1], nodes.layout_order);
+    nodes.layout_ids.assign(nodes.size(), ESEMAN_NULL_NODE_ID);
+    for (size_t i = 0; i < nodes.layout_order.size(); ++i) nodes.layout_ids[nodes.layout_order[i] - 1] = i + 1;
+}
+
+// COST rule: findClusters stops at a node once the bin size reaches the node's span, so a child is only
+// expanded by queries with narrower bins. Taking bin sizes spread evenly on a log scale, a child spanning s
+// is expanded with a probability that grows with log(1 + s), and expanding it costs about as many nodes as it
+// has intervals. The split with the lowest log(1 + left span) * left intervals + log(1 + right span) * right
+// intervals lands in large idle gaps, which shorten both spans. Only the middle half of the intervals is
+// considered so the tree depth stays logarithmic.
+static size_t costSplitIndex(const EventColumns& data_vector, size_t start_index, size_t end_index) {
+    size_t intervals = (end_index + 1 - start_index) / 2;
+    size_t first = max<size_t>(1, intervals / 4);
+    size_t last = min(intervals - 1, intervals - intervals / 4);
+    int64_t start_time = data_vector.time(start_index);
+    int64_t end_time = data_vector.time(end_index);
+
+    size_t best_index = end_index;
+    double best_cost = numeric_limits<double>::max();
+    for (size_t k = first; k <= last; ++k) {
+        size_t mid_index = start_index + 2 * k;
+        double left_span = (double)max<int64_t>(0, data_vector.time(mid_index - 1) - start_time);
+        double right_span = (double)max<int64_t>(0, end_time - data_vector.time(mid_index));
+        double cost = log1p(left_span) * k + log1p(right_span) * (intervals - k);
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_index = mid_index;
+        }
+    }
+    return best_index;
 }
 
 // This is following only the sliding midpoint rule.
-string EseManKDT::constructKDTPerTrack(size_t start_index, size_t end_index, size_t track_index) {
-    string result_uuid("");
-    EventDictList& data_vector = event_data_values[track_index];
-    if (start_index >= data_vector.size() || end_index >= data_vector.size() || start_index >= end_index) return result_uuid;
+// Nodes are appended to out in post order, the returned summary carries the local id of the subtree root.
+EsemanNodeSummary EseManKDT::constructKDTPerTrack(size_t start_index, size_t end_index, size_t track_index, int depth, EsemanNodeBuffer& out) {
+    EsemanNodeSummary result;
+    const EventColumns& data_vector = event_data_values[track_index];
+    if (start_index >= data_vector.size() || end_index >= data_vector.size() || start_index >= end_index) return result;
     
-    EsemanNode* cur_node = new EsemanNode(getEventTime(data_vector[start_index]), getEventTime(data_vector[end_index]), track_index);
+    EsemanNode* cur_node = new EsemanNode(data_vector.time(start_index), data_vector.time(end_index), track_index);
     if (start_index + 1 == end_index) {
-        for (const auto& [key, indexes] : data_vector[start_index]) {
-            if (key == "time") continue;
-            size_t attr_index = event_data_attributes[key].get_track_index(get<string>(indexes));
-            cur_node->addAttribute(key, attr_index);
+        addEventAttributes(cur_node, data_vector, start_index);
+        return finishNode(cur_node, out);
+    }
+    if ((end_index + 1 - start_index) / 2 <= leafBucketSize()) {
+        for (size_t i = start_index; i < end_index; i += 2) {
+            cur_node->bucket.push(data_vector.time(i), data_vector.time(i + 1), data_vector.primitive(i), data_vector.id(i));
+            addEventAttributes(cur_node, data_vector, i);
         }
-        saveNodeToLMDB(cur_node);
-        result_uuid = cur_node->uuid;
-        delete cur_node;
-        return result_uuid;
+        return finishNode(cur_node, out);
     }
 
     string splitting_rule = ESEMAN_SPLITTING_RULE;
@@ -132,36 +311,30 @@ string EseManKDT::constructKDTPerTrack(size_t start_index, size_t end_index, siz
     size_t mid_index = start_index+2;
     if(splitting_rule == "MIDPOINT") {
         // sliding midpoint rule
-        double mid_point = getEventTime(data_vector[start_index]) + (getEventTime(data_vector[end_index]) - getEventTime(data_vector[start_index])) / 2.0;
-        mid_index = upper_bound(data_vector.begin() + start_index, data_vector.begin() + end_index + 1, 
+        double mid_point = data_vector.time(start_index) + (data_vector.time(end_index) - data_vector.time(start_index)) / 2.0;
+        mid_index = upper_bound(data_vector.times.begin() + start_index, data_vector.times.begin() + end_index + 1, 
             mid_point,
-            [](double val, const EventDict& dict) {
-            return val < getEventTime(dict);
-            }) - data_vector.begin();
+            [](double val, int64_t time) {
+            return val < time;
+            }) - data_vector.times.begin();
         if(mid_index%2 == 1)
             mid_index--;
         if(mid_index == start_index) mid_index = start_index + 2;
         if(mid_index >= end_index) {
-            saveNodeToLMDB(cur_node);
-            result_uuid = cur_node->uuid;
-            delete cur_node;
-            return result_uuid;
+            return finishNode(cur_node, out);
         }
         PRINTLOG("MIDPOINT Rule");
     } else if(splitting_rule == "MAX-DISTANCE") {
         // sliding midpoint of max distance rule
         double max_distance = 0;   
         for(size_t i = start_index+1; i < end_index; i+=2) {
-            if(getEventTime(data_vector[i+1]) - getEventTime(data_vector[i]) > max_distance) {
-                max_distance = getEventTime(data_vector[i+1]) - getEventTime(data_vector[i]);
+            if(data_vector.time(i+1) - data_vector.time(i) > max_distance) {
+                max_distance = data_vector.time(i+1) - data_vector.time(i);
                 mid_index = i+1;
             }
         }
         if(mid_index >= end_index) {
-            saveNodeToLMDB(cur_node);
-            result_uuid = cur_node->uuid;
-            delete cur_node;
-            return result_uuid;
+            return finishNode(cur_node, out);
         }
         PRINTLOG("MAX-DISTANCE Rule");
     } else if(splitting_rule == "FAIR") {
@@ -169,281 +342,188 @@ string EseManKDT::constructKDTPerTrack(size_t start_index, size_t end_index, siz
         if (mid_index % 2 == 1) mid_index--;
         if(mid_index == start_index) mid_index = start_index + 2;
         if(mid_index >= end_index) {
-            saveNodeToLMDB(cur_node);
-            result_uuid = cur_node->uuid;
-            delete cur_node;
-            return result_uuid;
+            return finishNode(cur_node, out);
         }
         PRINTLOG("Fair Rule");
+    } else if(splitting_rule == "COST") {
+        mid_index = costSplitIndex(data_vector, start_index, end_index);
+        if(mid_index >= end_index) {
+            return finishNode(cur_node, out);
+        }
+        PRINTLOG("COST Rule");
     }
 
-    cur_node->left_child = constructKDTPerTrack(start_index, mid_index-1, track_index);
-    cur_node->right_child = constructKDTPerTrack(mid_index, end_index, track_index);
+    EsemanNodeSummary left_summary = constructKDTPerTrack(start_index, mid_index-1, track_index, depth + 1, out);
+    EsemanNodeSummary right_summary = constructKDTPerTrack(mid_index, end_index, track_index, depth + 1, out);
+    cur_node->left_child = left_summary.id;
+    cur_node->right_child = right_summary.id;
 
-    if (cur_node->hasLeftChild()) {
-        EsemanNode* left_node = loadNodeFromLMDB(cur_node->left_child);
-        if(left_node) {
-            for (const auto& [key, indexes] : left_node->attribute_lists) {
-                for (size_t index : indexes) {
-                    cur_node->addAttribute(key, index);
-                }
-            }
-            delete left_node;
-        }
+    cur_node->mergeAttributes(left_summary.attribute_lists);
+    cur_node->mergeAttributes(right_summary.attribute_lists);
+
+    uint8_t inline_levels = inlineLevels();
+    if (inline_levels && depth % inline_levels == 0) {
+        vector<EsemanInlineChild> block(((size_t)2 << inline_levels) - 1);
+        placeInlineSubtree(block, left_summary.subtree, 0);
+        placeInlineSubtree(block, right_summary.subtree, 1);
+        cur_node->inline_children.assign(block.begin() + 1, block.end());
     }
-    if (cur_node->hasRightChild()) {
-        EsemanNode* right_node = loadNodeFromLMDB(cur_node->right_child);
-        if(right_node) {
-            for (const auto& [key, indexes] : right_node->attribute_lists) {
-                for (size_t index : indexes) {
-                    cur_node->addAttribute(key, index);
-                }
-            }
-            delete right_node;
-        }
+    EsemanNodeSummary summary = finishNode(cur_node, out);
+    if (inline_levels) {
+        vector<EsemanInlineChild> subtree(((size_t)1 << inline_levels) - 1);
+        subtree[0] = summary.subtree[0];
+        placeInlineSubtree(subtree, left_summary.subtree, 0);
+        placeInlineSubtree(subtree, right_summary.subtree, 1);
+        summary.subtree = std::move(subtree);
     }
-    
-    saveNodeToLMDB(cur_node);
-    result_uuid = cur_node->uuid;
-    delete cur_node;
-    return result_uuid;
+    return summary;
 }
 
 // This is following only the sliding midpoint rule.
-string EseManKDT::constructTwoDKDT(double start_time, double end_time, size_t start_track, size_t end_track, int depth) {
-    string result_uuid("");
+EsemanNodeSummary EseManKDT::constructTwoDKDT(double start_time, double end_time, size_t start_track, size_t end_track, int depth, EsemanNodeBuffer& out) {
+    EsemanNodeSummary result;
     if (start_track < 0 || end_track < 0 
         || start_track >= event_tracks.size() || end_track >= event_tracks.size() 
-        || start_track > end_track || start_time > end_time) return result_uuid;
+        || start_track > end_track || start_time > end_time) return result;
 
     if (start_track == end_track) {
         // If only one track, construct KDT for that track
-        auto& data_vector = event_data_values[start_track];
-        if(data_vector.size() == 0) return result_uuid;
-        auto cmp_start = [this](const EventDict& dict, double t) { return getEventTime(dict) < t; };
+        const EventColumns& data_vector = event_data_values[start_track];
+        if(data_vector.size() == 0) return result;
+        auto cmp_start = [](int64_t time, double t) { return time < t; };
 
-        auto start_it = std::lower_bound(data_vector.begin(), data_vector.end(), start_time, cmp_start);
-        auto end_it = std::lower_bound(data_vector.begin(), data_vector.end(), end_time, cmp_start);
+        auto start_it = std::lower_bound(data_vector.times.begin(), data_vector.times.end(), start_time, cmp_start);
+        auto end_it = std::lower_bound(data_vector.times.begin(), data_vector.times.end(), end_time, cmp_start);
 
-        size_t start_index = std::distance(data_vector.begin(), start_it);
-        size_t end_index = std::distance(data_vector.begin(), end_it);
+        size_t start_index = std::distance(data_vector.times.begin(), start_it);
+        size_t end_index = std::distance(data_vector.times.begin(), end_it);
         if(end_index >= data_vector.size()) end_index = data_vector.size() - 1;
 
         if (start_index > end_index || start_index >= data_vector.size() || end_index > data_vector.size() || end_index == 0) {
-            return result_uuid;
+            return result;
         }
         EsemanNode* cur_node = nullptr;
+        EsemanNodeSummary left_summary, right_summary;
         if (start_index % 2 == 1) { // odd index
-            if (getEventTime(data_vector[start_index]) < start_time) start_index++;
+            if (data_vector.time(start_index) < start_time) start_index++;
             else {
                 // create here a split node from start_time to start_index.time as a left child and the rest as a right child
                 cur_node = new EsemanNode(start_time, end_time, start_track);
 
-                EsemanNode* l_node = new EsemanNode(start_time, getEventTime(data_vector[start_index]), start_track);
-                for (const auto& [key, indexes] : data_vector[start_index]) {
-                    if (key == "time") continue;
-                    size_t attr_index = event_data_attributes[key].get_track_index(get<string>(indexes));
-                    l_node->addAttribute(key, attr_index);
-                }
-                saveNodeToLMDB(l_node);
-                cur_node->left_child = l_node->uuid;
-                delete l_node;
+                EsemanNode* l_node = new EsemanNode(start_time, data_vector.time(start_index), start_track);
+                addEventAttributes(l_node, data_vector, start_index);
+                left_summary = finishNode(l_node, out);
+                cur_node->left_child = left_summary.id;
 
                 start_index++;
-                cur_node->right_child = constructKDTPerTrack(start_index, end_index, start_track);
+                right_summary = constructKDTPerTrack(start_index, end_index, start_track, 0, out);
+                cur_node->right_child = right_summary.id;
             }
         } else { // even index
-            if (getEventTime(data_vector[start_index]) < start_time) {
+            if (data_vector.time(start_index) < start_time) {
                 // create here a split node from start_time to start_index+1.time as a left child and the rest as a right child
                 cur_node = new EsemanNode(start_time, end_time, start_track);
 
-                EsemanNode* l_node = new EsemanNode(start_time, getEventTime(data_vector[start_index+1]), start_track);
-                for (const auto& [key, indexes] : data_vector[start_index+1]) {
-                    if (key == "time") continue;
-                    size_t attr_index = event_data_attributes[key].get_track_index(get<string>(indexes));
-                    l_node->addAttribute(key, attr_index);
-                }
-                saveNodeToLMDB(l_node);
-                cur_node->left_child = l_node->uuid;
-                delete l_node;
+                EsemanNode* l_node = new EsemanNode(start_time, data_vector.time(start_index+1), start_track);
+                addEventAttributes(l_node, data_vector, start_index+1);
+                left_summary = finishNode(l_node, out);
+                cur_node->left_child = left_summary.id;
 
                 start_index++;
-                cur_node->right_child = constructKDTPerTrack(start_index+1, end_index, start_track);
+                right_summary = constructKDTPerTrack(start_index+1, end_index, start_track, 0, out);
+                cur_node->right_child = right_summary.id;
             } else {
                 // do nothing
             }
         }
 
         if (end_index % 2 == 1) { // odd index
-            if (getEventTime(data_vector[end_index]) > end_time) {
+            if (data_vector.time(end_index) > end_time) {
                 // create here a split node from end_index-1.time to end_time as a right child and the rest as a left child
                 cur_node = new EsemanNode(start_time, end_time, start_track);
 
-                EsemanNode* r_node = new EsemanNode(getEventTime(data_vector[end_index-1]), end_time, start_track);
-                for (const auto& [key, indexes] : data_vector[end_index-1]) {
-                    if (key == "time") continue;
-                    size_t attr_index = event_data_attributes[key].get_track_index(get<string>(indexes));
-                    r_node->addAttribute(key, attr_index);
-                }
-                saveNodeToLMDB(r_node);
-                cur_node->right_child = r_node->uuid;
-                delete r_node;
+                EsemanNode* r_node = new EsemanNode(data_vector.time(end_index-1), end_time, start_track);
+                addEventAttributes(r_node, data_vector, end_index-1);
+                right_summary = finishNode(r_node, out);
+                cur_node->right_child = right_summary.id;
 
                 end_index--;
-                cur_node->left_child = constructKDTPerTrack(start_index, end_index-1, start_track);
+                left_summary = constructKDTPerTrack(start_index, end_index-1, start_track, 0, out);
+                cur_node->left_child = left_summary.id;
             }
             else {
                 // do nothing
             }
         } else { // even index
-            if (getEventTime(data_vector[end_index]) > end_time) end_index--;
+            if (data_vector.time(end_index) > end_time) end_index--;
             else {
                 // create here a split node from end_index.time to end_time as a right child and the rest as a left child
                 cur_node = new EsemanNode(start_time, end_time, start_track);
 
-                EsemanNode* r_node = new EsemanNode(getEventTime(data_vector[end_index]), end_time, start_track);
-                for (const auto& [key, indexes] : data_vector[end_index]) {
-                    if (key == "time") continue;
-                    size_t attr_index = event_data_attributes[key].get_track_index(get<string>(indexes));
-                    r_node->addAttribute(key, attr_index);
-                }
-                saveNodeToLMDB(r_node);
-                cur_node->right_child = r_node->uuid;
-                delete r_node;
+                EsemanNode* r_node = new EsemanNode(data_vector.time(end_index), end_time, start_track);
+                addEventAttributes(r_node, data_vector, end_index);
+                right_summary = finishNode(r_node, out);
+                cur_node->right_child = right_summary.id;
 
                 end_index--;
-                cur_node->left_child = constructKDTPerTrack(start_index, end_index, start_track);
+                left_summary = constructKDTPerTrack(start_index, end_index, start_track, 0, out);
+                cur_node->left_child = left_summary.id;
             }
         }
 
         if (cur_node) {
-            if (cur_node->hasLeftChild()) {
-                EsemanNode* left_node = loadNodeFromLMDB(cur_node->left_child);
-                if(left_node) {
-                    for (const auto& [key, indexes] : left_node->attribute_lists) {
-                        for (size_t index : indexes) {
-                            cur_node->addAttribute(key, index);
-                        }
-                    }
-                    delete left_node;
-                }
-            }
-            if (cur_node->hasRightChild()) {
-                EsemanNode* right_node = loadNodeFromLMDB(cur_node->right_child);
-                if(right_node) {
-                    for (const auto& [key, indexes] : right_node->attribute_lists) {
-                        for (size_t index : indexes) {
-                            cur_node->addAttribute(key, index);
-                        }
-                    }
-                    delete right_node;
-                }
-            }
+            cur_node->mergeAttributes(left_summary.attribute_lists);
+            cur_node->mergeAttributes(right_summary.attribute_lists);
 
-            saveNodeToLMDB(cur_node);
-            result_uuid = cur_node->uuid;
-            delete cur_node;
-            return result_uuid;
+            return finishNode(cur_node, out);
         }
-        return constructKDTPerTrack(start_index, end_index, start_track);
+        return constructKDTPerTrack(start_index, end_index, start_track, 0, out);
     }
 
     EsemanNode* cur_node = new EsemanNode(start_time, end_time, start_track);
     cur_node->end_track = end_track;
+    EsemanNodeSummary left_summary, right_summary;
     if(depth % 2 == 0) {
         double max_start = std::numeric_limits<double>::max();
         double max_end = 0;
         for (size_t t = start_track; t <= end_track; ++t) {
-            auto& data_vector = event_data_values[t];
-            auto cmp_start = [this](const EventDict& dict, double tt) { return getEventTime(dict) < tt; };
+            const EventColumns& data_vector = event_data_values[t];
+            auto cmp_start = [](int64_t time, double tt) { return time < tt; };
 
-            auto start_it = std::lower_bound(data_vector.begin(), data_vector.end(), start_time, cmp_start);
-            auto end_it = std::lower_bound(data_vector.begin(), data_vector.end(), end_time, cmp_start);
+            auto start_it = std::lower_bound(data_vector.times.begin(), data_vector.times.end(), start_time, cmp_start);
+            auto end_it = std::lower_bound(data_vector.times.begin(), data_vector.times.end(), end_time, cmp_start);
 
-            size_t start_index = std::distance(data_vector.begin(), start_it);
-            size_t end_index = std::distance(data_vector.begin(), end_it);
+            size_t start_index = std::distance(data_vector.times.begin(), start_it);
+            size_t end_index = std::distance(data_vector.times.begin(), end_it);
 
             // if (start_index > end_index || start_index >= data_vector.size() || end_index >= data_vector.size() || end_index == 0) {
             // continue;
             // }
             if(start_index%2 == 1) max_start = start_time;
-            else max_start = std::min(max_start, getEventTime(data_vector[start_index]));
+            else max_start = std::min(max_start, (double)data_vector.time(start_index));
 
             if(end_index%2 == 1) max_end = end_time;
             else if(end_index>0 && start_index+1<end_index) {
                 end_index--;
-                max_end = std::max(max_end, getEventTime(data_vector[end_index]));
+                max_end = std::max(max_end, (double)data_vector.time(end_index));
             }
         }
         if(max_end > 0) {
             // Split by time
-            cur_node->left_child = constructTwoDKDT(max_start, std::floor((max_start + max_end ) / 2), start_track, end_track, depth + 1);
-            cur_node->right_child = constructTwoDKDT(std::floor((max_start + max_end ) / 2)+1, max_end, start_track, end_track, depth + 1);
+            left_summary = constructTwoDKDT(max_start, std::floor((max_start + max_end ) / 2), start_track, end_track, depth + 1, out);
+            right_summary = constructTwoDKDT(std::floor((max_start + max_end ) / 2)+1, max_end, start_track, end_track, depth + 1, out);
         }
     } else {
         // Split by track
-        cur_node->left_child = constructTwoDKDT(start_time, end_time, start_track, (start_track + end_track) >> 1, depth + 1);
-        cur_node->right_child = constructTwoDKDT(start_time, end_time, ((start_track + end_track) >> 1) + 1, end_track, depth + 1);
-    }
-
-    if (cur_node->hasLeftChild()) {
-        EsemanNode* left_node = loadNodeFromLMDB(cur_node->left_child);
-        if(left_node) {
-            for (const auto& [key, indexes] : left_node->attribute_lists) {
-                for (size_t index : indexes) {
-                    cur_node->addAttribute(key, index);
-                }
-            }
-            delete left_node;
-        }
+        left_summary = constructTwoDKDT(start_time, end_time, start_track, (start_track + end_track) >> 1, depth + 1, out);
+        right_summary = constructTwoDKDT(start_time, end_time, ((start_track + end_track) >> 1) + 1, end_track, depth + 1, out);
     }
-    if (cur_node->hasRightChild()) {
-        EsemanNode* right_node = loadNodeFromLMDB(cur_node->right_child);
-        if(right_node) {
-            for (const auto& [key, indexes] : right_node->attribute_lists) {
-                for (size_t index : indexes) {
-                    cur_node->addAttribute(key, index);
-                }
-            }
-            delete right_node;
-        }
-    }
-    saveNodeToLMDB(cur_node);
-    result_uuid = cur_node->uuid;
-    delete cur_node;
-    return result_uuid;
-}
+    cur_node->left_child = left_summary.id;
+    cur_node->right_child = right_summary.id;
 
-void EseManKDT::checkNodeAvailability(EsemanNode* c_node, EsemanNode* replace_node) {
-    if(!replace_node || !c_node) return;
-    if(c_node->hasLeftChild() && c_node->left_child == replace_node->uuid) {
-        if(c_node->left_node) deleteTree(c_node->left_node);
-        c_node->left_node = replace_node;
-        replace_node = nullptr;
-        PRINTLOG("reusing nodes");
-    } else if(c_node->hasRightChild() && c_node->right_child == replace_node->uuid) {
-        if(c_node->right_node) deleteTree(c_node->right_node);
-        c_node->right_node = replace_node;
-        replace_node = nullptr;
-        PRINTLOG("reusing nodes");
-    }
-}
-
-void EseManKDT::clearDeepNodesFromCache(EsemanNode* c_node) {
-    if(c_node->hasLeftChild() && c_node->left_node != nullptr){
-        deleteTree(c_node->left_node->left_node);
-        c_node->left_node->left_node = nullptr;
-        deleteTree(c_node->left_node->right_node);
-        c_node->left_node->right_node = nullptr;
-        PRINTLOG("clearing left node cache");
-    }
-    if(c_node->hasRightChild() && c_node->right_node != nullptr){
-        deleteTree(c_node->right_node->left_node);
-        c_node->right_node->left_node = nullptr;
-        deleteTree(c_node->right_node->right_node);
-        c_node->right_node->right_node = nullptr;
-        PRINTLOG("clearing right node cache");
-    }
+    cur_node->mergeAttributes(left_summary.attribute_lists);
+    cur_node->mergeAttributes(right_summary.attribute_lists);
+    return finishNode(cur_node, out);
 }
 
 // search logic
@@ -451,132 +531,254 @@ void EseManKDT::clearDeepNodesFromCache(EsemanNode* c_node) {
 // else return the start end point of the current cluster
 // dfs on the start and end time query
 // Stack-based iterative version of findClusters
-void EseManKDT::findClusters(int64_t start_t, int64_t end_t, int64_t bin_size, 
-                            EsemanNode* root, EsemanNode* replace_node,
+// nodes are read as views straight from the LMDB map, so nothing is parsed or allocated on the way down.
+// Descendants stored inline are visited from their ancestor's record in the same order, without loading
+// them, unless the query needs their attributes.
+void EseManKDT::findClusters(EsemanKDTQueryContext& context, int64_t start_t, int64_t end_t, int64_t bin_size, 
+                            EsemanNode* root,
                             vector<int64_t> &results, int depth) {
 
     if (!root) return;
-
-    // Create a stack to store nodes with their depth
-    struct StackItem {
-        EsemanNode* node;
-        int depth;
+    EsemanNodeView root_view = getNodeView(context, root->id, depth);
+    if (!root_view.isValid()) return;
+
+    const bool use_inline = !context.has_filter_query && !context.has_return_attribute_key;
+    auto push_children = [&](const EsemanNodeView& node, int child_depth) {
+        if (use_inline && node.inlineLevels() > 0) {
+            if (node.inlineChild(2).id != ESEMAN_NULL_NODE_ID) context.traversal_stack.push_back({node, child_depth, 2});
+            if (node.inlineChild(1).id != ESEMAN_NULL_NODE_ID) context.traversal_stack.push_back({node, child_depth, 1});
+            return;
+        }
+        // Push right child first (so left child gets processed first when popped)
+        if (node.hasRightChild()) {
+            EsemanNodeView right_node = getNodeView(context, node.rightChild(), child_depth);
+            if (right_node.isValid()) context.traversal_stack.push_back({right_node, child_depth, 0});
+        }
+        if (node.hasLeftChild()) {
+            EsemanNodeView left_node = getNodeView(context, node.leftChild(), child_depth);
+            if (left_node.isValid()) context.traversal_stack.push_back({left_node, child_depth, 0});
+        }
     };
-    stack<StackItem> nodeStack;
-    nodeStack.push({root, depth});
-
-    while (!nodeStack.empty()) {
-        nodes_visited++;
-        auto current = nodeStack.top();
-        nodeStack.pop();
-        EsemanNode* c_node = current.node;
+
+    context.traversal_stack.clear();
+    context.traversal_stack.push_back({root_view, depth, 0});
+
+    while (!context.traversal_stack.empty()) {
+        context.nodes_visited++;
+        EsemanTraversalItem current = context.traversal_stack.back();
+        context.traversal_stack.pop_back();
+        const EsemanNodeView& c_node = current.node;
         int current_depth = current.depth;
 
-        if (has_filter_query && !checkFiltersSatisfied(c_node)) continue;
+        if (current.inline_index) {
+            EsemanInlineChild child = c_node.inlineChild(current.inline_index);
+            int64_t start_time = child.start_time;
+            int64_t end_time = child.end_time;
+            if (start_time >= end_t || end_time <= start_t) continue;
 
-        int64_t start_time = (int64_t)c_node->start_time;
-        int64_t end_time = (int64_t)c_node->end_time;
-        if (start_time >= end_t || end_time <= start_t) continue;
+            bool is_leaf = child.id & ESEMAN_INLINE_LEAF;
+            if ((child.id & ESEMAN_INLINE_BUCKET) && bin_size < (end_time - start_time + 1)) {
+                EsemanNodeView bucket_node = getNodeView(context, child.id & ESEMAN_INLINE_ID_MASK, current_depth);
+                if (bucket_node.isValid()) scanBucket(context, bucket_node, start_t, end_t, bin_size, results, current_depth);
+                continue;
+            }
+            if (bin_size >= (end_time - start_time + 1) || is_leaf) {
+                if (bin_size < (end_time - start_time + 1)) {
+                    start_time = max(start_time, start_t);
+                    end_time = min(end_time, end_t);
+                }
+                results.push_back(start_time);
+                results.push_back(end_time);
+                context.max_depth_reached = std::max(context.max_depth_reached, current_depth);
+                continue;
+            }
 
-        checkNodeAvailability(c_node, replace_node);
+            size_t left_index = 2 * current.inline_index + 1;
+            if (inlineLevel(current.inline_index) < c_node.inlineLevels()) {
+                if (c_node.inlineChild(left_index + 1).id != ESEMAN_NULL_NODE_ID)
+                    context.traversal_stack.push_back({c_node, current_depth + 1, (uint16_t)(left_index + 1)});
+                if (c_node.inlineChild(left_index).id != ESEMAN_NULL_NODE_ID)
+                    context.traversal_stack.push_back({c_node, current_depth + 1, (uint16_t)left_index});
+            } else {
+                // last inline level, the node is read to get to its own children
+                EsemanNodeView child_node = getNodeView(context, child.id & ESEMAN_INLINE_ID_MASK, current_depth);
+                if (child_node.isValid()) push_children(child_node, current_depth + 1);
+            }
+            continue;
+        }
+
+        if (context.has_filter_query && !checkFiltersSatisfied(context, c_node)) continue;
+
+        int64_t start_time = c_node.startTime();
+        int64_t end_time = c_node.endTime();
+        if (start_time >= end_t || end_time <= start_t) continue;
 
         if (bin_size >= (end_time - start_time + 1)) {
-            if (has_return_attribute_key) {
-                if (!c_node->hasAttribute(return_attribute_key)) {
-                    PRINTLOG("Attribute not found for key: " << return_attribute_key);
+            if (context.has_return_attribute_key) {
+                size_t attr_index;
+                if (!getAttributeView(context.read_txn, c_node).firstAttributeValue(context.return_attribute_key, attr_index)) {
+                    PRINTLOG("Attribute not found for key: " << context.return_attribute_key);
                     continue;
                 }
-                results.push_back((int64_t)(*c_node->attribute_lists.at(return_attribute_key).begin()));
+                results.push_back((int64_t)attr_index);
             } else {
                 results.push_back(start_time);
                 results.push_back(end_time);
             }
-            max_depth_reached = std::max(max_depth_reached, current_depth);
+            context.max_depth_reached = std::max(context.max_depth_reached, current_depth);
             // PRINTLOG("Cluster: " << " Start: " << start_time << ", End: " << end_time << ", Depth: " << current_depth);
             PRINTLOG("Cluster: " << " Start: " << start_time << ", End: " << end_time);
             continue;
         }
 
-        if (!c_node->hasLeftChild() && !c_node->hasRightChild()) {
+        if (c_node.bucketIntervals()) {
+            scanBucket(context, c_node, start_t, end_t, bin_size, results, current_depth);
+            continue;
+        }
+
+        if (!c_node.hasLeftChild() && !c_node.hasRightChild()) {
             if (start_time < start_t) {
                 start_time = start_t;
             }
             if (end_time > end_t) {
                 end_time = end_t;
             }
-            if (has_return_attribute_key) {
-                if (!c_node->hasAttribute(return_attribute_key)) {
-                    PRINTLOG("Attribute not found for key: " << return_attribute_key);
+            if (context.has_return_attribute_key) {
+                size_t attr_index;
+                if (!getAttributeView(context.read_txn, c_node).firstAttributeValue(context.return_attribute_key, attr_index)) {
+                    PRINTLOG("Attribute not found for key: " << context.return_attribute_key);
                     continue;
                 }
-                results.push_back((int64_t)(*c_node->attribute_lists.at(return_attribute_key).begin()));
+                results.push_back((int64_t)attr_index);
             } else {
                 results.push_back(start_time);
                 results.push_back(end_time);
             }
-            max_depth_reached = std::max(max_depth_reached, current_depth);
+            context.max_depth_reached = std::max(context.max_depth_reached, current_depth);
             PRINTLOG("Cluster-Leaf: " << " Start: " << start_time << ", End: " << end_time);
             continue;
         }
 
-        // Load children if not already loaded
-        if (!c_node->right_node) c_node->right_node = loadNodeFromLMDB(c_node->right_child);
-        if (!c_node->left_node) c_node->left_node = loadNodeFromLMDB(c_node->left_child);
+        push_children(c_node, current_depth + 1);
+    }
+    context.held_records.clear();
+}
 
-        // Push right child first (so left child gets processed first when popped)
-        if (c_node->right_node) {
-            nodeStack.push({c_node->right_node, current_depth + 1});
+// Expands a leaf bucket in place of the subtree it replaces. Consecutive intervals are merged into one
+// cluster while the cluster fits into bin_size, and a single interval wider than bin_size is clipped to
+// the query like a leaf. Intervals are in start time order, so the ones starting before end_t are a prefix
+// that is counted with a branch free loop over the start column before anything else is read.
+void EseManKDT::scanBucket(EsemanKDTQueryContext& context, const EsemanNodeView& node, int64_t start_t, int64_t end_t, int64_t bin_size,
+                           vector<int64_t> &results, int depth) {
+    size_t intervals = node.bucketIntervals();
+    size_t last = 0;
+    for (size_t i = 0; i < intervals; ++i) last += node.bucketStartTime(i) < end_t;
+    // the primitive and ID columns are only read for filters and attribute returns
+    EsemanAttributeView attributes;
+    if (context.has_filter_query || context.has_return_attribute_key) {
+        attributes = getAttributeView(context.read_txn, node);
+        if (!attributes.isValid()) return;
+    }
+
+    bool has_cluster = false;
+    int64_t cluster_start = 0, cluster_end = 0;
+    uint32_t cluster_attribute = 0; // the return attribute of the cluster's first interval
+    auto emit_cluster = [&]() {
+        if (bin_size < (cluster_end - cluster_start + 1)) {
+            cluster_start = max(cluster_start, start_t);
+            cluster_end = min(cluster_end, end_t);
+        }
+        if (context.has_return_attribute_key) {
+            results.push_back((int64_t)cluster_attribute);
+        } else {
+            results.push_back(cluster_start);
+            results.push_back(cluster_end);
+        }
+    };
+
+    for (size_t i = 0; i < last; ++i) {
+        int64_t end_time = node.bucketEndTime(i);
+        if (end_time <= start_t) continue;
+        if (context.has_filter_query && !checkFiltersSatisfied(context, attributes.bucketPrimitive(i), attributes.bucketID(i))) continue;
+        int64_t start_time = node.bucketStartTime(i);
+        if (has_cluster && max(cluster_end, end_time) - cluster_start + 1 <= bin_size) {
+            cluster_end = max(cluster_end, end_time);
+            continue;
         }
-        if (c_node->left_node) {
-            nodeStack.push({c_node->left_node, current_depth + 1});
+        if (has_cluster) emit_cluster();
+        has_cluster = true;
+        cluster_start = start_time;
+        cluster_end = end_time;
+        if (context.has_return_attribute_key) cluster_attribute = context.return_attribute_key == "primitive" ? attributes.bucketPrimitive(i) : attributes.bucketID(i);
+    }
+    if (has_cluster) emit_cluster();
+    context.max_depth_reached = std::max(context.max_depth_reached, depth);
+}
+
+// Answers an unfiltered track query from the level of detail pyramid when its cluster size spans at least
+// ESEMAN_LOD_BINS_PER_QUERY_BIN bins of the finest level, using the coarsest level that still does. The cluster
+// size is the bin size times horizontal_resolution_divisor, as in the tree walk it replaces. A level bin
+// straddling a query bin boundary adds its busy time to both in proportion to the overlap, finer levels keep
+// that from marking idle bins next to busy ones. A query bin busy over its whole width is 1.0 and a partly
+// busy one 0.5, as rasterizeClusters marks them.
+bool EseManKDT::resampleTrackLOD(const EsemanKDTQueryContext& context, size_t track_index, int64_t time_begin, int64_t time_end, uint64_t bins,
+                                 vector<double>& results) {
+    if (!ESEMAN_LOD_QUERIES || !has_lod_dbi || context.has_filter_query) return false;
+    int64_t bin_size = (int64_t)getBinSize(time_begin, time_end, bins);
+    if (bin_size <= 0) return false;
+    int64_t cluster_size = bin_size * horizontal_resolution_divisor;
+
+    uint64_t track_key = track_index;
+    MDB_val key, data;
+    key.mv_data = (void*)&track_key;
+    key.mv_size = sizeof(track_key);
+    if (mdb_get(context.read_txn, lod_dbi, &key, &data)) return false;
+    EsemanLODView lod((const char*)data.mv_data, data.mv_size);
+    if (!lod.isValid() || lod.binWidth(0) * ESEMAN_LOD_BINS_PER_QUERY_BIN > cluster_size) return false;
+
+    uint8_t level = 0;
+    while (level + 1 < lod.levelCount() && lod.binWidth(level + 1) * ESEMAN_LOD_BINS_PER_QUERY_BIN <= cluster_size) level++;
+    const int64_t width = lod.binWidth(level);
+    const int64_t level_end = (int64_t)lod.binCount(level) * width;
+
+    results.assign(bins, 0.0);
+    for (uint64_t b = 0; b < bins; ++b) {
+        // the query bin relative to the pyramid's origin
+        int64_t from = time_begin + (int64_t)b * bin_size - lod.origin();
+        int64_t to = min(from + bin_size, level_end);
+        from = max<int64_t>(from, 0);
+        if (from >= to) continue;
+
+        double busy = 0;
+        for (int64_t i = from / width; i * width < to; ++i) {
+            int64_t overlap = min(to, (i + 1) * width) - max(from, i * width);
+            busy += (double)lod.busyTime(level, (uint64_t)i) * (double)overlap / (double)width;
         }
+        if (busy >= (double)bin_size) results[b] = 1.0;
+        else if (busy > 0) results[b] = 0.5;
     }
+    return true;
 }
 
-vector<double> EseManKDT::binnedRangeQueryPerTrack(int64_t time_begin, 
+vector<double> EseManKDT::binnedRangeQueryPerTrack(EsemanKDTQueryContext& context,
+                                      int64_t time_begin, 
                                         int64_t time_end,
                                         size_t track_index,
-                                        uint64_t bins,
-                                        EsemanNode* replace_node){
-    vector<double> results(bins);
+                                        uint64_t bins){
+    vector<double> lod_results;
+    if (resampleTrackLOD(context, track_index, time_begin, time_end, bins, lod_results)) return lod_results;
+
     uint64_t bin_size(getBinSize(time_begin, time_end, bins));
 
     vector<int64_t> data_short_list;
-    findClusters(time_begin, time_end, (int64_t)bin_size*horizontal_resolution_divisor, 
-                event_data_nodes[track_index], replace_node,
+    findClusters(context, time_begin, time_end, (int64_t)bin_size*horizontal_resolution_divisor, 
+                trackRoot(track_index),
                 data_short_list, 0);
-
-    for(long unsigned int i = 0; i < data_short_list.size(); i+=2) {
-        int64_t start_time = data_short_list[i];
-        int64_t end_time = data_short_list[i+1]; 
-        
-        if(end_time < time_begin || start_time > time_end) continue;
-
-
-        if(start_time < time_begin) start_time = time_begin;
-        if(start_time > time_end) continue;
-        if(end_time < time_begin) continue;
-        if(end_time > time_end) end_time = time_end;
-        int64_t startingBin = getBinNumber(time_begin, time_end, bins, start_time);
-        int64_t endingBin = getBinNumber(time_begin, time_end, bins, end_time);
-        if(startingBin < 0 || endingBin < 0) continue;
-
-        for(int64_t bin_it = startingBin+1;
-        bin_it < endingBin && bin_it < (int64_t)bins && results[bin_it] < 0.5; 
-        bin_it++)
-        results[bin_it] = 1.0;
-        
-        if(startingBin < (int64_t)bins && results[startingBin] < 0.5) 
-        results[startingBin] = (start_time % bin_size)?0.5:1.0;
-        if(endingBin < (int64_t)bins && results[endingBin] < 0.5)
-        results[endingBin] = (end_time % bin_size)?0.5:1.0;
-    }
-
-    data_short_list.clear();
-    return results;
+    return rasterizeClusters(data_short_list, time_begin, time_end, bins);
 }
 
-LocDict EseManKDT::binnedRangeQueryAllTracks(int64_t time_begin, 
+LocDict EseManKDT::binnedRangeQueryAllTracks(EsemanKDTQueryContext& context,
+                                            int64_t time_begin, 
                                             int64_t time_end, 
                                             size_t track_begin, 
                                             size_t track_end, uint64_t bins) {
@@ -586,36 +788,33 @@ LocDict EseManKDT::binnedRangeQueryAllTracks(int64_t time_begin,
 
     EsemanNode* root = event_data_nodes[0];
     if (!root) return locDict;
+    EsemanNodeView root_view = getNodeView(context, root->id, 0);
+    if (!root_view.isValid()) return locDict;
 
-    // Create a stack to store nodes with their depth
-    struct StackItem {
-        EsemanNode* node;
-        int depth;
-    };
-    stack<StackItem> nodeStack;
-    nodeStack.push({root, 0});
+    context.traversal_stack.clear();
+    context.traversal_stack.push_back({root_view, 0});
     map<size_t, vector<pair<int64_t, int64_t>>> results;
 
-    while (!nodeStack.empty()) {
-        nodes_visited++;
-        auto current = nodeStack.top();
-        nodeStack.pop();
-        EsemanNode* c_node = current.node;
+    while (!context.traversal_stack.empty()) {
+        context.nodes_visited++;
+        EsemanTraversalItem current = context.traversal_stack.back();
+        context.traversal_stack.pop_back();
+        const EsemanNodeView& c_node = current.node;
         int current_depth = current.depth;
 
-        if (has_filter_query && !checkFiltersSatisfied(c_node)) continue;
+        if (context.has_filter_query && !checkFiltersSatisfied(context, c_node)) continue;
 
-        int64_t start_time = (int64_t)c_node->start_time;
-        int64_t end_time = (int64_t)c_node->end_time;
+        int64_t start_time = c_node.startTime();
+        int64_t end_time = c_node.endTime();
+        size_t c_start_track = c_node.startTrack();
+        size_t c_end_track = c_node.endTrack();
         if (start_time >= time_end || end_time <= time_begin) continue;
-        if (c_node->start_track > track_end || c_node->end_track < track_begin) continue;
-
-        // checkNodeAvailability(c_node, replace_node);
+        if (c_start_track > track_end || c_end_track < track_begin) continue;
 
         if ((int64_t)bin_size >= (end_time - start_time + 1) 
-            && c_node->start_track == c_node->end_track 
-            && c_node->start_track >= track_begin 
-            && c_node->end_track <= track_end) {
+            && c_start_track == c_end_track 
+            && c_start_track >= track_begin 
+            && c_end_track <= track_end) {
             // if (has_return_attribute_key) {
             //     if (!c_node->hasAttribute(return_attribute_key)) {
             //         PRINTLOG("Attribute not found for key: " << return_attribute_key);
@@ -623,25 +822,26 @@ LocDict EseManKDT::binnedRangeQueryAllTracks(int64_t time_begin,
             //     }
             //     results.push_back((int64_t)(*c_node->attribute_lists.at(return_attribute_key).begin()));
             // } else {
-            if (results.find(c_node->start_track) == results.end()) {
-                results[c_node->start_track] = vector<pair<int64_t, int64_t>>();
+            if (results.find(c_start_track) == results.end()) {
+                results[c_start_track] = vector<pair<int64_t, int64_t>>();
             }
             int64_t id = -1;
-            if (c_node->hasAttribute("ID")) {
-                id = (int64_t)(*c_node->attribute_lists.at("ID").begin());
+            size_t attr_index;
+            if (getAttributeView(context.read_txn, c_node).firstAttributeValue("ID", attr_index)) {
+                id = (int64_t)attr_index;
             }
-            results[c_node->start_track].push_back(pair<int64_t, int64_t>(start_time,id));
-            results[c_node->start_track].push_back(pair<int64_t, int64_t>(end_time,id));
+            results[c_start_track].push_back(pair<int64_t, int64_t>(start_time,id));
+            results[c_start_track].push_back(pair<int64_t, int64_t>(end_time,id));
             
-            max_depth_reached = std::max(max_depth_reached, current_depth);
-            PRINTLOG("Cluster: " << " Start: " << start_time << ", End: " << end_time << ", s_track: " << c_node->start_track << ", e_track: " << c_node->end_track);
+            context.max_depth_reached = std::max(context.max_depth_reached, current_depth);
+            PRINTLOG("Cluster: " << " Start: " << start_time << ", End: " << end_time << ", s_track: " << c_start_track << ", e_track: " << c_end_track);
             continue;
         }
 
-        if (!c_node->hasLeftChild() && !c_node->hasRightChild()
-            && c_node->start_track == c_node->end_track
-            && c_node->start_track >= track_begin 
-            && c_node->end_track <= track_end) {
+        if (!c_node.hasLeftChild() && !c_node.hasRightChild()
+            && c_start_track == c_end_track
+            && c_start_track >= track_begin 
+            && c_end_track <= track_end) {
             if (start_time < time_begin) {
                 start_time = time_begin;
             }
@@ -655,36 +855,36 @@ LocDict EseManKDT::binnedRangeQueryAllTracks(int64_t time_begin,
             //     }
             //     results.push_back((int64_t)(*c_node->attribute_lists.at(return_attribute_key).begin()));
             // } else {
-            if (results.find(c_node->start_track) == results.end()) {
-                results[c_node->start_track] = vector<pair<int64_t, int64_t>>();
+            if (results.find(c_start_track) == results.end()) {
+                results[c_start_track] = vector<pair<int64_t, int64_t>>();
             }
             int64_t id = -1;
-            if (c_node->hasAttribute("ID")) {
-                id = (int64_t)(*c_node->attribute_lists.at("ID").begin());
+            size_t attr_index;
+            if (getAttributeView(context.read_txn, c_node).firstAttributeValue("ID", attr_index)) {
+                id = (int64_t)attr_index;
             }
-            results[c_node->start_track].push_back(pair<int64_t, int64_t>(start_time,id));
-            results[c_node->start_track].push_back(pair<int64_t, int64_t>(end_time,id));
+            results[c_start_track].push_back(pair<int64_t, int64_t>(start_time,id));
+            results[c_start_track].push_back(pair<int64_t, int64_t>(end_time,id));
 
-            max_depth_reached = std::max(max_depth_reached, current_depth);
-            PRINTLOG("Cluster-Leaf: " << " Start: " << start_time << ", End: " << end_time << ", s_track: " << c_node->start_track << ", e_track: " << c_node->end_track);
+            context.max_depth_reached = std::max(context.max_depth_reached, current_depth);
+            PRINTLOG("Cluster-Leaf: " << " Start: " << start_time << ", End: " << end_time << ", s_track: " << c_start_track << ", e_track: " << c_end_track);
             continue;
         }
 
-        // Load children if not already loaded
-        if (!c_node->right_node) c_node->right_node = loadNodeFromLMDB(c_node->right_child);
-        if (!c_node->left_node) c_node->left_node = loadNodeFromLMDB(c_node->left_child);
-
         // Push right child first (so left child gets processed first when popped)
-        if (c_node->right_node) {
-            nodeStack.push({c_node->right_node, current_depth + 1});
+        if (c_node.hasRightChild()) {
+            EsemanNodeView right_node = getNodeView(context, c_node.rightChild(), current_depth + 1);
+            if (right_node.isValid()) context.traversal_stack.push_back({right_node, current_depth + 1});
         }
-        if (c_node->left_node) {
-            nodeStack.push({c_node->left_node, current_depth + 1});
+        if (c_node.hasLeftChild()) {
+            EsemanNodeView left_node = getNodeView(context, c_node.leftChild(), current_depth + 1);
+            if (left_node.isValid()) context.traversal_stack.push_back({left_node, current_depth + 1});
         }
     }
+    context.held_records.clear();
 
     for (const auto& [track_index, intervals] : results) {
-        vector<double> bins_vec(bins, 0.0);
+        EsemanBinRasterizer rasterizer(time_begin, time_end, bins);
         size_t i = 0;
         for (; i + 1 < intervals.size(); i += 2) {
             int64_t start_time = intervals[i].first;
@@ -694,52 +894,37 @@ LocDict EseManKDT::binnedRangeQueryAllTracks(int64_t time_begin,
             }
             int64_t end_time = intervals[j - 2].first;
             i = j - 3;
-
-            if (end_time < time_begin || start_time > time_end) continue;
-            if (start_time < time_begin) start_time = time_begin;
-            if (end_time > time_end) end_time = time_end;
-
-            int64_t startingBin = getBinNumber(time_begin, time_end, bins, start_time);
-            int64_t endingBin = getBinNumber(time_begin, time_end, bins, end_time);
-            if (startingBin < 0 || endingBin < 0) continue;
-
-            for (int64_t bin_it = startingBin + 1; bin_it < endingBin && bin_it < (int64_t)bins && bins_vec[bin_it] < 0.5; bin_it++)
-                bins_vec[bin_it] = 1.0;
-
-            if (startingBin < (int64_t)bins && bins_vec[startingBin] < 0.5)
-                bins_vec[startingBin] = (start_time % bin_size) ? 0.5 : 1.0;
-            if (endingBin < (int64_t)bins && bins_vec[endingBin] < 0.5)
-                bins_vec[endingBin] = (end_time % bin_size) ? 0.5 : 1.0;
+            rasterizer.add(start_time, end_time);
         }
-        locDict[stol(event_tracks[track_index])] = vector<double>(bins_vec.begin(), bins_vec.end());
-        bins_vec.clear();
+        locDict[stol(event_tracks[track_index])] = rasterizer.finish();
     }
     return locDict;
 }
 
-tuple<LocDict, int64_t, int64_t> EseManKDT::binnedRangeQuery(int64_t i_time_begin, 
+// Everything the query changes is in context, the model itself is only read. Queries with different
+// contexts can run on several threads at once.
+tuple<LocDict, int64_t, int64_t> EseManKDT::binnedRangeQuery(EsemanKDTQueryContext& context,
+                                    int64_t i_time_begin, 
                                     int64_t i_time_end,
                                     vector<string> &locations,
                                     uint64_t bins){
     LocDict locDict;
     PRINTLOG("Got EseMan KDT binned range query");
-
-    has_filter_query = false;
-    try {
-        for (size_t i = 0; i < filters.size(); i++) {
-            for (const auto& [key, value] : filters[i]) {
-                has_filter_query = true;
-                filters[i][key] = event_data_attributes[key].get_track_index(get<string>(value));
-            }
-        }
-    } catch (...) {
-        PRINTLOG("Error in converting filter attributes to indices");
+    context.read_txn = acquireReadTxn();
+    if (!context.read_txn) {
+        context.finishQuery();
+        return make_tuple(locDict, i_time_begin, i_time_end);
     }
 
+    context.resolveFilters(event_data_attributes);
+    bool is_filtered = context.has_filter_query;
+
     int total_nodes_visited = 0;
-    max_depth_reached = 0;
-    leafs_read = 0;
-    has_return_attribute_key = false;
+    context.max_depth_reached = 0;
+    context.leafs_read = 0;
+    context.cache_hits = 0;
+    context.cache_misses = 0;
+    context.has_return_attribute_key = false;
     chrono::steady_clock::time_point clock_begin = chrono::steady_clock::now();
     if(is_vertical_split) {
         sort(locations.begin(), locations.end(), [](const string& a, const string& b) {
@@ -749,7 +934,9 @@ tuple<LocDict, int64_t, int64_t> EseManKDT::binnedRangeQuery(int64_t i_time_begi
         size_t en_track = event_tracks.get_track_index(locations[locations.size()-1]);
         if (i_time_begin < 0) i_time_begin = (int64_t)(event_data_nodes[0]->start_time) - 10;
         if (i_time_end < 0) i_time_end = (int64_t)(event_data_nodes[0]->end_time) + 10;
-        locDict = binnedRangeQueryAllTracks(i_time_begin, i_time_end, st_track, en_track, bins);
+        context.nodes_visited = 0;
+        locDict = binnedRangeQueryAllTracks(context, i_time_begin, i_time_end, st_track, en_track, bins);
+        total_nodes_visited = context.nodes_visited;
         PRINTLOG("From vertical split");
     } else {
         if(locations.size() == 0) {
@@ -766,151 +953,178 @@ tuple<LocDict, int64_t, int64_t> EseManKDT::binnedRangeQuery(int64_t i_time_begi
                     PRINTLOG("Track not found in event tracks " << loc);
                     continue;
                 }
-                if(event_data_nodes[track_index]) {
-                    global_start_time = std::min(global_start_time, (int64_t)event_data_nodes[track_index]->start_time);
-                    global_end_time = std::max(global_end_time, (int64_t)event_data_nodes[track_index]->end_time);
+                EsemanNode* t_node = trackRoot(track_index);
+                if(t_node) {
+                    global_start_time = std::min(global_start_time, (int64_t)t_node->start_time);
+                    global_end_time = std::max(global_end_time, (int64_t)t_node->end_time);
                 }
             }
             if(i_time_begin < 0) i_time_begin = global_start_time - 10;
             if(i_time_end < 0) i_time_end = global_end_time + 10;
         }
 
+        vector<size_t> track_indices;
+        vector<uint64_t> track_keys;
         for (const string& loc : locations) {
             size_t track_index = event_tracks.get_track_index(loc);
             if(track_index == event_tracks.size()) {
                 PRINTLOG("Track not found in event tracks " << loc);
                 continue;
             }
-            nodes_visited = 0;
-            EsemanNode* t_node = checkHotNodes(i_time_begin, i_time_end, track_index);
+            track_indices.push_back(track_index);
+            track_keys.push_back(stol(loc));
+        }
+
+        // Tracks are independent, so a request with many of them spreads them over the query pool. The request
+        // thread and its helpers take the next track from a shared counter, so a thread that gets cheap tracks
+        // takes more of them. Each helper queries in a context of its own with the request's filters and its own
+        // read transaction. Results and counters go to the slot of their track and are merged and logged in
+        // request order on the request thread once the helpers are done.
+        struct TrackStats {
+            int     nodes_visited = 0;
+            int     leafs_read = 0;
+            int     max_depth_reached = 0;
+            int     cache_hits = 0;
+            int     cache_misses = 0;
+            int64_t microseconds = 0;
+        };
+        vector<vector<double>> track_results(track_indices.size());
+        vector<TrackStats> track_stats(track_indices.size());
+        atomic<size_t> next_track(0);
+        auto query_tracks = [&](EsemanKDTQueryContext& track_context) {
+            for (size_t i = next_track++; i < track_indices.size(); i = next_track++) {
+                track_context.nodes_visited = 0;
+                track_context.leafs_read = 0;
+                track_context.max_depth_reached = 0;
+                track_context.cache_hits = 0;
+                track_context.cache_misses = 0;
 #ifdef _DEBUG
-            chrono::steady_clock::time_point track_clock_begin = chrono::steady_clock::now();
+                chrono::steady_clock::time_point track_clock_begin = chrono::steady_clock::now();
 #endif
-            locDict[stol(loc)] = binnedRangeQueryPerTrack(i_time_begin, i_time_end, track_index, bins, t_node);
+                track_results[i] = binnedRangeQueryPerTrack(track_context, i_time_begin, i_time_end, track_indices[i], bins);
+                TrackStats& stats = track_stats[i];
 #ifdef _DEBUG
-            chrono::steady_clock::time_point track_clock_end = chrono::steady_clock::now();
+                stats.microseconds = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - track_clock_begin).count();
 #endif
-            total_nodes_visited = std::max(total_nodes_visited, nodes_visited);
-            PRINTLOG("Track index: " << track_index << " " << event_tracks[track_index] << " " << leafs_read << " " << chrono::duration_cast<chrono::microseconds>(track_clock_end - track_clock_begin).count());
+                stats.nodes_visited = track_context.nodes_visited;
+                stats.leafs_read = track_context.leafs_read;
+                stats.max_depth_reached = track_context.max_depth_reached;
+                stats.cache_hits = track_context.cache_hits;
+                stats.cache_misses = track_context.cache_misses;
+            }
+        };
+
+        size_t helper_count = query_pool.beginQuery(queryHelpersWanted(track_indices.size()));
+        shared_ptr<EsemanQueryBatch> batch = make_shared<EsemanQueryBatch>();
+        for (size_t h = 0; h < helper_count; ++h) {
+            query_pool.submit(batch, [&]() {
+                if (next_track >= track_indices.size()) return;
+                EsemanKDTQueryContext helper_context;
+                helper_context.filters = context.filters;
+                helper_context.has_filter_query = context.has_filter_query;
+                helper_context.read_txn = acquireReadTxn();
+                if (helper_context.read_txn) query_tracks(helper_context);
+                releaseReadTxn(helper_context.read_txn);
+            });
+        }
+        query_tracks(context);
+        batch->close();
+        query_pool.endQuery();
+
+        context.leafs_read = 0;
+        context.max_depth_reached = 0;
+        context.cache_hits = 0;
+        context.cache_misses = 0;
+        for (size_t i = 0; i < track_indices.size(); i++) {
+            const TrackStats& stats = track_stats[i];
+            total_nodes_visited += stats.nodes_visited;
+            context.leafs_read += stats.leafs_read;
+            context.max_depth_reached = std::max(context.max_depth_reached, stats.max_depth_reached);
+            context.cache_hits += stats.cache_hits;
+            context.cache_misses += stats.cache_misses;
+            PRINTLOG("Track index: " << track_indices[i] << " " << event_tracks[track_indices[i]] << " " << stats.leafs_read << " " << stats.microseconds);
         }
+        for (size_t i = 0; i < track_indices.size(); i++) locDict[track_keys[i]] = std::move(track_results[i]);
     }
     chrono::steady_clock::time_point clock_end = chrono::steady_clock::now();
 
-    filters.clear(); // automatically clear filters after query
-    has_filter_query = false;
+    context.finishQuery(); // automatically clear filters after query
+    releaseReadTxn(context.read_txn);
+    context.read_txn = nullptr;
 
     string profiled_ds("ESEMAN");
     if(is_vertical_split) {
         profiled_ds = "ESEMAN_TWOD";
     }
     cout << profiled_ds << ",ds_window";
-    if(filters.size() > 0) cout << "_cond";
+    if(is_filtered) cout << "_cond";
     cout << "," << i_time_begin << "," << i_time_end << "," 
         << horizontal_resolution_divisor << ","
-        << chrono::duration_cast<chrono::microseconds>(clock_end - clock_begin).count()
-        << endl;
+        << chrono::duration_cast<chrono::microseconds>(clock_end - clock_begin).count() << ","
+        << total_nodes_visited << ","
+        << context.cache_hits << "," << context.cache_misses;   // both 0 without a node cache
+    cout << endl;
     return make_tuple(locDict, i_time_begin, i_time_end);
 }
 
-string EseManKDT::findNearestEvent(uint64_t cTime, uint64_t cLocation) {
+string EseManKDT::findNearestEvent(EsemanKDTQueryContext& context, uint64_t cTime, uint64_t cLocation) {
   string ret_result("");
   string c_loc_str = to_string(cLocation);
   size_t track_index = event_tracks.get_track_index(c_loc_str);
-  
+  if(track_index == event_tracks.size()) return ret_result;
 
   int64_t result = -1;
-  return_attribute_key = "ID";
-  has_return_attribute_key = true;
+  context.return_attribute_key = "ID";
+  context.has_return_attribute_key = true;
   vector<int64_t> data_short_list;
 
   uint64_t bin_size(getBinSize(cTime, cTime+1, 1));
-  findClusters(cTime, cTime+1, (int64_t)bin_size, event_data_nodes[track_index], nullptr, data_short_list, 0);
+  context.read_txn = acquireReadTxn();
+  if (context.read_txn) findClusters(context, cTime, cTime+1, (int64_t)bin_size, trackRoot(track_index), data_short_list, 0);
+  releaseReadTxn(context.read_txn);
+  context.read_txn = nullptr;
   if(data_short_list.size() > 0) result = data_short_list[0];
-  if(result >= 0) ret_result = event_data_attributes["ID"][result];
+  auto ids = event_data_attributes.find("ID");
+  if(result >= 0 && ids != event_data_attributes.end()) ret_result = ids->second[result];
   data_short_list.clear();
-  return_attribute_key = "";
-  has_return_attribute_key = false;
+  context.finishQuery();
   return ret_result;
 }
 
-// this function checks if the already loaded nodes in the event_data_nodes are enough to satisfy the query range.
-// this will return true if there is no need to fetch nodes from LMDB
-// this will return false if we need to fetch more nodes from LMDB
-// do this for each track seperately
+// pool helpers a request over track_count tracks would use, one for every ESEMAN_QUERY_TRACKS_PER_THREAD
+// tracks past the first batch, which the request thread takes itself
+size_t EseManKDT::queryHelpersWanted(size_t track_count) const {
+    size_t thread_count = track_count / ESEMAN_QUERY_TRACKS_PER_THREAD;
+    return thread_count > 1 ? thread_count - 1 : 0;
+}
 
-// this will return nullptr if no loading require. 
-// otherwise this will update event_data_nodes with the lowest common ancester and return the pointer to the previous value of event_data_nodes
-EsemanNode* EseManKDT::checkHotNodes(double start_time, double end_time, size_t track_index) {
-    // four scenarios
-    // first, zoom in overlapping range
-    // second, zoom out overlapping range
-    // third, pan within short overlapping range
-    // fourth, out of range
-
-    // Take maximum of 0 or start_time to avoid negative times
-    start_time = std::max(0.0, start_time);
-    end_time = std::max(0.0, end_time);
-
-
-
-    // first check completely out of range check.
-    EsemanNode *root = event_data_nodes[track_index];
-    double first_index_left = std::max(0.0, start_time - 2*(end_time - start_time));
-    double first_index = start_time;
-    // double second_index = ((end_time - start_time) / 3) + start_time;
-    // double third_index = (2 * (end_time - start_time) / 3) + start_time;
-    double fourth_index = end_time;
-    double foruth_index_right = end_time + 2*(end_time - start_time);
-
-    // fourth case, jump to different range (from the utilization view), complete out of range
-    if(fourth_index < root->start_time || root->end_time < first_index) {
-        // deleteTree(root);
-        root = nullptr;
-        event_data_nodes[track_index] = findNodeInTimeRange(eseman_node_uuids[track_index], first_index_left, foruth_index_right, nullptr);
-        // cout << "fourth case" << endl;
-    // } // second case, zoom out overlapping range
-    // else if(first_index < root->start_time && root->end_time < fourth_index) {
-    }// third case, partially overlapping range, either start or end overlaps
-    else if(first_index < root->start_time || root->end_time < fourth_index) {
-        if(root->uuid == eseman_node_uuids[track_index]) // already in the root, nothign to do
-            return nullptr;
-        EsemanNode *t_node = findNodeInTimeRange(eseman_node_uuids[track_index], first_index_left, foruth_index_right, root);
-        if(root->uuid == t_node->uuid) // already in the cache, nothing to do
-            return nullptr;
-        event_data_nodes[track_index] = t_node;
-        // cout << "third case" << endl;
-    } // first case, zoom in overlapping range
-    else {
-        // EsemanNode *t_node = findNodeInTimeRange(eseman_node_uuids[track_index], first_index_left, foruth_index_right, root);
-        // if(root->uuid == t_node->uuid) // already in the cache, nothing to do
-        //     return nullptr;
-        // event_data_nodes[track_index] = t_node;
-        return nullptr;
-    }
-    return root;
+EsemanNode* EseManKDT::trackRoot(size_t track_index) const {
+    return track_index < event_data_nodes.size() ? event_data_nodes[track_index] : nullptr;
 }
 
 void EseManKDT::printKDTDotPerTrack(size_t track_index) {
     ofstream dotFile("track_" + to_string(track_index) + ".dot");
     dotFile << "digraph G {" << endl;
     dotFile << "  label = \"Track " << event_tracks[track_index] << "\";" << endl;
-    printKDTDotRecursive(eseman_node_uuids[track_index], dotFile);
+    MDB_txn* read_txn = acquireReadTxn();
+    if (read_txn) printKDTDotRecursive(read_txn, eseman_root_ids[track_index], dotFile);
+    releaseReadTxn(read_txn);
     dotFile << "}" << endl;
     dotFile.close();
 }
 
-void EseManKDT::printKDTDotRecursive(string uuid, ofstream& dotFile) {
-    if (uuid.empty()) return;
-    EsemanNode *node = loadNodeFromLMDB(uuid);
+void EseManKDT::printKDTDotRecursive(MDB_txn* read_txn, uint64_t node_id, ofstream& dotFile) {
+    if (node_id == ESEMAN_NULL_NODE_ID) return;
+    EsemanNode *node = loadNodeFromLMDB(read_txn, node_id);
     if(!node)return;
-    dotFile << "  \"" << node->start_time << "," << node->end_time << "\" [label=\"[" << node->uuid << "]\"];" << endl;
+    dotFile << "  \"" << node->start_time << "," << node->end_time << "\" [label=\"[" << node->id << "]\"];" << endl;
     if (node->hasLeftChild()) {
-        dotFile << "  \"" << node->uuid << "\" -> \"" << node->left_child << "\";" << endl;
-        printKDTDotRecursive(node->left_child, dotFile);
+        dotFile << "  \"" << node->id << "\" -> \"" << node->left_child << "\";" << endl;
+        printKDTDotRecursive(read_txn, node->left_child, dotFile);
     }
     if (node->hasRightChild()) {
-        dotFile << "  \"" << node->uuid << "\" -> \"" << node->right_child << "\";" << endl;
-        printKDTDotRecursive(node->right_child, dotFile);
+        dotFile << "  \"" << node->id << "\" -> \"" << node->right_child << "\";" << endl;
+        printKDTDotRecursive(read_txn, node->right_child, dotFile);
     }
     delete node;
 }
@@ -921,29 +1135,42 @@ void EseManKDT::printKDTDot() {
     }
 }
 
-void EseManKDT::buildKDT() {
+// false when the dataset could not be written completely, a partial dataset must not be served
+bool EseManKDT::buildKDT() {
     string dataset_path = node_storage_base_path + "/" + dataset_id;
     string commands_remove_dir = "cd " + node_storage_base_path + " && mkdir -p " + dataset_id;
     int result = system(commands_remove_dir.c_str());
     if (result != 0) {
         PRINTLOG("Failed to create directory: " << dataset_path);
-        return;
+        return false;
+    }
+    if (has_spill_failed) {
+        PRINTLOG("Spilling the ingested intervals failed, the bundle is not built");
+        closeSpillRuns();
+        return false;
     }
 
     if(is_vertical_split) {
-        vector<pair<string, EventDictList>> track_data_pairs;
+        // the 2D tree splits across tracks, so every spilled track has to be read back before building
+        for (size_t i = 0; i < event_data_values.size(); ++i) {
+            if (!loadSpilledTrack(i)) return false;
+        }
+        closeSpillRuns();
+        prepareAllTracks();
+
+        vector<pair<string, EventColumns>> track_data_pairs;
         for (size_t i = 0; i < event_tracks.size(); ++i) {
-            track_data_pairs.emplace_back(event_tracks[i], event_data_values[i]);
+            track_data_pairs.emplace_back(event_tracks[i], std::move(event_data_values[i]));
         }
         std::sort(track_data_pairs.begin(), track_data_pairs.end(),
-            [](const pair<string, EventDictList>& a, const pair<string, EventDictList>& b) {
+            [](const pair<string, EventColumns>& a, const pair<string, EventColumns>& b) {
                 return stoi(a.first) < stoi(b.first);
             });
         event_tracks.cleanMemory();
         event_data_values.clear();
-        for (const auto& p : track_data_pairs) {
+        for (auto& p : track_data_pairs) {
             event_tracks.insert(p.first);
-            event_data_values.push_back(p.second);
+            event_data_values.push_back(std::move(p.second));
         }
     }
 
@@ -952,35 +1179,39 @@ void EseManKDT::buildKDT() {
 
     if(is_vertical_split) {
         PRINTLOG("Building KDT with vertical split");
-        if(eseman_node_uuids.empty()) eseman_node_uuids = vector<string>(1, "");
 
         double global_min = std::numeric_limits<double>::max();
         double global_max = std::numeric_limits<double>::lowest();
         for (const auto& data_vector : event_data_values) {
             if (!data_vector.empty()) {
-                auto it_first = data_vector.front().find("time");
-                auto it_last = data_vector.back().find("time");
-                if (it_first != data_vector.front().end()) {
-                    double t_min = std::get<double>(it_first->second);
-                    if (t_min < global_min) global_min = t_min;
-                }
-                if (it_last != data_vector.back().end()) {
-                    double t_max = std::get<double>(it_last->second);
-                    if (t_max > global_max) global_max = t_max;
-                }
+                double t_min = data_vector.time(0);
+                double t_max = data_vector.time(data_vector.size() - 1);
+                if (t_min < global_min) global_min = t_min;
+                if (t_max > global_max) global_max = t_max;
             }
         }
         PRINTLOG("Global min time: " << global_min << ", max time: " << global_max);
 
-        openWritePermLMDB();
-        writeNodeUuidAtIndex(constructTwoDKDT(global_min, global_max, 0, event_tracks.size() - 1, 0), 0);
-        closeWritePermLMDB();
+        // the 2D tree is a single tree over all tracks, with tasks only the first one builds it into its shard
+        if(ESEMAN_TASK_COUNT && ESEMAN_TASK_ID != 0) {
+            PRINTLOG("Vertical split KDT is built by task 0 only, skipping task " << ESEMAN_TASK_ID);
+            event_data_values.clear();
+            return true;
+        }
+        EsemanNodeBuffer nodes;
+        uint64_t root_local_id = constructTwoDKDT(global_min, global_max, 0, event_tracks.size() - 1, 0, nodes).id;
+        layoutNodes(nodes, root_local_id);
+        if(!openBulkLoadLMDB(shardFileName(ESEMAN_LMDB_FILE_NAME))) return false;
+        eseman_root_ids = vector<uint64_t>(1, ESEMAN_NULL_NODE_ID);
+        bool is_appended = appendNodesToLMDB(nodes, root_local_id, eseman_root_ids[0]);
+        if (!closeBulkLoadLMDB() || !is_appended) return false;
+        writeRootIds(shardFileName(ESEMAN_ROOT_IDS_FILE_NAME), eseman_root_ids);
         event_data_values.clear();
         PRINTLOG("Vertical split KDT build completed");
-        return;
+        return true;
     }
 
-    if(eseman_node_uuids.empty()) eseman_node_uuids = vector<string>(event_data_values.size(), "");
+    eseman_root_ids = vector<uint64_t>(event_data_values.size(), ESEMAN_NULL_NODE_ID);
     int ntask = ESEMAN_TASK_COUNT;
     int procid = ESEMAN_TASK_ID;
 
@@ -995,59 +1226,575 @@ void EseManKDT::buildKDT() {
         << ntask << ","<< procid << ","
         << starting_chunk_index << "," << ending_chunk_index << ")");
 
-    for (size_t i = starting_chunk_index; i <= ending_chunk_index; ++i) {
-        if (event_data_values[i].empty()) continue;
+    // all tracks go through one environment and one write transaction, the root table is written once at the end.
+    // With tasks every task writes its own shard and root table, mergeShards combines them afterwards.
+    // once anything was spilled the rest goes to disk too, the builders then load one track at a time
+    if(!spill_run_fds.empty() && !spillTracks()) return false;
+    if(!openBulkLoadLMDB(shardFileName(ESEMAN_LMDB_FILE_NAME))) return false;
+    bool is_built = buildTracksInParallel(starting_chunk_index, ending_chunk_index);
+    if (!closeBulkLoadLMDB()) is_built = false;
+    event_data_values.clear();
+    closeSpillRuns();
+    if (!is_built) return false;
+    writeRootIds(shardFileName(ESEMAN_ROOT_IDS_FILE_NAME), eseman_root_ids);
+    return true;
+}
+
+static bool writeSpillRun(int fd, const void* data, size_t bytes, uint64_t offset) {
+    const char* p = (const char*)data;
+    while (bytes > 0) {
+        ssize_t written = pwrite(fd, p, bytes, offset);
+        if (written <= 0) return false;
+        p += written;
+        bytes -= written;
+        offset += written;
+    }
+    return true;
+}
 
-        if(is_vertical_split == false) {
-            openWritePermLMDB();
-            writeNodeUuidAtIndex(constructKDTPerTrack(0, event_data_values[i].size() - 1, i), i);
-            closeWritePermLMDB();
-        }
-        PRINTLOG("Constructing KDT for track index: " << event_tracks[i]);
-        event_data_values[i].clear();
+static bool readSpillRun(int fd, void* data, size_t bytes, uint64_t offset) {
+    char* p = (char*)data;
+    while (bytes > 0) {
+        ssize_t n = pread(fd, p, bytes, offset);
+        if (n <= 0) return false;
+        p += n;
+        bytes -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// after a failed spill the intervals stay in memory and the bundle fails in buildKDT, spilling is not retried
+void EseManKDT::checkMemoryBudget() {
+    if (ESEMAN_BUNDLE_MEMORY_BUDGET && !has_spill_failed && resident_column_bytes > ESEMAN_BUNDLE_MEMORY_BUDGET) {
+        has_spill_failed = !spillTracks();
     }
-    event_data_values.clear();
 }
 
-void EseManKDT::writeNodeUuidAtIndex(string new_uuid, size_t index) {
+// Writes the resident columns of every track into a new spill run and frees them. The segments of a track
+// are consecutive pieces of its interval stream, reading them back in run order restores the ingest order.
+bool EseManKDT::spillTracks() {
     string dataset_path = node_storage_base_path + "/" + dataset_id;
-    eseman_node_uuids.clear();
-    ifstream uuid_file(dataset_path + "/eseman_node_uuids.dat");
-    if (uuid_file.is_open()) {
-        int uuid_count;
-        uuid_file >> uuid_count;
-        for (int i = 0; i < uuid_count; i++) {
-            string nuid;
-            uuid_file >> nuid;
-            eseman_node_uuids.push_back(nuid);
+    error_code ec;
+    filesystem::create_directories(dataset_path, ec);
+    string run_path = dataset_path + "/eseman_spill." + to_string(ESEMAN_TASK_ID) + "." + to_string(spill_run_fds.size());
+    int fd = open(run_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        PRINTLOG("Failed to create spill run: " << run_path);
+        return false;
+    }
+    unlink(run_path.c_str());
+    size_t run = spill_run_fds.size();
+    spill_run_fds.push_back(fd);
+    spilled_segments.resize(event_data_values.size());
+
+    uint64_t offset = 0;
+    for (size_t t = 0; t < event_data_values.size(); ++t) {
+        EventColumns& columns = event_data_values[t];
+        if (columns.empty()) continue;
+        uint64_t n = columns.primitives.size();
+        if (!writeSpillRun(fd, columns.times.data(), 2 * n * sizeof(int64_t), offset)
+            || !writeSpillRun(fd, columns.primitives.data(), n * sizeof(uint32_t), offset + 2 * n * sizeof(int64_t))
+            || !writeSpillRun(fd, columns.ids.data(), n * sizeof(uint32_t), offset + 2 * n * sizeof(int64_t) + n * sizeof(uint32_t))) {
+            PRINTLOG("Failed to write spill run: " << run_path);
+            return false;
         }
-        uuid_file.close();
+        spilled_segments[t].push_back(SpilledSegment{run, offset, n});
+        offset += n * ESEMAN_INTERVAL_COLUMN_BYTES;
+        resident_column_bytes -= min(resident_column_bytes, n * ESEMAN_INTERVAL_COLUMN_BYTES);
+        columns.clear();
     }
-    if(!eseman_node_uuids.size()) eseman_node_uuids = vector<string>(is_vertical_split?1:event_data_values.size(), "");
-    eseman_node_uuids[index] = new_uuid;
+    PRINTLOG("Spilled " << offset << " bytes of intervals into run " << run);
+    return true;
+}
 
-    ofstream w_uuid_file(dataset_path + "/eseman_node_uuids.dat");
-    if (w_uuid_file.is_open()) {
-        w_uuid_file << eseman_node_uuids.size() << "\n";
-        for (const auto& cuid : eseman_node_uuids) {
-            w_uuid_file << cuid << "\n";
+// Reads the spilled segments of a track back in front of the columns still in memory
+bool EseManKDT::loadSpilledTrack(size_t track_index) {
+    if (track_index >= spilled_segments.size() || spilled_segments[track_index].empty()) return true;
+    EventColumns& resident = event_data_values[track_index];
+    uint64_t count = trackIntervalCount(track_index);
+    EventColumns columns;
+    columns.times.resize(2 * count);
+    columns.primitives.resize(count);
+    columns.ids.resize(count);
+
+    size_t pos = 0;
+    for (const auto& segment : spilled_segments[track_index]) {
+        int fd = spill_run_fds[segment.run];
+        uint64_t n = segment.interval_count;
+        if (!readSpillRun(fd, &columns.times[2 * pos], 2 * n * sizeof(int64_t), segment.offset)
+            || !readSpillRun(fd, &columns.primitives[pos], n * sizeof(uint32_t), segment.offset + 2 * n * sizeof(int64_t))
+            || !readSpillRun(fd, &columns.ids[pos], n * sizeof(uint32_t), segment.offset + 2 * n * sizeof(int64_t) + n * sizeof(uint32_t))) {
+            PRINTLOG("Failed to read spilled track " << track_index);
+            return false;
         }
-        w_uuid_file.close();
+        pos += n;
+    }
+    copy(resident.times.begin(), resident.times.end(), columns.times.begin() + 2 * pos);
+    copy(resident.primitives.begin(), resident.primitives.end(), columns.primitives.begin() + pos);
+    copy(resident.ids.begin(), resident.ids.end(), columns.ids.begin() + pos);
+    resident = std::move(columns);
+    vector<SpilledSegment>().swap(spilled_segments[track_index]);
+    return true;
+}
+
+uint64_t EseManKDT::trackIntervalCount(size_t track_index) const {
+    uint64_t count = event_data_values[track_index].primitives.size();
+    if (track_index < spilled_segments.size()) {
+        for (const auto& segment : spilled_segments[track_index]) count += segment.interval_count;
     }
+    return count;
 }
 
-void EseManKDT::deleteFromLMDB(const string& uuid) {
-    if (uuid.empty()) return;
+void EseManKDT::closeSpillRuns() {
+    for (int fd : spill_run_fds) close(fd);
+    spill_run_fds.clear();
+    spilled_segments.clear();
+    resident_column_bytes = 0;
+    has_spill_failed = false;
+}
+
+// The splitting rules and the lower_bound lookups expect a track's times to alternate start and end in time
+// order. Traces from multi-threaded runtimes are not written in that order, so tracks are sorted by start
+// time here, and intervals that still break the layout are counted for the report.
+IntervalOrderStats EseManKDT::prepareTrackIntervals(size_t track_index) {
+    EventColumns& columns = event_data_values[track_index];
+    bool is_sorted = isSortedByStart(columns);
+    if (!is_sorted) sortIntervalsByStart(columns);
+    IntervalOrderStats stats = checkIntervalOrder(columns);
+    stats.unsorted_tracks = is_sorted ? 0 : 1;
+    if (stats.hasIssues()) {
+        PRINTLOG("Track " << event_tracks[track_index] << (is_sorted ? "" : " was not sorted,")
+            << " overlapping: " << stats.overlapping << " nested: " << stats.nested << " inverted: " << stats.inverted);
+    }
+    return stats;
+}
+
+// Busy time of a track in ESEMAN_LOD_BINS (rounded up to a power of two) bins over its span, and the coarser
+// levels summed pairwise from them. Overlapping intervals are merged first so no bin is busier than it is wide.
+// Expects the columns prepared by prepareTrackIntervals, leaves record empty without ESEMAN_LOD_BINS.
+void EseManKDT::buildTrackLOD(size_t track_index, string& record) const {
+    const EventColumns& columns = event_data_values[track_index];
+    record.clear();
+    if (!ESEMAN_LOD_BINS || columns.empty()) return;
+
+    uint64_t bin_count = 1;
+    uint8_t level_count = 1;
+    while (bin_count < ESEMAN_LOD_BINS && level_count < 63) {
+        bin_count <<= 1;
+        level_count++;
+    }
+    int64_t origin = columns.time(0);
+    int64_t track_end = origin;
+    for (size_t i = 1; i < columns.size(); i += 2) track_end = max(track_end, columns.time(i));
+    int64_t bin_width = max<int64_t>(1, (track_end - origin + (int64_t)bin_count) / (int64_t)bin_count);
+
+    vector<int64_t> busy(2 * bin_count - 1, 0);
+    int64_t covered_until = origin; // exclusive end of the intervals added so far
+    for (size_t i = 0; i + 1 < columns.size(); i += 2) {
+        int64_t from = max(columns.time(i), covered_until);
+        int64_t to = columns.time(i + 1) + 1;
+        if (to <= from) continue;
+        covered_until = to;
+        while (from < to) {
+            int64_t bin = (from - origin) / bin_width;
+            int64_t bin_end = min(to, origin + (bin + 1) * bin_width);
+            busy[bin] += bin_end - from;
+            from = bin_end;
+        }
+    }
+
+    size_t level_begin = 0;
+    for (uint64_t count = bin_count; count > 1; count >>= 1) {
+        size_t next_begin = level_begin + count;
+        for (uint64_t b = 0; b < count / 2; ++b) {
+            busy[next_begin + b] = busy[level_begin + 2 * b] + busy[level_begin + 2 * b + 1];
+        }
+        level_begin = next_begin;
+    }
+
+    EsemanLODHeader header;
+    header.version = ESEMAN_LOD_FORMAT_VERSION;
+    header.level_count = level_count;
+    header.origin = origin;
+    header.bin_width = bin_width;
+    header.bin_count = bin_count;
+    record.assign((const char*)&header, sizeof(header));
+    record.append((const char*)busy.data(), busy.size() * sizeof(int64_t));
+}
+
+// prepares every track on ESEMAN_BUILD_THREADS threads, for the 2D tree which needs all tracks at once
+IntervalOrderStats EseManKDT::prepareAllTracks() {
+    size_t thread_count = ESEMAN_BUILD_THREADS > 0 ? ESEMAN_BUILD_THREADS : thread::hardware_concurrency();
+    if (thread_count == 0) thread_count = 1;
+    thread_count = min(thread_count, max<size_t>(1, event_data_values.size()));
+
+    atomic<size_t> next_track(0);
+    mutex stats_mutex;
+    IntervalOrderStats order_stats;
+    vector<thread> workers;
+    for (size_t t = 0; t < thread_count; ++t) {
+        workers.emplace_back([&]() {
+            for (size_t i = next_track++; i < event_data_values.size(); i = next_track++) {
+                IntervalOrderStats track_stats = prepareTrackIntervals(i);
+                lock_guard<mutex> lock(stats_mutex);
+                order_stats.add(track_stats);
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    reportIntervalOrder(order_stats);
+    return order_stats;
+}
+
+// Worker threads pick tracks off a shared counter and build each one into its own node buffer.
+// LMDB allows a single writer, so finished buffers are queued and this thread appends them one by one.
+// The queue is bounded so fast workers cannot pile up more built tracks than the writer keeps up with,
+// by the memory budget when there is one and by track count otherwise.
+// After the first failed write the workers stop taking tracks and the bundle fails.
+bool EseManKDT::buildTracksInParallel(size_t start_index, size_t end_index) {
+    struct BuiltTrack {
+        size_t              track_index;
+        uint64_t            root_local_id;
+        EsemanNodeBuffer    nodes;
+        string              lod;
+        IntervalOrderStats  order_stats;
+        uint64_t            reserved_bytes;
+    };
+
+    if (event_data_values.empty() || start_index > end_index) return true;
+    end_index = min(end_index, event_data_values.size() - 1);
+
+    size_t thread_count = ESEMAN_BUILD_THREADS > 0 ? ESEMAN_BUILD_THREADS : thread::hardware_concurrency();
+    if (thread_count == 0) thread_count = 1;
+    thread_count = min(thread_count, end_index - start_index + 1);
+    const size_t max_queued_tracks = 2 * thread_count;
+    PRINTLOG("Building tracks with " << thread_count << " threads");
+
+    // Under a memory budget a track holds a reservation from before it is loaded until it is written:
+    // ESEMAN_TRACK_BUILD_BYTES per interval while it is built, then the bytes of its node buffer and pyramid
+    // while it is queued. Columns still in memory count against the budget as well. A worker waits until its
+    // track fits next to the reserved ones, a track that does not fit the whole budget is built alone.
+    mutex budget_mutex;
+    condition_variable budget_released;
+    uint64_t reserved_bytes = resident_column_bytes;
+    size_t reserved_tracks = 0;
+    auto reserve = [&](uint64_t bytes, uint64_t resident_bytes) {
+        if (!ESEMAN_BUNDLE_MEMORY_BUDGET) return;
+        unique_lock<mutex> lock(budget_mutex);
+        budget_released.wait(lock, [&]() {
+            return reserved_tracks == 0 || reserved_bytes + bytes - resident_bytes <= ESEMAN_BUNDLE_MEMORY_BUDGET;
+        });
+        reserved_bytes += bytes - resident_bytes;
+        reserved_tracks++;
+    };
+    auto resize_reservation = [&](uint64_t bytes, uint64_t new_bytes) {
+        if (!ESEMAN_BUNDLE_MEMORY_BUDGET) return;
+        lock_guard<mutex> lock(budget_mutex);
+        reserved_bytes = reserved_bytes - bytes + new_bytes;
+        budget_released.notify_all();
+    };
+    auto release = [&](uint64_t bytes) {
+        if (!ESEMAN_BUNDLE_MEMORY_BUDGET) return;
+        lock_guard<mutex> lock(budget_mutex);
+        reserved_bytes -= bytes;
+        reserved_tracks--;
+        budget_released.notify_all();
+    };
+
+    atomic<size_t> next_track(start_index);
+    mutex queue_mutex;
+    condition_variable queue_not_empty, queue_not_full;
+    deque<BuiltTrack> built_tracks;
+    size_t running_workers = thread_count;
+    IntervalOrderStats order_stats;
+    atomic<bool> is_failed(false);
+
+    auto worker = [&]() {
+        for (size_t i = next_track++; i <= end_index && !is_failed; i = next_track++) {
+            uint64_t track_bytes = trackIntervalCount(i) * ESEMAN_TRACK_BUILD_BYTES;
+            if (track_bytes == 0) continue;
+            reserve(track_bytes, event_data_values[i].primitives.size() * ESEMAN_INTERVAL_COLUMN_BYTES);
+
+            BuiltTrack built;
+            built.track_index = i;
+            bool is_loaded = loadSpilledTrack(i);
+            if (is_loaded) {
+                built.order_stats = prepareTrackIntervals(i);
+                built.root_local_id = constructKDTPerTrack(0, event_data_values[i].size() - 1, i, 0, built.nodes).id;
+                layoutNodes(built.nodes, built.root_local_id);
+                buildTrackLOD(i, built.lod);
+            }
+            event_data_values[i].clear();
+
+            // a track that cannot be read back would be left without a tree
+            if (!is_loaded || built.nodes.size() == 0) {
+                release(track_bytes);
+                if (!is_loaded) {
+                    is_failed = true;
+                    break;
+                }
+                continue;
+            }
+            built.reserved_bytes = built.nodes.memoryBytes() + built.lod.capacity();
+            resize_reservation(track_bytes, built.reserved_bytes);
+
+            unique_lock<mutex> lock(queue_mutex);
+            queue_not_full.wait(lock, [&]() { return ESEMAN_BUNDLE_MEMORY_BUDGET || built_tracks.size() < max_queued_tracks; });
+            built_tracks.push_back(std::move(built));
+            queue_not_empty.notify_one();
+        }
+        lock_guard<mutex> lock(queue_mutex);
+        running_workers--;
+        queue_not_empty.notify_one();
+    };
+
+    vector<thread> workers;
+    for (size_t t = 0; t < thread_count; ++t) workers.emplace_back(worker);
+
+    while (true) {
+        unique_lock<mutex> lock(queue_mutex);
+        queue_not_empty.wait(lock, [&]() { return !built_tracks.empty() || running_workers == 0; });
+        if (built_tracks.empty()) break;
+        BuiltTrack built = std::move(built_tracks.front());
+        built_tracks.pop_front();
+        lock.unlock();
+        queue_not_full.notify_one();
+
+        bool was_failed = is_failed; // after a failure the queue is only drained so the workers can finish
+        bool is_written = !was_failed
+            && appendNodesToLMDB(built.nodes, built.root_local_id, eseman_root_ids[built.track_index])
+            && (built.lod.empty() || putTrackLOD(built.track_index, built.lod));
+        built.nodes = EsemanNodeBuffer();
+        string().swap(built.lod);
+        release(built.reserved_bytes);
+        if (!is_written) {
+            if (!was_failed) {
+                PRINTLOG("Failed to write the KDT of track index: " << event_tracks[built.track_index]);
+            }
+            is_failed = true;
+            continue;
+        }
+        order_stats.add(built.order_stats);
+        PRINTLOG("Constructing KDT for track index: " << event_tracks[built.track_index]);
+    }
+
+    for (auto& w : workers) w.join();
+    if (is_failed) return false;
+    reportIntervalOrder(order_stats);
+    return true;
+}
+
+// "eseman.db" becomes "eseman.<task id>.db" when bundling is split into tasks
+string EseManKDT::shardFileName(const string& file_name) const {
+    if (!ESEMAN_TASK_COUNT) return file_name;
+    size_t dot = file_name.rfind('.');
+    return file_name.substr(0, dot) + "." + to_string(ESEMAN_TASK_ID) + file_name.substr(dot);
+}
+
+// Files that other tasks may read or write at the same time are written to a task private temporary
+// file first and then renamed over the target, so readers never see a half written file.
+bool EseManKDT::commitFile(const string& tmp_path, const string& path) const {
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        PRINTLOG("Failed to rename " << tmp_path << " to " << path);
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+string EseManKDT::temporaryFileName(const string& path) const {
+    return path + ".tmp" + to_string(ESEMAN_TASK_ID);
+}
+
+bool EseManKDT::readRootIds(const string& file_name, vector<uint64_t>& root_ids) {
+    string dataset_path = node_storage_base_path + "/" + dataset_id;
+    root_ids.clear();
+    ifstream id_file(dataset_path + "/" + file_name);
+    if (!id_file.is_open()) return false;
+    int id_count;
+    id_file >> id_count;
+    for (int i = 0; i < id_count; i++) {
+        uint64_t c_id;
+        id_file >> c_id;
+        root_ids.push_back(c_id);
+    }
+    id_file.close();
+    return true;
+}
+
+void EseManKDT::writeRootIds(const string& file_name, const vector<uint64_t>& root_ids) {
+    string path = node_storage_base_path + "/" + dataset_id + "/" + file_name;
+    string tmp_path = temporaryFileName(path);
+    ofstream w_id_file(tmp_path);
+    if (!w_id_file.is_open()) {
+        PRINTLOG("Failed to write root ids: " << path);
+        return;
+    }
+    w_id_file << root_ids.size() << "\n";
+    for (const auto& c_id : root_ids) {
+        w_id_file << c_id << "\n";
+    }
+    w_id_file.close();
+    commitFile(tmp_path, path);
+}
+
+// Combines the shards written by ESEMAN_TASK_COUNT bundling tasks into eseman.db and eseman_root_ids.dat.
+// Shard node ids start from 1, so every shard is appended with its ids and child references shifted
+// past the nodes already merged. The shards are read in key order and stay contiguous after the merge.
+bool EseManKDT::mergeShards() {
+    if (ESEMAN_TASK_COUNT <= 0) {
+        PRINTLOG("ESEMAN_TASK_COUNT is 0, there are no shards to merge");
+        return false;
+    }
+    string dataset_path = node_storage_base_path + "/" + dataset_id;
+    int task_count = ESEMAN_TASK_COUNT;
+    int task_id = ESEMAN_TASK_ID;
+
+    // merging appends after the ids already stored, over an existing dataset it would add a second copy of
+    // every tree and point the root ids at that copy only
+    if (filesystem::exists(dataset_path + "/" + ESEMAN_LMDB_FILE_NAME)) {
+        PRINTLOG("Merged dataset " << dataset_path << "/" << ESEMAN_LMDB_FILE_NAME << " already exists, remove it to merge again");
+        return false;
+    }
+
+    ESEMAN_TASK_COUNT = 0; // the merged dataset is written under the plain file names
+    bool is_opened = openBulkLoadLMDB();
+    ESEMAN_TASK_COUNT = task_count;
+    if (!is_opened) return false;
+
+    vector<uint64_t> merged_root_ids;
+    bool is_merged = true;
+    for (int t = 0; t < task_count && is_merged; ++t) {
+        ESEMAN_TASK_ID = t;
+        string shard_path = dataset_path + "/" + shardFileName(ESEMAN_LMDB_FILE_NAME);
+        vector<uint64_t> shard_root_ids;
+        if (!filesystem::exists(shard_path) || !readRootIds(shardFileName(ESEMAN_ROOT_IDS_FILE_NAME), shard_root_ids)) {
+            // the 2D tree is built by task 0 alone, the other tasks of a vertical split write no shard
+            if (is_vertical_split && t != 0) continue;
+            PRINTLOG("Shard of task " << t << " not found");
+            is_merged = false;
+            break;
+        }
+
+        MDB_env *shard_env;
+        MDB_txn *shard_txn;
+        MDB_dbi shard_dbi, shard_attributes_dbi, shard_lod_dbi;
+        MDB_cursor *cursor;
+        int rc = mdb_env_create(&shard_env);
+        if (rc) {
+            PRINTLOG("mdb_env_create failed, error " << rc);
+            is_merged = false;
+            break;
+        }
+        mdb_env_set_mapsize(shard_env, lmdb_database_total_size < 0 ? LMDB_DATABASE_TOTAL_SIZE : lmdb_database_total_size);
+        mdb_env_set_maxdbs(shard_env, LMDB_MAX_DBS);
+        if ((rc = mdb_env_open(shard_env, shard_path.c_str(), MDB_NOSUBDIR | MDB_RDONLY, 0664))
+            || (rc = mdb_txn_begin(shard_env, NULL, MDB_RDONLY, &shard_txn))) {
+            PRINTLOG("Failed to open shard " << shard_path << ", error " << rc);
+            mdb_env_close(shard_env);
+            is_merged = false;
+            break;
+        }
+        // every shard has nodes and attributes, pyramids only when they were built
+        if ((rc = mdb_dbi_open(shard_txn, ESEMAN_NODES_DB_NAME, MDB_INTEGERKEY, &shard_dbi))
+            || (rc = mdb_dbi_open(shard_txn, ESEMAN_ATTRIBUTES_DB_NAME, MDB_INTEGERKEY, &shard_attributes_dbi))) {
+            PRINTLOG("Failed to open nodes of shard " << shard_path << ", error " << rc);
+            mdb_txn_abort(shard_txn);
+            mdb_env_close(shard_env);
+            is_merged = false;
+            break;
+        }
+        rc = mdb_dbi_open(shard_txn, ESEMAN_LOD_DB_NAME, MDB_INTEGERKEY, &shard_lod_dbi);
+        bool has_shard_lod = rc == 0;
+        if (rc && rc != MDB_NOTFOUND) {
+            PRINTLOG("Failed to open pyramids of shard " << shard_path << ", error " << rc);
+            mdb_txn_abort(shard_txn);
+            mdb_env_close(shard_env);
+            is_merged = false;
+            break;
+        }
+
+        const uint64_t id_shift = next_node_id - 1;
+        uint64_t node_count = 0;
+        MDB_val key, data;
+        bool is_copied = mdb_cursor_open(shard_txn, shard_dbi, &cursor) == 0;
+        if (is_copied) {
+            while (is_copied && mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
+                uint64_t shard_node_id;
+                memcpy(&shard_node_id, key.mv_data, sizeof(shard_node_id));
+                is_copied = putRebasedNode(shard_node_id + id_shift, (const char*)data.mv_data, data.mv_size, id_shift);
+                next_node_id = shard_node_id + id_shift + 1;
+                node_count++;
+            }
+            mdb_cursor_close(cursor);
+        }
+
+        // attributes records follow their nodes' ids
+        if (is_copied && (is_copied = mdb_cursor_open(shard_txn, shard_attributes_dbi, &cursor) == 0)) {
+            while (is_copied && mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
+                uint64_t shard_node_id;
+                memcpy(&shard_node_id, key.mv_data, sizeof(shard_node_id));
+                is_copied = putNodeAttributes(shard_node_id + id_shift, (const char*)data.mv_data, data.mv_size);
+            }
+            mdb_cursor_close(cursor);
+        }
+
+        // pyramids are keyed by track index, which is the same in every shard
+        if (is_copied && has_shard_lod && (is_copied = mdb_cursor_open(shard_txn, shard_lod_dbi, &cursor) == 0)) {
+            while (is_copied && mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
+                uint64_t track_index;
+                memcpy(&track_index, key.mv_data, sizeof(track_index));
+                is_copied = putTrackLOD(track_index, string((const char*)data.mv_data, data.mv_size));
+            }
+            mdb_cursor_close(cursor);
+        }
+        mdb_txn_abort(shard_txn);
+        mdb_env_close(shard_env);
+        if (!is_copied) {
+            PRINTLOG("Failed to copy shard of task " << t);
+            is_merged = false;
+            break;
+        }
+
+        if (merged_root_ids.size() < shard_root_ids.size()) merged_root_ids.resize(shard_root_ids.size(), ESEMAN_NULL_NODE_ID);
+        for (size_t i = 0; i < shard_root_ids.size(); ++i) {
+            if (shard_root_ids[i] != ESEMAN_NULL_NODE_ID) merged_root_ids[i] = shard_root_ids[i] + id_shift;
+        }
+        PRINTLOG("Merged shard of task " << t << " with " << node_count << " nodes");
+    }
+    ESEMAN_TASK_ID = task_id;
+    if (!is_merged) abortWriteTxn();
+    if (!closeBulkLoadLMDB()) is_merged = false;
+
+    // a failed merge leaves no dataset behind, so it can simply be run again
+    if (!is_merged) {
+        error_code ec;
+        filesystem::remove(dataset_path + "/" + ESEMAN_LMDB_FILE_NAME, ec);
+        filesystem::remove(dataset_path + "/" + ESEMAN_LMDB_FILE_NAME + "-lock", ec);
+        return false;
+    }
+
+    ESEMAN_TASK_COUNT = 0;
+    writeRootIds(ESEMAN_ROOT_IDS_FILE_NAME, merged_root_ids);
+    ESEMAN_TASK_COUNT = task_count;
+    eseman_root_ids = merged_root_ids;
+    return true;
+}
+
+void EseManKDT::deleteFromLMDB(uint64_t node_id) {
+    if (node_id == ESEMAN_NULL_NODE_ID) return;
 
     MDB_val key;
     if(!openWritePermLMDB())return;
 
     // Set the key to delete
-    key.mv_size = uuid.length();
-    key.mv_data = (void*)uuid.c_str();
+    key.mv_size = sizeof(node_id);
+    key.mv_data = (void*)&node_id;
 
     // Attempt deletion
     int rc = mdb_del(txn, dbi, &key, nullptr);
+    if (rc == 0) mdb_del(txn, attributes_dbi, &key, nullptr);
 
     if (rc == MDB_NOTFOUND) {
         PRINTLOG("Key not found.");
@@ -1059,104 +1806,319 @@ void EseManKDT::deleteFromLMDB(const string& uuid) {
 
     closeWritePermLMDB();
 }
-void EseManKDT::saveNodeToLMDB(const EsemanNode* node) {
-    if (!node) return;
 
-    MDB_val key, data;
-    int rc;
+// levels of descendants stored inline, every that many levels of a track's tree. The 2D tree is walked
+// with track ranges and keeps plain binary nodes.
+uint8_t EseManKDT::inlineLevels() const {
+    if (is_vertical_split) return 0;
+    uint8_t levels = 0;
+    for (size_t fanout = min<size_t>(ESEMAN_NODE_FANOUT, ESEMAN_MAX_NODE_FANOUT); fanout >= 2; fanout >>= 1) levels++;
+    return levels;
+}
+
+// intervals packed into one leaf bucket, buckets are only used for the per track trees
+size_t EseManKDT::leafBucketSize() const {
+    return is_vertical_split ? 0 : ESEMAN_LEAF_BUCKET_SIZE;
+}
 
-    // Serialize node data
-    ostringstream oss;
-    oss << doubleToStringZeroPrecision(node->start_time) << " " 
-        << doubleToStringZeroPrecision(node->end_time) << " "
-        << node->start_track << " " << node->end_track << "\n";
+// Serializes a node whose children are already in out and hands its summary to the parent.
+// The attribute sets are moved into the summary, the node itself is freed.
+EsemanNodeSummary EseManKDT::finishNode(EsemanNode* node, EsemanNodeBuffer& out) {
+    EsemanNodeSummary summary;
+    serializeNode(node, out);
+    summary.id = node->id;
+    summary.start_time = node->start_time;
+    summary.end_time = node->end_time;
+    summary.attribute_lists = std::move(node->attribute_lists);
+    if (inlineLevels()) {
+        uint64_t id = node->id;
+        if (!node->bucket.empty()) id |= ESEMAN_INLINE_BUCKET;
+        else if (node->left_child == ESEMAN_NULL_NODE_ID && node->right_child == ESEMAN_NULL_NODE_ID) id |= ESEMAN_INLINE_LEAF;
+        summary.subtree.assign(1, EsemanInlineChild{(int64_t)node->start_time, (int64_t)node->end_time, id});
+    }
+    delete node;
+    return summary;
+}
 
-    // Serialize attributes
-    oss << node->attribute_lists.size() << "\n";
+// Appends the node to the buffer and gives it the next local id. Nodes are serialized children first,
+// so local ids are increasing in post order until layoutNodes reorders the finished tree.
+void EseManKDT::serializeNode(EsemanNode* node, EsemanNodeBuffer& out) {
+    if (!node) return;
+    node->id = out.size() + 1;
+    out.offsets.push_back(out.bytes.size());
+    out.attribute_offsets.push_back(out.attribute_bytes.size());
+
+    // Serialize the fixed size header
+    EsemanNodeHeader header;
+    memset(&header, 0, sizeof(header));
+    header.version = ESEMAN_NODE_FORMAT_VERSION;
+    header.attribute_count = (uint16_t)node->attribute_lists.size();
+    header.start_time = (int64_t)node->start_time;
+    header.end_time = (int64_t)node->end_time;
+    header.start_track = node->start_track;
+    header.end_track = node->end_track;
+    header.left_child = node->left_child;
+    header.right_child = node->right_child;
+    if (node->left_child != ESEMAN_NULL_NODE_ID) header.flags |= ESEMAN_NODE_HAS_LEFT;
+    if (node->right_child != ESEMAN_NULL_NODE_ID) header.flags |= ESEMAN_NODE_HAS_RIGHT;
+    if (!node->inline_children.empty()) header.inline_levels = inlineLevels();
+    header.bucket_intervals = (uint32_t)node->bucket.primitives.size();
+    out.bytes.append((const char*)&header, sizeof(header));
+    out.bytes.append((const char*)node->inline_children.data(), node->inline_children.size() * sizeof(EsemanInlineChild));
+
+    // the bucket's interleaved times are split into a start and an end column
+    for (size_t i = 0; i < node->bucket.size(); i += 2) out.bytes.append((const char*)&node->bucket.times[i], sizeof(int64_t));
+    for (size_t i = 1; i < node->bucket.size(); i += 2) out.bytes.append((const char*)&node->bucket.times[i], sizeof(int64_t));
+
+    // the rest goes into the node's attributes record
+    out.attribute_bytes.append((const char*)node->bucket.primitives.data(), node->bucket.primitives.size() * sizeof(uint32_t));
+    out.attribute_bytes.append((const char*)node->bucket.ids.data(), node->bucket.ids.size() * sizeof(uint32_t));
+
+    // Serialize attributes as bitmaps the view can look values up in without decoding them
     for (const auto& attr : node->attribute_lists) {
-        oss << attr.first << " " << attr.second.size() << "\n";
-        for (int val : attr.second) {
-            oss << val << " ";
+        uint8_t key_length = (uint8_t)attr.first.length();
+        out.attribute_bytes.append((const char*)&key_length, sizeof(key_length));
+        out.attribute_bytes.append(attr.first.c_str(), key_length);
+        attr.second.serialize(out.attribute_bytes);
+    }
+}
+
+// Writes a built subtree into LMDB and sets root_id to the global id of its root, false when a put fails.
+// The node at position i of the layout (local id i without one) becomes next_node_id + i - 1 and child
+// references are renumbered the same way, so the keys stay strictly increasing and every put can use MDB_APPEND.
+bool EseManKDT::appendNodesToLMDB(const EsemanNodeBuffer& nodes, uint64_t root_local_id, uint64_t& root_id) {
+    root_id = ESEMAN_NULL_NODE_ID;
+    if (root_local_id == ESEMAN_NULL_NODE_ID || nodes.size() == 0) return true;
+    const uint64_t id_shift = next_node_id - 1;
+    const bool has_layout = nodes.layout_order.size() == nodes.size();
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        size_t local = has_layout ? nodes.layout_order[i] - 1 : i;
+        size_t record_end = local + 1 < nodes.size() ? nodes.offsets[local + 1] : nodes.bytes.size();
+        size_t attributes_end = local + 1 < nodes.size() ? nodes.attribute_offsets[local + 1] : nodes.attribute_bytes.size();
+        if (!putNodeAttributes(next_node_id, nodes.attribute_bytes.data() + nodes.attribute_offsets[local],
+                               attributes_end - nodes.attribute_offsets[local])
+            || !putRebasedNode(next_node_id, nodes.bytes.data() + nodes.offsets[local], record_end - nodes.offsets[local], id_shift,
+                               has_layout ? &nodes.layout_ids : nullptr)) {
+            return false;
         }
-        oss << "\n";
+        next_node_id++;
     }
+    root_id = (has_layout ? nodes.layout_ids[root_local_id - 1] : root_local_id) + id_shift;
+    return true;
+}
 
-    // Save child UUIDs
-    oss << node->left_child << "\n";
-    oss << node->right_child << "\n";
+// puts one serialized node under node_id with its child references mapped through layout_ids, if given,
+// and shifted by id_shift
+bool EseManKDT::putRebasedNode(uint64_t node_id, const char* record, size_t record_size, uint64_t id_shift,
+                               const vector<uint64_t>* layout_ids) {
+    if (!txn) return false;
+    MDB_val key, data;
+    node_buffer.assign(record, record_size);
+    auto rebase = [id_shift, layout_ids](uint64_t id) { return (layout_ids ? (*layout_ids)[id - 1] : id) + id_shift; };
 
-    string serialized_data = oss.str();
-    
-    // Store in LMDB
-    key.mv_data = (void*)node->uuid.c_str();
-    key.mv_size = node->uuid.length();
-    data.mv_data = (void*)serialized_data.c_str();
-    data.mv_size = serialized_data.length();
+    uint64_t child_ids[2];
+    memcpy(child_ids, node_buffer.data() + offsetof(EsemanNodeHeader, left_child), sizeof(child_ids));
+    for (uint64_t& child_id : child_ids) {
+        if (child_id != ESEMAN_NULL_NODE_ID) child_id = rebase(child_id);
+    }
+    memcpy(&node_buffer[offsetof(EsemanNodeHeader, left_child)], child_ids, sizeof(child_ids));
+
+    uint8_t inline_levels;
+    memcpy(&inline_levels, node_buffer.data() + offsetof(EsemanNodeHeader, inline_levels), sizeof(inline_levels));
+    size_t inline_end = sizeof(EsemanNodeHeader) + inlineBlockSize(inline_levels);
+    for (size_t offset = sizeof(EsemanNodeHeader); offset < inline_end && inline_end <= node_buffer.size(); offset += sizeof(EsemanInlineChild)) {
+        uint64_t inline_id;
+        memcpy(&inline_id, node_buffer.data() + offset + offsetof(EsemanInlineChild, id), sizeof(inline_id));
+        if ((inline_id & ESEMAN_INLINE_ID_MASK) == ESEMAN_NULL_NODE_ID) continue;
+        inline_id = rebase(inline_id & ESEMAN_INLINE_ID_MASK) | (inline_id & ~ESEMAN_INLINE_ID_MASK);
+        memcpy(&node_buffer[offset + offsetof(EsemanInlineChild, id)], &inline_id, sizeof(inline_id));
+    }
 
-    rc = mdb_put(txn, dbi, &key, &data, 0);
+    key.mv_data = (void*)&node_id;
+    key.mv_size = sizeof(node_id);
+    data.mv_data = (void*)node_buffer.data();
+    data.mv_size = node_buffer.length();
+
+    int rc = mdb_put(txn, dbi, &key, &data, MDB_APPEND);
     if (rc) {
         PRINTLOG("mdb_put failed, error " << rc);
+        abortWriteTxn();
+        return false;
+    }
+
+    if (is_bulk_loading && ESEMAN_BULK_COMMIT_NODES && ++bulk_pending_puts >= ESEMAN_BULK_COMMIT_NODES) {
+        return commitBulkLoadBatch();
     }
+    return true;
 }
-EsemanNode* EseManKDT::loadNodeFromLMDB(const string& uuid) {
-    if (uuid == "NULL" || uuid == "") return nullptr;
 
+// puts the attributes record of node_id, nodes without attributes get none. Node ids only grow, so the
+// attributes database is appended to like the nodes and its puts ride along with the node batches.
+bool EseManKDT::putNodeAttributes(uint64_t node_id, const char* record, size_t record_size) {
+    if (!txn) return false;
+    if (record_size == 0) return true;
     MDB_val key, data;
-    
+    key.mv_data = (void*)&node_id;
+    key.mv_size = sizeof(node_id);
+    data.mv_data = (void*)record;
+    data.mv_size = record_size;
+
+    int rc = mdb_put(txn, attributes_dbi, &key, &data, MDB_APPEND);
+    if (rc) {
+        PRINTLOG("mdb_put failed for attributes, error " << rc);
+        abortWriteTxn();
+        return false;
+    }
+    return true;
+}
+
+// stores the pyramid of a track under its index, the pyramid database is created with the first one
+bool EseManKDT::putTrackLOD(size_t track_index, const string& record) {
+    if (!txn) return false;
     int rc;
+    if (!has_lod_dbi) {
+        rc = mdb_dbi_open(txn, ESEMAN_LOD_DB_NAME, MDB_CREATE | MDB_INTEGERKEY, &lod_dbi);
+        if (rc) {
+            PRINTLOG("mdb_dbi_open failed for " << ESEMAN_LOD_DB_NAME << ", error " << rc);
+            abortWriteTxn();
+            return false;
+        }
+        has_lod_dbi = true;
+    }
+
+    uint64_t track_key = track_index;
+    MDB_val key, data;
+    key.mv_data = (void*)&track_key;
+    key.mv_size = sizeof(track_key);
+    data.mv_data = (void*)record.data();
+    data.mv_size = record.size();
+    rc = mdb_put(txn, lod_dbi, &key, &data, 0);
+    if (rc) {
+        PRINTLOG("mdb_put failed, error " << rc);
+        abortWriteTxn();
+        return false;
+    }
 
-    // Prepare key
-    key.mv_data = (void*)uuid.c_str();
-    key.mv_size = uuid.length();
+    if (is_bulk_loading && ESEMAN_BULK_COMMIT_NODES && ++bulk_pending_puts >= ESEMAN_BULK_COMMIT_NODES) {
+        return commitBulkLoadBatch();
+    }
+    return true;
+}
 
-    // Get data from LMDB
-    rc = mdb_get(txn, dbi, &key, &data);
+// a reset transaction from the pool renewed on the current snapshot, or a new one while all are in use
+MDB_txn* EseManKDT::acquireReadTxn() {
+    MDB_txn* read_txn = nullptr;
+    {
+        lock_guard<mutex> lock(read_txn_mutex);
+        if (!read_txn_pool.empty()) {
+            read_txn = read_txn_pool.back();
+            read_txn_pool.pop_back();
+        }
+    }
+    int rc;
+    if (read_txn) {
+        rc = mdb_txn_renew(read_txn);
+        if (rc) {
+            PRINTLOG("mdb_txn_renew failed, error " << rc);
+            mdb_txn_abort(read_txn);
+            return nullptr;
+        }
+        return read_txn;
+    }
+    rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &read_txn);
     if (rc) {
-        PRINTLOG("mdb_get failed, error " << rc);
+        PRINTLOG("mdb_txn_begin failed, error " << rc);
         return nullptr;
     }
+    return read_txn;
+}
 
-    // Create new node and parse data
-    EsemanNode* node = new EsemanNode();
-    node->uuid = uuid;
+// views read through the transaction are invalid from here on
+void EseManKDT::releaseReadTxn(MDB_txn* read_txn) {
+    if (!read_txn) return;
+    mdb_txn_reset(read_txn);
+    lock_guard<mutex> lock(read_txn_mutex);
+    read_txn_pool.push_back(read_txn);
+}
 
-    string serialized_data((char*)data.mv_data, data.mv_size);
-    istringstream iss(serialized_data);
+EsemanNodeView EseManKDT::getNodeView(MDB_txn* read_txn, uint64_t node_id) {
+    MDB_val key, data;
+    key.mv_data = (void*)&node_id;
+    key.mv_size = sizeof(node_id);
 
-    // Parse node data
-    iss >> node->start_time >> node->end_time 
-        >> node->start_track >> node->end_track;
+    int rc = mdb_get(read_txn, dbi, &key, &data);
+    if (rc) {
+        PRINTLOG("mdb_get failed, error " << rc);
+        return EsemanNodeView();
+    }
+    return EsemanNodeView((const char*)data.mv_data, data.mv_size, node_id);
+}
 
-    // Parse attributes
-    int attr_count;
-    iss >> attr_count;
-    
-    for (int i = 0; i < attr_count; i++) {
-        string key;
-        int size;
-        iss >> key >> size;
-        
-        for (int j = 0; j < size; j++) {
-            int val;
-            iss >> val;
-            node->attribute_lists[key].insert(val);
+// the same for a query, counted in its context and served from the node cache when it is on. A miss reads the
+// record from LMDB and offers a copy to the cache, pinned when the node is within the top pinned levels of its
+// tree. A hit is held by the context until its traversal is done, the view points into the cached copy.
+EsemanNodeView EseManKDT::getNodeView(EsemanKDTQueryContext& context, uint64_t node_id, int depth) {
+    context.leafs_read++;
+    if (!node_cache.enabled()) return getNodeView(context.read_txn, node_id);
+
+    EsemanCachedRecord record = node_cache.find(node_id);
+    if (!record) {
+        context.cache_misses++;
+        EsemanNodeView view = getNodeView(context.read_txn, node_id);
+        if (view.isValid()) {
+            node_cache.insert(node_id, make_shared<const string>(view.rawData(), view.rawSize()),
+                              depth < ESEMAN_NODE_CACHE_PINNED_LEVELS);
         }
+        return view;
+    }
+    context.cache_hits++;
+    context.held_records.push_back(record);
+    return EsemanNodeView(record->data(), record->size(), node_id);
+}
+
+// reads the attributes record of a node only when a filter or an attribute return asks for it
+EsemanAttributeView EseManKDT::getAttributeView(MDB_txn* read_txn, const EsemanNodeView& node) {
+    if (!node.isValid() || (!node.attributeCount() && !node.bucketIntervals())) return EsemanAttributeView();
+    uint64_t node_id = node.id();
+    MDB_val key, data;
+    key.mv_data = (void*)&node_id;
+    key.mv_size = sizeof(node_id);
+
+    int rc = mdb_get(read_txn, attributes_dbi, &key, &data);
+    if (rc) {
+        PRINTLOG("mdb_get failed for attributes, error " << rc);
+        return EsemanAttributeView();
     }
+    return EsemanAttributeView((const char*)data.mv_data, data.mv_size, node);
+}
 
-    // Parse child UUIDs
-    string left_uuid, right_uuid;
-    iss >> left_uuid >> right_uuid;
+EsemanNode* EseManKDT::loadNodeFromLMDB(MDB_txn* read_txn, uint64_t node_id) {
+    if (node_id == ESEMAN_NULL_NODE_ID) return nullptr;
 
-    node->left_child = left_uuid;
-    node->right_child = right_uuid;
-    leafs_read++;
-    // PRINTLOG("Loaded from LMDB with uuid: " << uuid);
+    EsemanNodeView view = getNodeView(read_txn, node_id);
+    if (!view.isValid()) {
+        PRINTLOG("Invalid or outdated node format for id: " << node_id);
+        return nullptr;
+    }
+
+    // Create new node and decode the view
+    EsemanNode* node = new EsemanNode();
+    node->id = node_id;
+    node->start_time = (double)view.startTime();
+    node->end_time = (double)view.endTime();
+    node->start_track = view.startTrack();
+    node->end_track = view.endTrack();
+    if (view.hasLeftChild()) node->left_child = view.leftChild();
+    if (view.hasRightChild()) node->right_child = view.rightChild();
+    // attributes are left in their own database, queries read them through getAttributeView
+    // PRINTLOG("Loaded from LMDB with id: " << node_id);
     return node;
 }
 
 void EseManKDT::cleanNodesFromMemory(bool is_store_existing) {
     if (is_store_existing) {
-        PRINTLOG("eseman uuid size " << eseman_node_uuids.size());
+        PRINTLOG("eseman root id size " << eseman_root_ids.size());
         // since removing the directory is expensive operation, dont do it here.
         // string commands_remove_dir = "cd " + node_storage_base_path + " && rm -rf " + dataset_id + " && mkdir -p " + dataset_id;
         string commands_remove_dir = "cd " + node_storage_base_path + " && mkdir -p " + dataset_id;
@@ -1167,7 +2129,7 @@ void EseManKDT::cleanNodesFromMemory(bool is_store_existing) {
             return;
         }
         // Save event_data_attributes to file
-        ofstream attr_file(dataset_path + "/event_data_attributes.dat");
+        ofstream attr_file(temporaryFileName(dataset_path + "/event_data_attributes.dat"));
         if (attr_file.is_open()) {
             // Write number of attributes
             attr_file << event_data_attributes.size() << "\n";
@@ -1180,30 +2142,32 @@ void EseManKDT::cleanNodesFromMemory(bool is_store_existing) {
                 }
             }
             attr_file.close();
+            commitFile(temporaryFileName(dataset_path + "/event_data_attributes.dat"), dataset_path + "/event_data_attributes.dat");
         }
         // Save event_tracks to file
-        ofstream tracks_file(dataset_path + "/event_tracks.dat");
+        ofstream tracks_file(temporaryFileName(dataset_path + "/event_tracks.dat"));
         if (tracks_file.is_open()) {
             tracks_file << event_tracks.size() << "\n";
             for (size_t i = 0; i < event_tracks.size(); i++) {
                 tracks_file << event_tracks[i] << "\n";
             }
             tracks_file.close();
+            commitFile(temporaryFileName(dataset_path + "/event_tracks.dat"), dataset_path + "/event_tracks.dat");
         }
-        // // Save eseman_node_uuids to file
-        // ofstream uuid_file(dataset_path + "/eseman_node_uuids.dat");
-        // if (uuid_file.is_open()) {
-        //     uuid_file << eseman_node_uuids.size() << "\n";
-        //     for (const auto& uuid : eseman_node_uuids) {
-        //         uuid_file << uuid << "\n";
+        // // Save eseman_root_ids to file
+        // ofstream id_file(dataset_path + "/eseman_root_ids.dat");
+        // if (id_file.is_open()) {
+        //     id_file << eseman_root_ids.size() << "\n";
+        //     for (const auto& c_id : eseman_root_ids) {
+        //         id_file << c_id << "\n";
         //     }
-        //     uuid_file.close();
+        //     id_file.close();
         // }
     }
     event_data_nodes.clear();
     event_data_attributes.clear();
     event_tracks.cleanMemory();
-    // eseman_node_uuids.clear();
+    // eseman_root_ids.clear();
 }
 
 bool EseManKDT::reloadNodesFromFile(bool is_load_attributes) {
@@ -1221,10 +2185,12 @@ bool EseManKDT::reloadNodesFromFile(bool is_load_attributes) {
                 string key;
                 int track_count;
                 attr_file >> key >> track_count;
+                attr_file.ignore(numeric_limits<streamsize>::max(), '\n');
                 event_data_attributes.insert(make_pair(key, StringIndexMapper()));
+                // values are one per line and may contain spaces, the build stores their line order as the index
                 for (int j = 0; j < track_count; j++) {
                     string track;
-                    attr_file >> track;
+                    getline(attr_file, track);
                     event_data_attributes[key].insert(track);
                 }
             }
@@ -1245,32 +2211,23 @@ bool EseManKDT::reloadNodesFromFile(bool is_load_attributes) {
             tracks_file.close();
         }
 
-        // Load eseman_node_uuids from file
-        eseman_node_uuids.clear();
-        ifstream uuid_file(dataset_path + "/eseman_node_uuids.dat");
-        if (uuid_file.is_open()) {
-            int uuid_count;
-            uuid_file >> uuid_count;
-            for (int i = 0; i < uuid_count; i++) {
-                string uuid;
-                uuid_file >> uuid;
-                eseman_node_uuids.push_back(uuid);
-            }
-            uuid_file.close();
-        }
+        // Load eseman_root_ids from file
+        readRootIds(ESEMAN_ROOT_IDS_FILE_NAME, eseman_root_ids);
 
         if(is_load_attributes) {
             // Load each node from file
             event_data_nodes.clear();
-            for (string node_uid : eseman_node_uuids) {
-                EsemanNode* node = findNodeInTimeRange(node_uid, -1, numeric_limits<int64_t>::max(), nullptr);
+            MDB_txn* read_txn = acquireReadTxn();
+            for (uint64_t root_id : eseman_root_ids) {
+                EsemanNode* node = read_txn ? loadNodeFromLMDB(read_txn, root_id) : nullptr;
                 if (node) {
                     event_data_nodes.push_back(node);
-                    // PRINTLOG("Loaded node with Grand root UUID: " << node_uid << " and current UUID: " << node->uuid);
+                    // PRINTLOG("Loaded node with Grand root id: " << root_id << " and current id: " << node->id);
                 } else {
-                    // PRINTLOG("Failed to load node with UUID: " << node_uid << " and current UUID: " << node->uuid);
+                    // PRINTLOG("Failed to load node with root id: " << root_id);
                 }
             }
+            releaseReadTxn(read_txn);
 
             // // Iterate over event_tracks vector
             // for(size_t i = 0; i < (is_vertical_split?1:event_tracks.size()); i++) {
@@ -1288,80 +2245,6 @@ bool EseManKDT::reloadNodesFromFile(bool is_load_attributes) {
     return false;
 }
 
-EsemanNode* EseManKDT::findNodeInTimeRange(string uuid, double s_time, double e_time, EsemanNode* c_root) {
-    EsemanNode* root = c_root;
-    if(!c_root || c_root->uuid != uuid) {
-        root = loadNodeFromLMDB(uuid);
-    }
-    if (!root) return root;
-
-    struct StackItem {
-        EsemanNode* node;
-        string next_uuid;
-        bool is_root;
-    };
-    stack<StackItem> nodeStack;
-    nodeStack.push({root, "", true});
-
-    EsemanNode* result = nullptr;
-    while (!nodeStack.empty()) {
-        auto current = nodeStack.top();
-        nodeStack.pop();
-        EsemanNode* currentNode = current.node;
-
-        if(currentNode->hasLeftChild() && !currentNode->isLeftChildCached()) 
-            currentNode->left_node = loadNodeFromLMDB(currentNode->left_child);
-        if(currentNode->hasRightChild() && !currentNode->isRightChildCached()) 
-            currentNode->right_node = loadNodeFromLMDB(currentNode->right_child);
-
-        if (currentNode->hasLeftChild() && currentNode->left_node->end_time > s_time && 
-            currentNode->hasRightChild() && currentNode->right_node->start_time < e_time) {
-            result = currentNode;
-            break;
-        } 
-        else if (currentNode->hasRightChild() && currentNode->right_node->start_time > e_time) {
-            string next_uuid = currentNode->left_child;
-            EsemanNode* next_node = currentNode->left_node;
-            
-            if(currentNode != c_root && !current.is_root) {
-                next_node = nullptr;
-                delete currentNode;
-            }
-            
-            if(next_node) {
-                nodeStack.push({next_node, "", false});
-            } else {
-                nodeStack.push({loadNodeFromLMDB(next_uuid), "", false});
-            }
-        }
-        else if (currentNode->hasLeftChild() && currentNode->left_node->end_time < s_time) {
-            string next_uuid = currentNode->right_child;
-            EsemanNode* next_node = currentNode->right_node;
-            
-            if(currentNode != c_root && !current.is_root) {
-                next_node = nullptr;
-                delete currentNode;
-            }
-            
-            if(next_node) {
-                nodeStack.push({next_node, "", false});
-            } else {
-                nodeStack.push({loadNodeFromLMDB(next_uuid), "", false});
-            }
-        }
-        else if (s_time < currentNode->start_time && currentNode->end_time < e_time) {
-            result = currentNode;
-            break;
-        }
-        else {
-            result = currentNode;
-            break;
-        }
-    }
-
-    return result;
-}
-
  // four scenarios
 // first, zoom in overlapping range
 // second, zoom out overlapping range
@@ -1533,8 +2416,85 @@ void test_lmdb() {
 
 }
 
+static string concurrent_query_result(EseManKDT* kdt, EsemanKDTQueryContext& context, int query) {
+    vector<string> locations;
+    switch (query % 6) {
+        case 1: context.addPrimitiveFilter("prim3"); break;
+        case 2: context.addIDFilter("49"); break;
+        case 3: return kdt->findNearestEvent(context, query * 10000 + query % 48 * 13 + 100, query % 48);
+        case 4: locations = {"1", "2", "3"}; break;
+    }
+    int64_t time_begin = query % 3 ? 100000 * query : -1;
+    int64_t time_end = query % 3 ? time_begin + 2500000 : -1;
+    auto answer = kdt->binnedRangeQuery(context, time_begin, time_end, locations, 40 + query);
+    string result;
+    for (const auto& [track, bins] : get<0>(answer)) {
+        result += to_string(track) + ":";
+        for (double value : bins) result += value == 1.0 ? '#' : value == 0.5 ? '+' : '.';
+    }
+    return result;
+}
+
+// Queries from eight threads at once, each with its own context, must answer like the same queries one
+// after the other. Meant to run under ThreadSanitizer, see the eseman_kdt_tsan target of the Makefile.
+// 48 tracks spread a query over the query pool, the node cache is on and pins the top levels.
+bool test_concurrent_queries() {
+    string base_path = filesystem::temp_directory_path().string();
+    string dataset_id = "eseman_concurrency_test_" + to_string(getpid());
+    {
+        EseManKDT builder;
+        builder.node_storage_base_path = base_path;
+        builder.setDatasetID(dataset_id);
+        for (int track = 0; track < 48; track++) {
+            for (int i = 0; i < 400; i++) {
+                int64_t start_time = track * 13 + i * 1000;
+                builder.insertDataIntoTree(start_time, start_time + 200 + (i * 37 + track) % 600, to_string(track),
+                                           "prim" + to_string(i % 5), to_string(i % 64));
+            }
+        }
+        if (!builder.buildKDT()) {
+            PRINTLOG("Failed to build the test dataset");
+            return false;
+        }
+    }
+
+    EseManKDT kdt;
+    kdt.node_storage_base_path = base_path;
+    kdt.setDatasetID(dataset_id);
+    kdt.ESEMAN_NODE_CACHE_BYTES = 1 << 20;
+    kdt.ESEMAN_NODE_CACHE_PINNED_LEVELS = 2;
+    kdt.ESEMAN_QUERY_THREADS = 4;
+    if (!kdt.openReadOnlyLMDB() || !kdt.reloadNodesFromFile(true)) return false;
+
+    const int query_count = 24;
+    vector<string> expected(query_count);
+    for (int q = 0; q < query_count; q++) {
+        EsemanKDTQueryContext context;
+        expected[q] = concurrent_query_result(&kdt, context, q);
+    }
+    atomic<int> mismatches(0);
+    vector<thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&, t]() {
+            for (int r = 0; r < 30; r++) {
+                int q = (t * 7 + r * 5) % query_count;
+                EsemanKDTQueryContext context;
+                if (concurrent_query_result(&kdt, context, q) != expected[q]) mismatches++;
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    kdt.closeReadOnlyLMDB();
+
+    error_code ec;
+    filesystem::remove_all(base_path + "/" + dataset_id, ec);
+    cout << "Concurrent queries: " << mismatches << " of 240 differ from the sequential answers" << endl;
+    return mismatches == 0;
+}
+
 #ifdef TESTING
-int main() {
+int main(int argc, char** argv) {
+    if (argc > 1 && string(argv[1]) == "concurrent") return test_concurrent_queries() ? 0 : 1;
     PRINTLOG("hello inside eseman kdt");
     // test_event_tracks();
     // PRINTLOG("Printing resutls from RAM before cleaning");
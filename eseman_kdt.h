@@ -2,36 +2,253 @@
 #define ESEMAN_KDT_H_
 
 #include "eseman_commons.h"
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_generators.hpp>
-#include <boost/uuid/uuid_io.hpp>
+#include "eseman_interval_file.h"
+#include "eseman_node_cache.h"
+#include "eseman_query_pool.h"
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <filesystem>
 
-inline string generate_uuid() {
-  return boost::uuids::to_string(boost::uuids::random_generator()());
+// =======================================
+// Binary node format stored as the LMDB value
+// =======================================
+// Bump the version whenever the layout below changes, old databases need to be re-bundled.
+#define ESEMAN_NODE_FORMAT_VERSION  6
+#define ESEMAN_NULL_NODE_ID         0  // node ids start from 1, 0 marks a missing child
+#define ESEMAN_NODES_DB_NAME        "eseman_nodes"
+#define ESEMAN_ATTRIBUTES_DB_NAME   "eseman_attributes"
+#define ESEMAN_LMDB_FILE_NAME       "eseman.db"
+#define ESEMAN_ROOT_IDS_FILE_NAME   "eseman_root_ids.dat"
+
+#define ESEMAN_NODE_HAS_LEFT        0x01
+#define ESEMAN_NODE_HAS_RIGHT       0x02
+
+#define ESEMAN_MAX_NODE_FANOUT      32
+#define ESEMAN_INLINE_LEAF          (1ULL << 63) // set on the id of an inline descendant without children
+#define ESEMAN_INLINE_BUCKET        (1ULL << 62) // set on the id of an inline descendant holding a leaf bucket
+#define ESEMAN_INLINE_ID_MASK       (~(ESEMAN_INLINE_LEAF | ESEMAN_INLINE_BUCKET))
+
+// fixed size part of every node, followed by the inline descendants when inline_levels is set and the time
+// columns of the leaf bucket when bucket_intervals is set. Unfiltered queries only need this much, so the
+// attributes are a separate record under the same id in ESEMAN_ATTRIBUTES_DB_NAME: the primitive and ID
+// columns of the leaf bucket, then attribute_count attribute blocks of
+// [uint8 key length][key bytes][serialized EsemanBitmap of the indices]. Nodes without attributes have none.
+#pragma pack(push, 1)
+struct EsemanNodeHeader {
+  uint8_t   version;
+  uint8_t   flags;
+  uint16_t  attribute_count;
+  int64_t   start_time;
+  int64_t   end_time;
+  uint64_t  start_track;
+  uint64_t  end_track;
+  uint64_t  left_child;
+  uint64_t  right_child;
+  uint8_t   inline_levels;
+  uint32_t  bucket_intervals;
+};
+
+// With ESEMAN_NODE_FANOUT, every inline_levels-th level of a track's tree carries its descendants of the
+// next inline_levels levels in heap order (children of entry i at 2i+1 and 2i+2, the node itself being 0
+// and not stored). Traversal reads their spans here and only loads the nodes of the last level it expands.
+// Missing descendants have id 0.
+struct EsemanInlineChild {
+  int64_t   start_time;
+  int64_t   end_time;
+  uint64_t  id;
+};
+#pragma pack(pop)
+
+inline size_t inlineBlockSize(uint8_t inline_levels) {
+  return inline_levels ? (((size_t)2 << inline_levels) - 2) * sizeof(EsemanInlineChild) : 0;
 }
 
+// With ESEMAN_LEAF_BUCKET_SIZE, a subtree of up to that many intervals is stored as a single leaf holding
+// its intervals as columns, bucket_intervals entries each in start time order: int64 start times and int64
+// end times in the node, uint32 primitive indices and uint32 ID indices in its attributes record.
+// The node's attributes are the union of the intervals'.
+inline size_t bucketBlockSize(uint32_t bucket_intervals) {
+  return (size_t)bucket_intervals * 2 * sizeof(int64_t);
+}
+inline size_t bucketAttributeBlockSize(uint32_t bucket_intervals) {
+  return (size_t)bucket_intervals * 2 * sizeof(uint32_t);
+}
+
+// Read only view over a serialized node, pointing straight into MDB_val::mv_data.
+// It never copies or allocates, so it is only valid while the transaction that produced it is alive.
+// LMDB does not align values, every field is read through memcpy.
+class EsemanNodeView {
+private:
+  const char*   data;
+  size_t        size;
+  uint64_t      node_id;
+
+  template<typename T> inline T readAt(size_t offset) const {
+    T value;
+    memcpy(&value, data + offset, sizeof(T));
+    return value;
+  }
+
+public:
+  EsemanNodeView() : data(nullptr), size(0), node_id(ESEMAN_NULL_NODE_ID) {}
+  EsemanNodeView(const char* n_data, size_t n_size, uint64_t n_id) : data(n_data), size(n_size), node_id(n_id) {}
+
+  inline bool isValid() const {
+    return data != nullptr && size >= sizeof(EsemanNodeHeader)
+      && readAt<uint8_t>(offsetof(EsemanNodeHeader, version)) == ESEMAN_NODE_FORMAT_VERSION
+      && size >= bucketOffset() + bucketBlockSize(bucketIntervals());
+  }
+  inline uint64_t id() const { return node_id; }
+  inline uint16_t attributeCount() const { return readAt<uint16_t>(offsetof(EsemanNodeHeader, attribute_count)); }
+  inline int64_t startTime() const { return readAt<int64_t>(offsetof(EsemanNodeHeader, start_time)); }
+  inline int64_t endTime() const { return readAt<int64_t>(offsetof(EsemanNodeHeader, end_time)); }
+  inline size_t startTrack() const { return (size_t)readAt<uint64_t>(offsetof(EsemanNodeHeader, start_track)); }
+  inline size_t endTrack() const { return (size_t)readAt<uint64_t>(offsetof(EsemanNodeHeader, end_track)); }
+  inline bool hasLeftChild() const { return readAt<uint8_t>(offsetof(EsemanNodeHeader, flags)) & ESEMAN_NODE_HAS_LEFT; }
+  inline bool hasRightChild() const { return readAt<uint8_t>(offsetof(EsemanNodeHeader, flags)) & ESEMAN_NODE_HAS_RIGHT; }
+  inline uint64_t leftChild() const { return readAt<uint64_t>(offsetof(EsemanNodeHeader, left_child)); }
+  inline uint64_t rightChild() const { return readAt<uint64_t>(offsetof(EsemanNodeHeader, right_child)); }
+  inline uint8_t inlineLevels() const { return readAt<uint8_t>(offsetof(EsemanNodeHeader, inline_levels)); }
+  // heap_index starts from 1, entry 0 would be the node itself
+  inline EsemanInlineChild inlineChild(size_t heap_index) const {
+    return readAt<EsemanInlineChild>(sizeof(EsemanNodeHeader) + (heap_index - 1) * sizeof(EsemanInlineChild));
+  }
+  inline uint32_t bucketIntervals() const { return readAt<uint32_t>(offsetof(EsemanNodeHeader, bucket_intervals)); }
+  inline size_t bucketOffset() const { return sizeof(EsemanNodeHeader) + inlineBlockSize(inlineLevels()); }
+  // the bucket columns, i below bucketIntervals()
+  inline int64_t bucketStartTime(size_t i) const { return readAt<int64_t>(bucketOffset() + i * sizeof(int64_t)); }
+  inline int64_t bucketEndTime(size_t i) const {
+    return readAt<int64_t>(bucketOffset() + (bucketIntervals() + i) * sizeof(int64_t));
+  }
+  inline const char* rawData() const { return data; }
+  inline size_t rawSize() const { return size; }
+};
+
+// Read only view over a node's attributes record, with the same lifetime rules as EsemanNodeView.
+// The bucket size and attribute count come from the node.
+class EsemanAttributeView {
+private:
+  const char*   data;
+  size_t        size;
+  uint32_t      bucket_intervals;
+  uint16_t      attribute_count;
+
+  template<typename T> inline T readAt(size_t offset) const {
+    T value;
+    memcpy(&value, data + offset, sizeof(T));
+    return value;
+  }
+  EsemanBitmapView findAttribute(const string& key) const;
+
+public:
+  EsemanAttributeView() : data(nullptr), size(0), bucket_intervals(0), attribute_count(0) {}
+  EsemanAttributeView(const char* a_data, size_t a_size, const EsemanNodeView& node)
+    : data(a_data), size(a_size), bucket_intervals(node.bucketIntervals()), attribute_count(node.attributeCount()) {}
+
+  inline bool isValid() const {
+    return data != nullptr && size >= bucketAttributeBlockSize(bucket_intervals);
+  }
+  // the bucket columns, i below the node's bucketIntervals()
+  inline uint32_t bucketPrimitive(size_t i) const { return readAt<uint32_t>(i * sizeof(uint32_t)); }
+  inline uint32_t bucketID(size_t i) const { return readAt<uint32_t>((bucket_intervals + i) * sizeof(uint32_t)); }
+  inline const char* rawData() const { return data; }
+  inline size_t rawSize() const { return size; }
+
+  inline bool hasAttribute(const string& key) const {
+    return findAttribute(key).isValid();
+  }
+  bool hasAttributeValue(const string& key, size_t value) const;
+  bool firstAttributeValue(const string& key, size_t& value) const;
+};
+
+// =======================================
+// Level of detail pyramid stored next to the nodes
+// =======================================
+// With ESEMAN_LOD_BINS, bundling also stores per track the time covered by its intervals (ends inclusive
+// as in the nodes) in bin_count bins of bin_width from origin, followed by the coarser levels down to a
+// single bin, each one halving the bins and doubling their width. The busy times are int64 and the
+// record is keyed by the track index in ESEMAN_LOD_DB_NAME.
+#define ESEMAN_LOD_FORMAT_VERSION   1
+#define ESEMAN_LOD_DB_NAME          "eseman_lod"
+#define ESEMAN_LOD_BINS_PER_QUERY_BIN 4 // least pyramid bins resampled into one query bin
+
+#pragma pack(push, 1)
+struct EsemanLODHeader {
+  uint8_t   version;
+  uint8_t   level_count;
+  int64_t   origin;
+  int64_t   bin_width;  // of the finest level
+  uint64_t  bin_count;  // of the finest level, a power of two
+};
+#pragma pack(pop)
+
+// Read only view over a pyramid record, valid as long as the transaction that produced it.
+class EsemanLODView {
+private:
+  const char*   data;
+  size_t        size;
+
+  template<typename T> inline T readAt(size_t offset) const {
+    T value;
+    memcpy(&value, data + offset, sizeof(T));
+    return value;
+  }
+  inline uint64_t finestBinCount() const { return readAt<uint64_t>(offsetof(EsemanLODHeader, bin_count)); }
+  // the levels before level hold 2 * bin_count - 2 * binCount(level) busy times
+  inline size_t levelOffset(uint8_t level) const {
+    return sizeof(EsemanLODHeader) + (2 * finestBinCount() - 2 * binCount(level)) * sizeof(int64_t);
+  }
+
+public:
+  EsemanLODView() : data(nullptr), size(0) {}
+  EsemanLODView(const char* l_data, size_t l_size) : data(l_data), size(l_size) {}
+
+  inline bool isValid() const {
+    if (data == nullptr || size < sizeof(EsemanLODHeader)) return false;
+    uint64_t bin_count = finestBinCount();
+    return readAt<uint8_t>(offsetof(EsemanLODHeader, version)) == ESEMAN_LOD_FORMAT_VERSION
+      && bin_count && !(bin_count & (bin_count - 1)) && levelCount() && levelCount() < 64
+      && (bin_count >> (levelCount() - 1)) && binWidth(0) > 0
+      && size >= levelOffset(levelCount() - 1) + binCount(levelCount() - 1) * sizeof(int64_t);
+  }
+  inline uint8_t levelCount() const { return readAt<uint8_t>(offsetof(EsemanLODHeader, level_count)); }
+  inline int64_t origin() const { return readAt<int64_t>(offsetof(EsemanLODHeader, origin)); }
+  inline int64_t binWidth(uint8_t level) const { return readAt<int64_t>(offsetof(EsemanLODHeader, bin_width)) << level; }
+  inline uint64_t binCount(uint8_t level) const { return finestBinCount() >> level; }
+  inline int64_t busyTime(uint8_t level, uint64_t bin) const {
+    return readAt<int64_t>(levelOffset(level) + bin * sizeof(int64_t));
+  }
+};
+
 class EsemanNode {
 private:
 public:
-  string        uuid;
+  uint64_t      id;
   double        start_time;
   double        end_time;
   size_t        start_track;
   size_t        end_track;
-  string        left_child;
-  string        right_child;
+  uint64_t      left_child;
+  uint64_t      right_child;
   EsemanNode*   left_node;
   EsemanNode*   right_node;
   AttributeList attribute_lists;
+  vector<EsemanInlineChild> inline_children; // heap entries from 1, only on nodes that store their descendants
+  EventColumns  bucket;                      // intervals of a leaf bucket, empty on other nodes
 
   EsemanNode()
-        : uuid(""), start_time(0), end_time(0), start_track(0), end_track(0),
-          left_child(""), right_child(""), left_node(nullptr), right_node(nullptr) {}
+        : id(ESEMAN_NULL_NODE_ID), start_time(0), end_time(0), start_track(0), end_track(0),
+          left_child(ESEMAN_NULL_NODE_ID), right_child(ESEMAN_NULL_NODE_ID), left_node(nullptr), right_node(nullptr) {}
 
+    // the id is assigned when the node is saved into LMDB
     EsemanNode(double s_time, double e_time, size_t location)
-        : uuid(generate_uuid()), start_time(s_time), end_time(e_time),
+        : id(ESEMAN_NULL_NODE_ID), start_time(s_time), end_time(e_time),
           start_track(location), end_track(location),
-          left_child(""), right_child(""), left_node(nullptr), right_node(nullptr) {}
+          left_child(ESEMAN_NULL_NODE_ID), right_child(ESEMAN_NULL_NODE_ID), left_node(nullptr), right_node(nullptr) {}
 
   ~EsemanNode() {
     // Don't delete children here - let EseManKDT handle deletion
@@ -46,33 +263,108 @@ public:
     return attribute_lists.find(key) != attribute_lists.end();
   }
   void addAttribute(const string& key, const int attr_index);
-  inline bool hasLeftChild() { return !left_child.empty(); }
-  inline bool hasRightChild() { return !right_child.empty(); }
+  void mergeAttributes(AttributeList& child_attributes);
+  inline bool hasLeftChild() { return left_child != ESEMAN_NULL_NODE_ID; }
+  inline bool hasRightChild() { return right_child != ESEMAN_NULL_NODE_ID; }
   inline bool isLeftChildCached() { return left_node != nullptr; }
   inline bool isRightChildCached() { return right_node != nullptr; }
 };
 
+// what a finished subtree hands back to its parent while the tree is being built,
+// so the parent never has to read its children back from LMDB. The id is local to the EsemanNodeBuffer.
+struct EsemanNodeSummary {
+  uint64_t      id = ESEMAN_NULL_NODE_ID;
+  double        start_time = 0;
+  double        end_time = 0;
+  AttributeList attribute_lists;
+  vector<EsemanInlineChild> subtree; // the node and its descendants in heap order, inline_levels levels deep
+};
+
+// Serialized nodes of one built tree in post order. Ids inside the buffer are local (1..size()),
+// including the child references, and are rebased by the single LMDB writer when the buffer is appended.
+// Once the tree is complete its builder lays it out in van Emde Boas order, so the writer assigns the ids
+// in that order instead.
+struct EsemanNodeBuffer {
+  string            bytes;
+  vector<size_t>    offsets;      // record with local id i starts at offsets[i-1]
+  string            attribute_bytes;
+  vector<size_t>    attribute_offsets; // attributes record of local id i, empty when the next one starts there too
+  vector<uint64_t>  layout_order; // local ids in the order they are written, empty for post order
+  vector<uint64_t>  layout_ids;   // position of local id i in layout_order at [i-1], counted from 1
+
+  inline uint64_t size() const { return offsets.size(); }
+  inline uint64_t memoryBytes() const {
+    return bytes.capacity() + attribute_bytes.capacity() + (offsets.capacity() + attribute_offsets.capacity()) * sizeof(size_t)
+      + (layout_order.capacity() + layout_ids.capacity()) * sizeof(uint64_t);
+  }
+};
+
+// A piece of one track's columns in a spill run, written while ingesting under ESEMAN_BUNDLE_MEMORY_BUDGET.
+// The times start at offset, the primitive and ID indices follow them.
+#define ESEMAN_INTERVAL_COLUMN_BYTES (2 * sizeof(int64_t) + 2 * sizeof(uint32_t))
+// Estimated peak bytes per interval of a track being built: its columns next to either the radix sort's keys,
+// order and sorted copy (about 80 bytes with the columns) or the node buffer of about two nodes per interval
+// with their attribute records (about 310 bytes), whichever is larger.
+#define ESEMAN_TRACK_BUILD_BYTES 384
+struct SpilledSegment {
+  size_t        run;
+  uint64_t      offset;
+  uint64_t      interval_count;
+};
+
+struct EsemanTraversalItem {
+  EsemanNodeView  node;
+  int             depth;
+  uint16_t        inline_index; // 0 for the node itself, else the descendant stored inline in node
+};
+
+#define ESEMAN_QUERY_TRACKS_PER_THREAD 16 // a query takes another pool thread only for this many tracks
+
+// Query state of the KD-Tree on top of the filters and counters. The traversal stack is reused across the
+// context's queries so traversal does not allocate, held_records keeps the node cache entries behind the views
+// of the running traversal alive.
+struct EsemanKDTQueryContext : public EsemanQueryContext {
+  vector<EsemanTraversalItem>   traversal_stack;
+  vector<EsemanCachedRecord>    held_records;
+  int                           cache_hits = 0;   // node cache lookups of the query, only counted while it is on
+  int                           cache_misses = 0;
+  MDB_txn*                      read_txn = nullptr; // taken from the model's pool for the duration of one query
+
+  EsemanKDTQueryContext() {}
+  EsemanKDTQueryContext(const EsemanKDTQueryContext&) = delete;
+  EsemanKDTQueryContext& operator=(const EsemanKDTQueryContext&) = delete;
+};
+
 class EseManKDT {
 private:
   StringIndexMapper                event_tracks;
-  vector<EventDictList>            event_data_values;
-  vector<EsemanNode*>              event_data_nodes;
-  vector<string>                   eseman_node_uuids;
+  vector<EventColumns>             event_data_values;
+  vector<EsemanNode*>              event_data_nodes; // the root of every track, children are read per query
+  vector<uint64_t>                 eseman_root_ids;
   AttributeDict                    event_data_attributes;
-  string                           return_attribute_key = "";
-  bool                             has_return_attribute_key = false;
-  bool                             has_filter_query = false;
-  EventDictList                    filters;
-  int                              max_depth_reached;
-  int                              leafs_read;
-  int                              nodes_visited;
+  EsemanKDTQueryContext            default_context; // for callers on a single thread that use the filter methods below
   string                           dataset_id = "default_dataset";
+  string                           node_buffer;     // reused record buffer for appendNodesToLMDB
+  vector<vector<SpilledSegment>>   spilled_segments; // per track, in ingest order
+  vector<int>                      spill_run_fds;    // runs are unlinked when created and go away when closed
+  uint64_t                         resident_column_bytes = 0;
+  bool                             has_spill_failed = false; // buildKDT refuses to build after a failed spill
 
   MDB_env                         *env;
   MDB_dbi                         dbi;
-  MDB_txn                         *txn;
+  MDB_dbi                         attributes_dbi;
+  MDB_dbi                         lod_dbi;
+  bool                            has_lod_dbi = false;
+  MDB_txn                         *txn = nullptr; // the write transaction, reads go through read_txn_pool
+  vector<MDB_txn*>                read_txn_pool;  // reset read transactions, renewed when a reader takes one
+  mutex                           read_txn_mutex;
+  EsemanNodeCache                 node_cache;     // shared by the queries of every thread
+  EsemanQueryPool                 query_pool;     // helpers of queries over many tracks, started with the read side
+  uint64_t                        next_node_id = 1;
+  bool                            is_bulk_loading = false;
+  uint64_t                        bulk_pending_puts = 0;
 
-  bool openLMDBENV() {
+  bool openLMDBENV(const string& file_name = ESEMAN_LMDB_FILE_NAME, unsigned int env_flags = 0) {
     int rc = mdb_env_create(&env);
     if (rc) {
         PRINTLOG("mdb_env_create failed, error " << rc);
@@ -80,9 +372,10 @@ private:
     }
 
     mdb_env_set_mapsize(env, lmdb_database_total_size < 0 ? LMDB_DATABASE_TOTAL_SIZE : lmdb_database_total_size);
+    mdb_env_set_maxdbs(env, LMDB_MAX_DBS);
 
-    string dataset_path = node_storage_base_path + "/" + dataset_id + "/eseman.db";
-    rc = mdb_env_open(env, dataset_path.c_str(), MDB_NOSUBDIR | MDB_NORDAHEAD, 0664);
+    string dataset_path = node_storage_base_path + "/" + dataset_id + "/" + file_name;
+    rc = mdb_env_open(env, dataset_path.c_str(), MDB_NOSUBDIR | MDB_NORDAHEAD | env_flags, 0664);
     if (rc) {
         PRINTLOG("mdb_env_open failed, error " << rc);
         mdb_env_close(env);
@@ -91,8 +384,8 @@ private:
     return true;
   }
 
-  bool openWritePermLMDB() {
-    if(!openLMDBENV()) return false;
+  bool openWritePermLMDB(const string& file_name = ESEMAN_LMDB_FILE_NAME) {
+    if(!openLMDBENV(file_name)) return false;
     int rc = mdb_txn_begin(env, NULL, 0, &txn);
     if (rc) {
         PRINTLOG("mdb_txn_begin failed, error " << rc);
@@ -100,52 +393,170 @@ private:
         return false;
     }
 
-    rc = mdb_dbi_open(txn, NULL, 0, &dbi);
+    rc = mdb_dbi_open(txn, ESEMAN_NODES_DB_NAME, MDB_CREATE | MDB_INTEGERKEY, &dbi);
+    if (!rc) rc = mdb_dbi_open(txn, ESEMAN_ATTRIBUTES_DB_NAME, MDB_CREATE | MDB_INTEGERKEY, &attributes_dbi);
     if (rc) {
         PRINTLOG("mdb_dbi_open failed, error " << rc);
         mdb_txn_abort(txn);
         mdb_env_close(env);
         return false;
     }
+    has_lod_dbi = false; // created by putTrackLOD when the first pyramid is written
+
+    // ids are handed out sequentially, continue after the largest id already in the database
+    MDB_cursor *cursor;
+    MDB_val key, data;
+    next_node_id = 1;
+    if (mdb_cursor_open(txn, dbi, &cursor) == 0) {
+        if (mdb_cursor_get(cursor, &key, &data, MDB_LAST) == 0) {
+            uint64_t last_id;
+            memcpy(&last_id, key.mv_data, sizeof(last_id));
+            next_node_id = last_id + 1;
+        }
+        mdb_cursor_close(cursor);
+    }
     return true;
   }
 
+  void closeLODDbi() {
+    if (has_lod_dbi) mdb_dbi_close(env, lod_dbi);
+    has_lod_dbi = false;
+  }
+
+  // after a failed put or commit the write transaction is gone, every later write fails until it is reopened
+  void abortWriteTxn() {
+    if (txn) mdb_txn_abort(txn);
+    txn = nullptr;
+  }
+
   void closeWritePermLMDB() {
-    mdb_txn_commit(txn);// committing is important here during the write
+    if (txn) mdb_txn_commit(txn);// committing is important here during the write
+    txn = nullptr;
+    mdb_dbi_close(env, dbi);
+    mdb_dbi_close(env, attributes_dbi);
+    closeLODDbi();
+    mdb_env_close(env);
+  }
+
+  // Bulk load keeps one environment and one write transaction open for the whole bundle.
+  // Syncing is turned off while loading and the environment is flushed once on close.
+  bool openBulkLoadLMDB(const string& file_name = ESEMAN_LMDB_FILE_NAME) {
+    if(!openWritePermLMDB(file_name)) return false;
+    mdb_env_set_flags(env, MDB_NOSYNC, 1);
+    is_bulk_loading = true;
+    bulk_pending_puts = 0;
+    return true;
+  }
+
+  // commits the current batch and continues in a fresh write transaction, the dbi handle stays valid
+  // a failed commit frees the transaction, txn is left empty then
+  bool commitBulkLoadBatch() {
+    if (!txn) return false;
+    int rc = mdb_txn_commit(txn);
+    txn = nullptr;
+    if (rc) {
+        PRINTLOG("mdb_txn_commit failed, error " << rc);
+        return false;
+    }
+    bulk_pending_puts = 0;
+    rc = mdb_txn_begin(env, NULL, 0, &txn);
+    if (rc) {
+        PRINTLOG("mdb_txn_begin failed, error " << rc);
+        txn = nullptr;
+        return false;
+    }
+    return true;
+  }
+
+  // false when a write of the bundle failed before or the last batch does not reach the disk
+  bool closeBulkLoadLMDB() {
+    bool is_written = txn != nullptr;
+    if (txn) {
+        int rc = mdb_txn_commit(txn);
+        txn = nullptr;
+        if (rc) {
+            PRINTLOG("mdb_txn_commit failed, error " << rc);
+            is_written = false;
+        }
+    }
+    if (is_written) {
+        int rc = mdb_env_sync(env, 1);
+        if (rc) {
+            PRINTLOG("mdb_env_sync failed, error " << rc);
+            is_written = false;
+        }
+    }
+    is_bulk_loading = false;
     mdb_dbi_close(env, dbi);
+    mdb_dbi_close(env, attributes_dbi);
+    closeLODDbi();
     mdb_env_close(env);
+    return is_written;
   }
 
-  bool checkFilterSatisfied(const EsemanNode* node, const EventDict& filter);
-  bool checkFiltersSatisfied(const EsemanNode* node);
+  bool checkFilterSatisfied(const EsemanAttributeView& attributes, const EventDict& filter);
+  bool checkFiltersSatisfied(const EsemanKDTQueryContext& context, const EsemanNodeView& node);
+  bool checkFiltersSatisfied(const EsemanKDTQueryContext& context, uint32_t primitive_index, uint32_t id_index);
 
-  string constructKDTPerTrack(size_t start_index, size_t end_index, size_t track_index);
-  string constructTwoDKDT(double start_time, double end_time, size_t start_track, size_t end_track, int depth);
-  void printKDTDotRecursive(string uuid, ofstream& dotFile);
+  void addEventAttributes(EsemanNode* node, const EventColumns& events, size_t event_index) const;
+  EsemanNodeSummary constructKDTPerTrack(size_t start_index, size_t end_index, size_t track_index, int depth, EsemanNodeBuffer& out);
+  EsemanNodeSummary constructTwoDKDT(double start_time, double end_time, size_t start_track, size_t end_track, int depth, EsemanNodeBuffer& out);
+  EsemanNodeSummary finishNode(EsemanNode* node, EsemanNodeBuffer& out);
+  uint8_t inlineLevels() const;
+  size_t leafBucketSize() const;
+  bool buildTracksInParallel(size_t start_index, size_t end_index);
+  IntervalOrderStats prepareTrackIntervals(size_t track_index);
+  IntervalOrderStats prepareAllTracks();
+  size_t trackColumns(const string& track);
+  void pushInterval(size_t track_index, int64_t start_time, int64_t end_time, uint32_t primitive_index, uint32_t id_index);
+  void checkMemoryBudget();
+  bool spillTracks();
+  bool loadSpilledTrack(size_t track_index);
+  uint64_t trackIntervalCount(size_t track_index) const;
+  void closeSpillRuns();
+  void printKDTDotRecursive(MDB_txn* read_txn, uint64_t node_id, ofstream& dotFile);
 
-  LocDict binnedRangeQueryAllTracks(int64_t time_begin, 
+  LocDict binnedRangeQueryAllTracks(EsemanKDTQueryContext& context,
+                                            int64_t time_begin, 
                                             int64_t time_end, 
                                             size_t track_begin, 
                                             size_t track_end, uint64_t bins);
-  vector<double> binnedRangeQueryPerTrack(int64_t time_begin, 
+  vector<double> binnedRangeQueryPerTrack(EsemanKDTQueryContext& context,
+                                      int64_t time_begin, 
                                       int64_t time_end,
                                       size_t track_index,
-                                      uint64_t bins,
-                                      EsemanNode* replace_node);
-  void findClusters(int64_t start_t, int64_t end_t, int64_t bin_size, 
-                    EsemanNode* c_node, EsemanNode* replace_node,
+                                      uint64_t bins);
+  void findClusters(EsemanKDTQueryContext& context, int64_t start_t, int64_t end_t, int64_t bin_size, 
+                    EsemanNode* c_node,
                     vector<int64_t> &results, int depth);
+  void scanBucket(EsemanKDTQueryContext& context, const EsemanNodeView& node, int64_t start_t, int64_t end_t, int64_t bin_size,
+                  vector<int64_t> &results, int depth);
+  void buildTrackLOD(size_t track_index, string& record) const;
+  bool putTrackLOD(size_t track_index, const string& record);
+  bool resampleTrackLOD(const EsemanKDTQueryContext& context, size_t track_index, int64_t time_begin, int64_t time_end,
+                        uint64_t bins, vector<double>& results);
   void deleteTree(EsemanNode *node);
 
-  void saveNodeToLMDB(const EsemanNode* node);
-  EsemanNode* loadNodeFromLMDB(const string& uuid);
-  void deleteFromLMDB(const string& uuid);
+  void serializeNode(EsemanNode* node, EsemanNodeBuffer& out);
+  bool appendNodesToLMDB(const EsemanNodeBuffer& nodes, uint64_t root_local_id, uint64_t& root_id);
+  bool putRebasedNode(uint64_t node_id, const char* record, size_t record_size, uint64_t id_shift,
+                      const vector<uint64_t>* layout_ids = nullptr);
+  bool putNodeAttributes(uint64_t node_id, const char* record, size_t record_size);
+  EsemanNode* loadNodeFromLMDB(MDB_txn* read_txn, uint64_t node_id);
+  EsemanNodeView getNodeView(MDB_txn* read_txn, uint64_t node_id);
+  EsemanNodeView getNodeView(EsemanKDTQueryContext& context, uint64_t node_id, int depth);
+  EsemanAttributeView getAttributeView(MDB_txn* read_txn, const EsemanNodeView& node);
+  MDB_txn* acquireReadTxn();
+  void releaseReadTxn(MDB_txn* read_txn);
+  void deleteFromLMDB(uint64_t node_id);
 
-  EsemanNode* findNodeInTimeRange(string uuid, double s_time, double e_time, EsemanNode* c_root);
-  EsemanNode* checkHotNodes(double start_time, double end_time, size_t track_index);
-  void checkNodeAvailability(EsemanNode* c_node, EsemanNode* replace_node);
-  void clearDeepNodesFromCache(EsemanNode* c_node);
-  void writeNodeUuidAtIndex(string uuid, size_t index);
+  EsemanNode* trackRoot(size_t track_index) const;
+  size_t queryHelpersWanted(size_t track_count) const;
+  string shardFileName(const string& file_name) const;
+  string temporaryFileName(const string& path) const;
+  bool commitFile(const string& tmp_path, const string& path) const;
+  bool readRootIds(const string& file_name, vector<uint64_t>& root_ids);
+  void writeRootIds(const string& file_name, const vector<uint64_t>& root_ids);
 
 public:
   int                 horizontal_resolution_divisor = 1;
@@ -153,10 +564,20 @@ public:
   bool                is_vertical_split = false;
   string              node_storage_base_path = ".";
 
-  uint64_t            lmdb_database_total_size = -1; // in bytes, -1 means use default 1GB
+  int64_t             lmdb_database_total_size = -1; // in bytes, -1 means use default 1GB
   string              ESEMAN_SPLITTING_RULE = "FAIR";
   int                 ESEMAN_TASK_COUNT = 0;
   int                 ESEMAN_TASK_ID = 0;
+  uint64_t            ESEMAN_BULK_COMMIT_NODES = 0; // nodes per write transaction while bundling, 0 commits once at the end
+  size_t              ESEMAN_BUILD_THREADS = 0;     // track builder threads while bundling, 0 uses all hardware threads
+  uint64_t            ESEMAN_BUNDLE_MEMORY_BUDGET = 0; // bytes of ingested intervals and tracks being built kept in memory while bundling, 0 keeps all of them
+  size_t              ESEMAN_NODE_FANOUT = 0;       // descendants a node stores inline (2 to 32), 0 keeps plain binary nodes
+  size_t              ESEMAN_LEAF_BUCKET_SIZE = 0;  // intervals packed into one leaf, 0 keeps one leaf per interval
+  uint64_t            ESEMAN_LOD_BINS = 0;          // finest pyramid level bins per track, 0 bundles no pyramid
+  bool                ESEMAN_LOD_QUERIES = false;   // answer coarse unfiltered queries from the pyramid, edge bins can differ from a tree walk
+  uint64_t            ESEMAN_NODE_CACHE_BYTES = 0;  // node records cached for queries across threads, 0 reads every node from LMDB
+  int                 ESEMAN_NODE_CACHE_PINNED_LEVELS = 0; // tree levels from the roots that are never evicted from the cache
+  size_t              ESEMAN_QUERY_THREADS = 0;     // most threads one query uses, its own and the shared pool's, 0 for all hardware threads
   
   EseManKDT() {
       // Constructor logic if needed
@@ -167,34 +588,57 @@ public:
       deleteTree(node);
     }
     event_tracks.cleanMemory();
-    filters.clear();
     event_data_values.clear();
     event_data_nodes.clear();
     event_data_attributes.clear();
-    eseman_node_uuids.clear();
+    eseman_root_ids.clear();
+    closeSpillRuns();
   }
 
+  // Read transactions are not tied to threads (MDB_NOTLS). Every query takes one from read_txn_pool and
+  // resets it when done, so queries on different threads never share a transaction and no snapshot is held
+  // between queries. The database handles are opened once in a transaction that is committed to share them.
   bool openReadOnlyLMDB(){
-    if(!openLMDBENV()) return false;
-    int rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+    if(!openLMDBENV(ESEMAN_LMDB_FILE_NAME, MDB_NOTLS)) return false;
+    MDB_txn *open_txn;
+    int rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &open_txn);
     if (rc) {
         PRINTLOG("mdb_txn_begin failed, error " << rc);
         mdb_env_close(env);
         return false;
     }
 
-    rc = mdb_dbi_open(txn, NULL, 0, &dbi);
+    rc = mdb_dbi_open(open_txn, ESEMAN_NODES_DB_NAME, MDB_INTEGERKEY, &dbi);
+    if (!rc) rc = mdb_dbi_open(open_txn, ESEMAN_ATTRIBUTES_DB_NAME, MDB_INTEGERKEY, &attributes_dbi);
     if (rc) {
         PRINTLOG("mdb_dbi_open failed, error " << rc);
-        mdb_txn_abort(txn);
+        mdb_txn_abort(open_txn);
         mdb_env_close(env);
         return false;
     }
+    // datasets bundled without ESEMAN_LOD_BINS have no pyramid and every query walks the tree
+    has_lod_dbi = mdb_dbi_open(open_txn, ESEMAN_LOD_DB_NAME, MDB_INTEGERKEY, &lod_dbi) == 0;
+    rc = mdb_txn_commit(open_txn);
+    if (rc) {
+        PRINTLOG("mdb_txn_commit failed, error " << rc);
+        mdb_env_close(env);
+        return false;
+    }
+    txn = nullptr;
+    node_cache.configure(ESEMAN_NODE_CACHE_BYTES);
+    size_t query_threads = ESEMAN_QUERY_THREADS > 0 ? ESEMAN_QUERY_THREADS : thread::hardware_concurrency();
+    query_pool.start(query_threads > 1 ? query_threads - 1 : 0);
     return true;
   }
+  // no query may be running
   void closeReadOnlyLMDB() {
-    mdb_txn_abort(txn);
+    query_pool.stop();
+    node_cache.clear();
+    for (MDB_txn* read_txn : read_txn_pool) mdb_txn_abort(read_txn);
+    read_txn_pool.clear();
     mdb_dbi_close(env, dbi);
+    mdb_dbi_close(env, attributes_dbi);
+    closeLODDbi();
     mdb_env_close(env);
   }
 
@@ -205,7 +649,11 @@ public:
     }
   }
   void insertDataIntoTree(double start_time, double end_time, string track, string primitive_name, string interval_id);
-  void buildKDT();
+  void insertIntervalChunk(const IntervalChunk& chunk);
+  void insertIntervalFile(const IntervalFile& file);
+  bool saveIntervalFile(const string& file_name);
+  bool buildKDT();
+  bool mergeShards();
   void printKDTDotPerTrack(size_t track_index);
   void printKDTDot();
 
@@ -213,25 +661,30 @@ public:
   bool reloadNodesFromFile(bool is_load_attributes);
 
   void addPrimitiveFilter(string primitive_filter) {
-    for (const auto& filter : filters) {
-      if(getEventPrimitive(filter) == primitive_filter) return;
-    }
-    filters.push_back(EventDict{{"primitive", primitive_filter}});
+    default_context.addPrimitiveFilter(primitive_filter);
   }
   void addIDFilter(string id_filter) {
-    for (const auto& filter : filters) {
-      if(getEventID(filter) == id_filter) return;
-    }
-    filters.push_back(EventDict{{"ID", id_filter}});
+    default_context.addIDFilter(id_filter);
   }
   void clearPrimitiveFilters() {
-    filters.clear();
+    default_context.clearPrimitiveFilters();
   }
 
-  tuple<LocDict, int64_t, int64_t> binnedRangeQuery(int64_t i_time_begin, int64_t i_time_end, 
+  // queries for concurrent callers, each brings its own context and sets its filters on it
+  tuple<LocDict, int64_t, int64_t> binnedRangeQuery(EsemanKDTQueryContext& context,
+                          int64_t i_time_begin, int64_t i_time_end,
                           vector<string> &locations,
                           uint64_t bins);
-  string findNearestEvent(uint64_t cTime, uint64_t cLocation);
+  string findNearestEvent(EsemanKDTQueryContext& context, uint64_t cTime, uint64_t cLocation);
+
+  tuple<LocDict, int64_t, int64_t> binnedRangeQuery(int64_t i_time_begin, int64_t i_time_end, 
+                          vector<string> &locations,
+                          uint64_t bins) {
+    return binnedRangeQuery(default_context, i_time_begin, i_time_end, locations, bins);
+  }
+  string findNearestEvent(uint64_t cTime, uint64_t cLocation) {
+    return findNearestEvent(default_context, cTime, cLocation);
+  }
 };
 
 #endif
\ No newline at end of file
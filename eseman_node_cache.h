@@ -0,0 +1,134 @@
+#ifndef ESEMAN_NODE_CACHE_H
+#define ESEMAN_NODE_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// =======================================
+// Node records shared by every query
+// =======================================
+// EsemanNodeCache keeps copies of node records keyed by node id, so sessions panning and zooming over the same
+// tracks read the upper levels of the trees from memory instead of walking the LMDB B-tree and faulting its pages
+// in for every query. The ids are spread over ESEMAN_NODE_CACHE_SHARDS shards, each with its own lock and an even
+// part of the byte budget, so threads rarely wait on each other. A shard evicts with CLOCK: a lookup sets the
+// entry's referenced bit, the hand clears set bits and evicts the first entry it finds clear. Pinned entries are
+// never evicted, they hold the top levels of the trees that every query of a track passes through. They take at
+// most half of a shard's budget, further entries asked to be pinned are kept like any other.
+//
+// Records are handed out as shared pointers, a query holds the ones it reads until it is done with their views,
+// so an entry evicted by another thread stays alive until then.
+
+#define ESEMAN_NODE_CACHE_SHARDS            64
+#define ESEMAN_NODE_CACHE_ENTRY_OVERHEAD    96 // bytes per entry on top of the record: slot, index entry, allocations
+
+typedef std::shared_ptr<const std::string> EsemanCachedRecord;
+
+class EsemanNodeCache {
+private:
+  struct Slot {
+    uint64_t            id;
+    EsemanCachedRecord  record;     // empty for a free slot
+    bool                referenced;
+    bool                pinned;
+  };
+  struct Shard {
+    std::mutex                            m;
+    std::unordered_map<uint64_t, size_t>  index; // node id to slot
+    std::vector<Slot>                     slots;
+    std::vector<size_t>                   free_slots;
+    size_t                                hand = 0;
+    uint64_t                              bytes = 0;
+    uint64_t                              pinned_bytes = 0;
+  };
+
+  std::array<Shard, ESEMAN_NODE_CACHE_SHARDS> shards;
+  uint64_t                                    shard_budget = 0;
+
+  inline Shard& shardOf(uint64_t id) { return shards[(id * 0x9E3779B97F4A7C15ULL) >> 58]; }
+  static inline uint64_t entryBytes(const EsemanCachedRecord& record) {
+    return record->size() + ESEMAN_NODE_CACHE_ENTRY_OVERHEAD;
+  }
+
+  // advances the hand until the shard has room for bytes more, gives up after two sweeps when everything left
+  // is pinned or the shard was too small to begin with
+  static bool makeRoom(Shard& shard, uint64_t bytes, uint64_t budget) {
+    size_t sweeps = 2 * shard.slots.size();
+    while (shard.bytes + bytes > budget && sweeps-- > 0) {
+      size_t i = shard.hand;
+      shard.hand = (shard.hand + 1) % shard.slots.size();
+      Slot& slot = shard.slots[i];
+      if (!slot.record || slot.pinned) continue;
+      if (slot.referenced) {
+        slot.referenced = false;
+        continue;
+      }
+      shard.bytes -= entryBytes(slot.record);
+      shard.index.erase(slot.id);
+      slot.record.reset();
+      shard.free_slots.push_back(i);
+    }
+    return shard.bytes + bytes <= budget;
+  }
+
+public:
+  // drops every entry, budget_bytes of 0 turns the cache off. Not safe while queries run.
+  void configure(uint64_t budget_bytes) {
+    clear();
+    shard_budget = budget_bytes / ESEMAN_NODE_CACHE_SHARDS;
+  }
+
+  void clear() {
+    for (Shard& shard : shards) {
+      std::lock_guard<std::mutex> lock(shard.m);
+      shard.index.clear();
+      shard.slots.clear();
+      shard.free_slots.clear();
+      shard.hand = 0;
+      shard.bytes = 0;
+      shard.pinned_bytes = 0;
+    }
+  }
+
+  inline bool enabled() const { return shard_budget > 0; }
+
+  // an empty pointer when the node is not cached
+  EsemanCachedRecord find(uint64_t id) {
+    Shard& shard = shardOf(id);
+    std::lock_guard<std::mutex> lock(shard.m);
+    auto it = shard.index.find(id);
+    if (it == shard.index.end()) return EsemanCachedRecord();
+    Slot& slot = shard.slots[it->second];
+    slot.referenced = true;
+    return slot.record;
+  }
+
+  // keeps record unless the node is already cached or the shard cannot make room for it
+  void insert(uint64_t id, const EsemanCachedRecord& record, bool pinned) {
+    Shard& shard = shardOf(id);
+    uint64_t bytes = entryBytes(record);
+    std::lock_guard<std::mutex> lock(shard.m);
+    if (shard.index.count(id)) return;
+    if (!makeRoom(shard, bytes, shard_budget)) return;
+    if (pinned && shard.pinned_bytes + bytes > shard_budget / 2) pinned = false;
+
+    size_t i;
+    if (!shard.free_slots.empty()) {
+      i = shard.free_slots.back();
+      shard.free_slots.pop_back();
+    } else {
+      i = shard.slots.size();
+      shard.slots.emplace_back();
+    }
+    shard.slots[i] = {id, record, false, pinned};
+    shard.index[id] = i;
+    shard.bytes += bytes;
+    if (pinned) shard.pinned_bytes += bytes;
+  }
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef ESEMAN_QUERY_POOL_H
+#define ESEMAN_QUERY_POOL_H
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// =======================================
+// Threads shared by the queries of all requests
+// =======================================
+// EsemanQueryPool starts its threads once and runs the tasks queries hand to it in submission order. A query
+// registers with beginQuery, which tells it how many helpers it may submit: the pool's threads are split evenly
+// between the queries running at the same time, so a loaded server never runs more query threads than the pool
+// has. The query keeps working on its own thread next to its helpers.
+//
+// EsemanQueryBatch tracks the helpers of one query. A helper that is still queued when the query has finished
+// its work is not needed any more and returns without running, so a query only waits for helpers that started.
+
+class EsemanQueryBatch {
+private:
+  std::mutex               m;
+  std::condition_variable  helper_done;
+  size_t                   running = 0;
+  bool                     is_closed = false;
+
+public:
+  // false when the query has already closed the batch, the helper must not touch the query's state then
+  bool enter() {
+    std::lock_guard<std::mutex> lock(m);
+    if (is_closed) return false;
+    running++;
+    return true;
+  }
+  void leave() {
+    std::lock_guard<std::mutex> lock(m);
+    running--;
+    helper_done.notify_all();
+  }
+  // turns away the helpers that have not started and waits for the running ones
+  void close() {
+    std::unique_lock<std::mutex> lock(m);
+    is_closed = true;
+    helper_done.wait(lock, [&]() { return running == 0; });
+  }
+};
+
+class EsemanQueryPool {
+private:
+  std::vector<std::thread>            threads;
+  std::mutex                          m;
+  std::condition_variable             task_ready;
+  std::deque<std::function<void()>>   tasks;
+  size_t                              active_queries = 0;
+  bool                                is_stopping = false;
+
+public:
+  ~EsemanQueryPool() { stop(); }
+
+  // does nothing while the pool is running
+  void start(size_t thread_count) {
+    std::lock_guard<std::mutex> lock(m);
+    if (!threads.empty()) return;
+    is_stopping = false;
+    for (size_t t = 0; t < thread_count; ++t) {
+      threads.emplace_back([this]() {
+        while (true) {
+          std::function<void()> task;
+          {
+            std::unique_lock<std::mutex> lock(m);
+            task_ready.wait(lock, [&]() { return is_stopping || !tasks.empty(); });
+            if (tasks.empty()) return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+          }
+          task();
+        }
+      });
+    }
+  }
+
+  // runs the queued tasks and joins the threads, no query may be running
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      is_stopping = true;
+      task_ready.notify_all();
+    }
+    for (auto& t : threads) t.join();
+    threads.clear();
+  }
+
+  // registers a query that is about to submit helpers and returns how many it may submit, at most wanted.
+  // Every beginQuery is followed by an endQuery.
+  size_t beginQuery(size_t wanted) {
+    std::lock_guard<std::mutex> lock(m);
+    active_queries++;
+    return std::min(wanted, threads.size() / active_queries);
+  }
+  void endQuery() {
+    std::lock_guard<std::mutex> lock(m);
+    active_queries--;
+  }
+
+  // the helper runs task unless the query closed batch before a thread got to it
+  void submit(const std::shared_ptr<EsemanQueryBatch>& batch, std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(m);
+    tasks.emplace_back([batch, task = std::move(task)]() {
+      if (!batch->enter()) return;
+      task();
+      batch->leave();
+    });
+    task_ready.notify_one();
+  }
+};
+
+#endif